@@ -21,6 +21,20 @@ typedef struct {
     char *iphostname;
     int ipport;
     int num_threads;
+    int num_encode_threads;
+    int max_connections;
+    int request_timeout_prio;
+    int request_timeout;
+    int request_timeout_low;
+    int weight_prio;
+    int weight_request;
+    int weight_low;
+    int weight_dirty;
+    int weight_bulk;
+    int max_queue_age;
+    char *dirty_log;
+    int dirty_log_size;
+    int map_unload_timeout;
     char *tile_dir;
     char *mapnik_plugins_dir;
     char *mapnik_font_dir;
@@ -36,13 +50,28 @@ typedef struct {
     char htcpip[PATH_MAX];
     char tile_dir[PATH_MAX];
     char parameterization[PATH_MAX];
+    char output_format[XMLCONFIG_MAX];
+    int format;
     int tile_px_size;
     double scale_factor;
     int min_zoom;
     int max_zoom;
     int num_threads;
+    int pool_threads;
+    int pool;
 } xmlconfigitem;
 
+/*
+ * Passed to each render thread: the styles, the request queue pool the
+ * thread fetches from and how long a style may go unused before its map
+ * is unloaded again.
+ */
+typedef struct {
+    xmlconfigitem *maps;
+    int pool;
+    int map_unload_timeout;
+} render_thread_config;
+
 
 
 struct request_queue * render_request_queue;
@@ -0,0 +1,35 @@
+#ifndef DIRTY_LOG_H
+#define DIRTY_LOG_H
+
+#include "gen_tile.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * On disk queue of dirty requests. Requests are appended to a ring of fixed
+ * size records in a memory mapped file and handed to the in memory dirty
+ * queue as it has room. A record stays in the log until its tile has been
+ * rendered, so the log is replayed when renderd starts again. An index of the
+ * queued records keeps out duplicates.
+ *
+ * The log is only synced to disk when it is closed, otherwise writing it back
+ * is left to the kernel. It survives renderd exiting or crashing, but records
+ * of the last moments before a power loss or kernel crash may be lost.
+ */
+struct dirty_log;
+
+struct dirty_log * dirty_log_open(const char * path, long capacity);
+void dirty_log_close(struct dirty_log * log);
+
+int dirty_log_append(struct dirty_log * log, const struct item * item);
+int dirty_log_next(struct dirty_log * log, struct item * item);
+void dirty_log_done(struct dirty_log * log, long long logpos);
+long dirty_log_pending(struct dirty_log * log);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -16,9 +16,14 @@ struct item {
     struct protocol req;
     int mx, my;
     int fd;
+    uint64_t id;          // client chosen request id of a version 4 request
+    long long deadline;   // ms since the epoch when the client stops waiting, 0 for none
     struct item *duplicates;
     enum queueEnum inQueue;
     enum queueEnum originatedQueue;
+    int style;            // index of the style in the request queue
+    long long queued;     // ms since the epoch when the request was queued
+    long long logpos;     // record in the dirty log plus one, 0 for none
 };
 
 //int render(Map &m, int x, int y, int z, const char *filename);
@@ -26,6 +31,8 @@ void *render_thread(void *);
 struct item *fetch_request(void);
 void delete_request(struct item *item);
 void render_init(const char *plugins_dir, const char* font_dir, int font_recurse);
+void encode_init(int num_threads);
+void encode_close(void);
 
 #ifdef __cplusplus
 }
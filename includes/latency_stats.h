@@ -0,0 +1,26 @@
+#ifndef LATENCY_STATS_H
+#define LATENCY_STATS_H
+
+#include <stdint.h>
+
+/* Request latencies are recorded in histograms with power of two buckets,
+ * bucket b counting latencies below 2^b microseconds */
+#define LATENCY_BUCKETS 32
+/* Kinds of latencies, depending on how the tile was served */
+#define LATENCY_NONE -1
+#define LATENCY_HIT 0
+#define LATENCY_RENDER 1
+#define LATENCY_TIMEOUT 2
+#define LATENCY_KINDS 3
+
+/* Position of the histogram of a layer and kind in the per layer latency
+ * counters. The layer is the outermost dimension, so the position doesn't
+ * depend on the number of layers the counters were allocated for. */
+#define LATENCY_LAYER_OFFSET(layer, kind) ((((layer) * LATENCY_KINDS) + (kind)) * LATENCY_BUCKETS)
+
+static inline int latency_bucket(uint64_t duration) {
+    int b = (duration == 0) ? 0 : 64 - __builtin_clzll(duration);
+    return (b < LATENCY_BUCKETS) ? b : LATENCY_BUCKETS - 1;
+}
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "config.h"
 #include <stdlib.h>
+#include <stdint.h>
 #include "render_config.h"
 
 #ifdef __cplusplus
@@ -12,6 +13,8 @@ extern "C" {
 
 #define META_MAGIC "META"
 #define META_MAGIC_COMPRESSED "METZ"
+#define META_ETAG_MAGIC "ETAG"
+#define META_FORMAT_MAGIC "FRMT"
     
     struct entry {
         int offset;
@@ -27,6 +30,38 @@ extern "C" {
         // The index offsets are measured from the start of the file
     };
 
+    // Optional extension of the header, directly following the index.
+    // Holds a content hash per tile that is used as its ETag. As the index
+    // offsets skip over it, readers that don't know about it are unaffected.
+    struct meta_etags {
+        char magic[4]; // META_ETAG_MAGIC
+        int count; // METATILE ^ 2
+        uint64_t hash[]; // count entries, in the same order as the index
+    };
+
+#define META_ETAGS_SIZE (sizeof(struct meta_etags) + (sizeof(uint64_t) * (METATILE * METATILE)))
+
+    // Optional extension following the hashes, the format the tiles are
+    // encoded in, so that they can be served with the right Content-Type.
+    struct meta_format {
+        char magic[4]; // META_FORMAT_MAGIC
+        int format; // enum tileFormat
+    };
+
+#define META_FORMAT_SIZE (sizeof(struct meta_format))
+
+    // 64bit FNV-1a hash of the tile data
+    static inline uint64_t meta_tile_hash(const char *data, size_t len) {
+        uint64_t hash = 14695981039346656037ULL;
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+            hash ^= (unsigned char)data[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
 
 #ifdef __cplusplus
 }
@@ -36,12 +71,14 @@ class metaTile {
     metaTile(const std::string &xmlconfig, const std::string &options, int x, int y, int z);
     void clear();
     void set(int x, int y, const std::string &data);
+    void set_format(int format);
     const std::string get(int x, int y);
     int xyz_to_meta_offset(int x, int y, int z);
     void save(struct storage_backend * store);
     void expire_tiles(int sock, char * host, char * uri);
  private:
     int x_, y_, z_;
+    int format_;
     std::string xmlconfig_;
     std::string options_;
     std::string tile[METATILE][METATILE];
@@ -2,6 +2,7 @@
 #define MODTILE_H
 
 #include "store.h"
+#include "latency_stats.h"
 
 /*Size of the delaypool hashtable*/
 #define DELAY_HASHTABLE_SIZE 100057
@@ -27,27 +28,36 @@
 #define VERYOLD 6
 
 
-/* Number of microseconds to camp out on the mutex */
-#define CAMPOUT 10
-/* Maximum number of times we camp out before giving up */
-#define MAXCAMP 10
+/* Number of shards the statistics counters are spread over, to keep
+ * concurrent workers from contending on the same cache lines */
+#define STATS_SHARDS 64
+#define STATS_CACHE_LINE 64
 
 #define DEFAULT_ATTRIBUTION "&copy;<a href=\"http://www.openstreetmap.org/\">OpenStreetMap</a> and <a href=\"http://wiki.openstreetmap.org/wiki/Contributors\">contributors</a>, <a href=\"http://opendatacommons.org/licenses/odbl/\">(ODbL)</a>"
 
+/*
+ * The buckets are kept as the time at which they will be full again
+ * (a "theoretical arrival time"), so that they can be topped up lazily on
+ * access and updated with a single compare and swap. A bucket with a
+ * timestamp in the past is full.
+ */
 typedef struct delaypool_entry {
-	struct in6_addr ip_addr;
-	int available_tiles;
-	int available_render_req;
+	apr_uint64_t ip_tag;
+	apr_time_t tiles_full_at;
+	apr_time_t render_full_at;
 } delaypool_entry;
 
 typedef struct delaypool {
 	delaypool_entry users[DELAY_HASHTABLE_SIZE];
 	in_addr_t whitelist[DELAY_HASHTABLE_WHITELIST_SIZE];
-	apr_time_t last_tile_fillup;
-	apr_time_t last_render_fillup;
-	int locked;
 } delaypool;
 
+/*
+ * One shard of the statistics counters. The shared memory segment holds
+ * STATS_SHARDS of these, each followed by the per layer arrays and padded to
+ * a cache line. Counters are only ever updated with atomic adds and summed up
+ * over all shards when they are read.
+ */
 typedef struct stats_data {
     apr_uint64_t noResp200;
     apr_uint64_t noResp304;
@@ -66,9 +76,12 @@ typedef struct stats_data {
     apr_uint64_t noTotalBufferRetrieval;
     apr_uint64_t zoomBufferRetrievalTime[MAX_ZOOM_SERVER + 1];
     apr_uint64_t noZoomBufferRetrieval[MAX_ZOOM_SERVER + 1];
+    apr_uint64_t latencyZoom[LATENCY_KINDS][MAX_ZOOM_SERVER + 1][LATENCY_BUCKETS];
 
     apr_uint64_t *noResp200Layer;
     apr_uint64_t *noResp404Layer;
+    /* layers x LATENCY_KINDS x LATENCY_BUCKETS, see LATENCY_LAYER_OFFSET */
+    apr_uint64_t *latencyLayer;
 
 } stats_data;
 
@@ -119,12 +132,30 @@ typedef struct {
 	int delaypoolRenderSize;
 	long delaypoolRenderRate;
     int bulkMode;
+    /* baseuri -> layer number, compiled at post config */
+    apr_hash_t *router;
+    int router_maxlen;
 } tile_server_conf;
 
 typedef struct tile_request_data {
 	struct protocol * cmd;
     struct storage_backend * store;
 	int layerNumber;
+    /* Result of the storage lookup, shared between the hooks of a request */
+    int stat_fetched;
+    int tile_fetched;
+    struct stat_info stat;
+    char * tile;
+    int tile_len;
+    int compressed;
+    int slice_fd;
+    off_t slice_offset;
+    char etag[TILE_ETAG_MAX];
+    int format;
+    long fetch_time;
+    const char * fetch_err;
+    /* How the tile was served, for the latency histograms */
+    int latency_kind;
 } tile_request_data;
 
 enum tileState { tileMissing, tileOld, tileVeryOld, tileCurrent };
@@ -1,6 +1,8 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -14,11 +16,22 @@ extern "C" {
  *
  * A client may not bother waiting for a response if the render daemon is too slow
  * causing responses to get slightly out of step with requests.
+ *
+ * ver = 4;
+ *
+ * Commands are sent in frames, a protocol_v4_header followed by count
+ * protocol_v4_tile entries, and len gives the size of the whole frame. Each
+ * tile carries its own command and an id chosen by the client. Responses use
+ * the same framing and echo the id, so many renders can be outstanding on one
+ * connection and complete in any order. A deadline, in milliseconds from when
+ * the request is received, tells the daemon when the client stops waiting.
  */
 #define TILE_PATH_MAX (256)
 #define PROTO_VER (3)
 #define RENDER_SOCKET "/var/run/renderd/renderd.sock"
 #define XMLCONFIG_MAX 41
+#define PROTO_VER_FRAMED (4)
+#define PROTO_FRAME_MAX_TILES (64)
 
 enum protoCmd { cmdIgnore, cmdRender, cmdDirty, cmdDone, cmdNotDone, cmdRenderPrio, cmdRenderBulk, cmdRenderLow };
 
@@ -50,6 +63,27 @@ struct protocol_v2 {
     char xmlname[XMLCONFIG_MAX]; 
 };
 
+struct protocol_v4_header {
+    int ver;
+    uint32_t len;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct protocol_v4_tile {
+    uint64_t id;
+    uint32_t deadline;
+    enum protoCmd cmd;
+    int x;
+    int y;
+    int z;
+    char xmlname[XMLCONFIG_MAX];
+    char mimetype[XMLCONFIG_MAX];
+    char options[XMLCONFIG_MAX];
+};
+
+#define PROTO_FRAME_MAX (sizeof(struct protocol_v4_header) + PROTO_FRAME_MAX_TILES * sizeof(struct protocol_v4_tile))
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,10 +5,14 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include "protocol.h"
 
 int send_cmd(struct protocol * cmd, int fd);
 int recv_cmd(struct protocol * cmd, int fd, int block);
+int parse_cmd(struct protocol * cmd, const char * buf, size_t len);
+int send_frame(struct protocol_v4_tile * tiles, int count, int fd);
+int parse_frame(struct protocol_v4_header * hdr, const char * buf, size_t len);
 
 
 #ifdef __cplusplus
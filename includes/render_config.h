@@ -47,6 +47,11 @@
 // Planet import should touch this file when complete
 #define PLANET_TIMESTAMP "/planet-import-complete"
 
+// How long (in seconds) the planet import timestamp is cached before the file is checked again
+#define PLANET_TIMESTAMP_TTL (30)
+// Number of (tile dir, style) combinations for which the planet import timestamp is cached
+#define PLANET_TIMESTAMP_CACHE_SIZE (64)
+
 // Timeout before giving for a tile to be rendered
 // (This is the default value. Can be overwritten in Apache config with ModTileRequestTimeout.)
 #define REQUEST_TIMEOUT (3)
@@ -56,10 +61,38 @@
 #define MIN(x,y) ((x)<(y)?(x):(y))
 #define MAX(x,y) ((x)>(y)?(x):(y))
 
+// default for the maximum number of client connections to renderd
 #define MAX_CONNECTIONS (2048)
+// Default shares of the render threads the request priorities get when all of them are busy
+#define QUEUE_WEIGHT_PRIO (64)
+#define QUEUE_WEIGHT_REQUEST (32)
+#define QUEUE_WEIGHT_LOW (16)
+#define QUEUE_WEIGHT_DIRTY (4)
+#define QUEUE_WEIGHT_BULK (1)
+// Default number of records in the on disk dirty log
+#define DIRTY_LOG_SIZE (1 << 22)
+// Seconds a style may go unused before a render thread unloads its map
+#define MAP_UNLOAD_TIMEOUT (3600)
+// Seconds before a render thread tries again to load a style that failed to load
+#define MAP_RETRY_DELAY (60)
+// Parameterized copies of a style's map each render thread keeps for reuse
+#define PARAMETERIZED_MAPS_MAX (8)
+// Mapnik output format of styles that don't specify one
+#define OUTPUT_FORMAT "png256"
+// Number of distinct tiles the index of a dedup:// tile store can hold
+#define DEDUP_INDEX_SIZE (1 << 24)
+// Encoded tiles of a single colour kept for reuse
+#define UNIFORM_TILES_MAX (256)
+// Number of events handled per epoll_wait in renderd
+#define EPOLL_MAX_EVENTS (64)
+// Bytes buffered per client connection, enough to hold many pipelined commands
+// and at least one full version 4 frame
+#define CONNECTION_BUFFER_SIZE (16384)
 
 // default for number of rendering threads
 #define NUM_THREADS (4)
+// default for number of threads encoding the tiles of rendered metatiles
+#define NUM_ENCODE_THREADS (4)
 
 // Use this to enable meta-tiles which will render NxN tiles at once
 // Note: This should be a power of 2 (2, 4, 8, 16 ...)
@@ -80,10 +113,9 @@
 #define QUEUE_MAX (1024)
 #define REQ_LIMIT (512)
 #define DIRTY_LIMIT (10000)
-#define HASHIDX_SIZE 22123
 #endif
 
-// Penalty for client making an invalid request (in seconds)
-#define CLIENT_PENALTY (3)
+// Penalty for client making an invalid request (in tiles taken from its delay pool)
+#define CLIENT_PENALTY (100)
 
 #endif
@@ -28,8 +28,6 @@
 extern "C" {
 #endif
 
-#define HASHIDX_SIZE 2213
-
 typedef struct {
     long noDirtyRender;
     long noReqRender;
@@ -37,25 +35,88 @@ typedef struct {
     long noReqLowRender;
     long noReqBulkRender;
     long noReqDroped;
+    long noReqPromoted;
+    long noReqExpired;
+    long noReqWasted;
     long noZoomRender[MAX_ZOOM + 1];
     long timeReqRender;
     long timeReqPrioRender;
     long timeReqLowRender;
     long timeReqBulkRender;
     long timeReqDirty;
+    long timeReqWasted;
     long timeZoomRender[MAX_ZOOM + 1];
 } stats_struct;
 
 struct item_idx {
-    struct item_idx *next;
+    uint64_t hash;
     struct item *item;
 };
 
-struct request_queue {
-    int hashidxSize;
-    struct item reqHead, reqPrioHead, reqLowHead, reqBulkHead, dirtyHead, renderHead;
+// Number of independently locked parts of the pending request index
+#define QUEUE_SHARDS 16
+
+/*
+ * A part of the index of pending requests, covering the items whose hash
+ * falls into it. Its lock also guards the duplicates and the queue state of
+ * those items. Padded so that shards do not share cache lines.
+ */
+struct request_shard {
+    pthread_mutex_t lock;
+    int hashidxSize, hashidxUsed;
     struct item_idx * item_hashidx;
-    int reqNum, reqPrioNum, reqLowNum, reqBulkNum, dirtyNum;
+    char pad[64];
+};
+
+// Number of styles the queue serves in turn, any further styles share the last one
+#define QUEUE_STYLES (XMLCONFIGS_MAX + 1)
+#define QUEUE_ALL_STYLES ((1u << QUEUE_STYLES) - 1)
+
+/*
+ * One priority list, locked on its own. Each style has its own first in first
+ * out list within it, and the styles take turns.
+ */
+struct request_list {
+    pthread_mutex_t lock;
+    struct item heads[QUEUE_STYLES];
+    int styleNum[QUEUE_STYLES];
+    int nextStyle;
+    int num;
+};
+
+/*
+ * Render threads that serve a set of styles, with their own weighted fair
+ * share between the priority lists. Pool 0 serves every style that does not
+ * have a pool of its own.
+ */
+struct request_pool {
+    unsigned int styles;
+    unsigned long long pass[queueRequestLow + 1];
+    unsigned long long vtime;
+};
+
+struct request_queue {
+    struct request_list lists[queueRequestLow + 1];
+    struct request_shard shards[QUEUE_SHARDS];
+    char styles[QUEUE_STYLES - 1][XMLCONFIG_MAX];
+    int numStyles;
+    /*
+     * Weighted fair share of the render threads between the priority lists,
+     * see request_queue_fetch_pool_request
+     */
+    pthread_mutex_t schedLock;
+    int weight[queueRequestLow + 1];
+    struct request_pool pools[QUEUE_STYLES];
+    int stylePool[QUEUE_STYLES];
+    int numPools;
+    long long maxAge;
+    // Dirty requests beyond what the dirty list holds, NULL if not configured
+    struct dirty_log * dirtyLog;
+    struct item * itemSlab;
+    struct item * itemFree;
+    int itemSlabSize;
+    pthread_mutex_t slabLock;
+    int waiting;
     pthread_mutex_t qLock;
     pthread_cond_t qCond;
     stats_struct stats;
@@ -65,7 +126,17 @@ struct request_queue {
 struct request_queue *request_queue_init();
 void request_queue_close(struct request_queue * queue);
 
+void request_queue_add_style(struct request_queue * queue, const char * xmlname);
+int request_queue_add_pool(struct request_queue * queue, const char * xmlname);
+void request_queue_set_weight(struct request_queue * queue, enum protoCmd priority, int weight);
+void request_queue_set_max_age(struct request_queue * queue, int max_age);
+int request_queue_open_dirty_log(struct request_queue * queue, const char * path, long capacity);
+
+struct item *request_queue_alloc_item(struct request_queue * queue);
+void request_queue_free_item(struct request_queue * queue, struct item * item);
+
 struct item *request_queue_fetch_request(struct request_queue * queue);
+struct item *request_queue_fetch_pool_request(struct request_queue * queue, int pool);
 enum protoCmd request_queue_add_request(struct request_queue * queue, struct item * request);
 
 void request_queue_remove_request(struct request_queue * queue, struct item * request, int render_time);
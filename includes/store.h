@@ -14,6 +14,12 @@ extern "C" {
 #define STORE_LOGLVL_WARNING 2
 #define STORE_LOGLVL_ERR 3
 
+/* Size of the buffer receiving a tile's ETag */
+#define TILE_ETAG_MAX 33
+
+    /* Image format the tiles of a metatile are encoded in, as recorded by renderd */
+    enum tileFormat { formatUnknown, formatPng, formatJpeg, formatWebp };
+
     struct stat_info {
         off_t     size;    /* total size, in bytes */
         time_t    atime;   /* time of last access */
@@ -24,6 +30,14 @@ extern "C" {
 
     struct storage_backend {
         int (*tile_read)(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz, int * compressed, char * err_msg);
+        /* Optional: locate a tile without copying it. Returns 0 and an open fd (owned by the caller)
+         * plus the byte range of the tile within it, or a negative value on failure. May be NULL. */
+        int (*tile_read_slice)(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, int * fd, off_t * offset, size_t * len, int * compressed, struct stat_info * sinfo, char * etag, int * format, char * err_msg);
+        /* Combined tile_stat and tile_read in a single pass over the storage. Fills in sinfo
+         * (size < 0 if the tile is missing) and returns the tile size, or a negative value on failure.
+         * etag (TILE_ETAG_MAX long, or NULL) receives the stored ETag of the tile, or an empty string if there is none.
+         * format (or NULL) receives the tileFormat recorded with the tile, or formatUnknown if there is none. */
+        int (*tile_fetch)(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz, int * compressed, struct stat_info * sinfo, char * etag, int * format, char * err_msg);
         struct stat_info (*tile_stat)(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z);
         int (*metatile_write)(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, const char *buf, int sz);
         int (*metatile_delete)(struct storage_backend * store, const char *xmlconfig, int x, int y, int z);
@@ -35,6 +49,13 @@ extern "C" {
     };
 
     void log_message(int log_lvl, const char *format, ...);
+
+    int metatile_etag(const char * meta, size_t len, int meta_offset, char * etag);
+    int metatile_format(const char * meta, size_t len);
+
+    enum tileFormat tile_format(const char * output_format);
+    const char * tile_format_mimetype(int format);
+    const char * tile_format_extension(int format);
     
     struct storage_backend * init_storage_backend(const char * options);
         
@@ -0,0 +1,41 @@
+#ifndef STORE_DEDUP_H
+#define STORE_DEDUP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "store.h"
+
+#define DEDUP_META_MAGIC "METD"
+
+    /*
+     * A metatile of the dedup store only holds where its tiles are in the
+     * pack file of the tile directory. Tiles are appended to the pack once
+     * per content, so identical tiles of any metatile and zoom share the
+     * same data.
+     */
+    struct dedup_entry {
+        uint64_t offset;   // position of the tile data in the pack
+        uint32_t size;
+        uint32_t reserved;
+        uint64_t etag;     // meta_tile_hash of the tile data
+    };
+
+    struct dedup_layout {
+        char magic[4];     // DEDUP_META_MAGIC
+        int count;         // METATILE ^ 2
+        int x, y, z;       // lowest x,y of this metatile, plus z
+        int compressed;
+        int format;        // enum tileFormat of the tiles
+        struct dedup_entry index[]; // count entries, in metatile order
+    };
+
+    struct storage_backend * init_storage_dedup(const char * connection_string);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STORE_DEDUP_H */
@@ -8,10 +8,13 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/un.h>
 #include <poll.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <signal.h>
 #include <string.h>
@@ -25,6 +28,7 @@
 #include "protocol.h"
 #include "protocol_helper.h"
 #include "request_queue.h"
+#include "store.h"
 
 #define PIDFILE "/var/run/renderd/renderd.pid"
 
@@ -38,6 +42,7 @@
 
 #ifndef MAIN_ALREADY_DEFINED
 static pthread_t *render_threads;
+static render_thread_config render_pools[XMLCONFIGS_MAX + 1];
 static pthread_t *slave_threads;
 static struct sigaction sigPipeAction;
 static pthread_t stats_thread;
@@ -68,6 +73,19 @@ static const char *cmdStr(enum protoCmd c)
 
 
 
+static void tile_from_request(struct protocol_v4_tile *tile, struct item *item)
+{
+    memset(tile, 0, sizeof(*tile));
+    tile->id = item->id;
+    tile->cmd = item->req.cmd;
+    tile->x = item->req.x;
+    tile->y = item->req.y;
+    tile->z = item->req.z;
+    strcpy(tile->xmlname, item->req.xmlname);
+    strcpy(tile->mimetype, item->req.mimetype);
+    strcpy(tile->options, item->req.options);
+}
+
 void send_response(struct item *item, enum protoCmd rsp, int render_time) {
     struct protocol *req = &item->req;
     struct item *prev;
@@ -76,20 +94,26 @@ void send_response(struct item *item, enum protoCmd rsp, int render_time) {
 
     while (item) {
         req = &item->req;
-        if ((item->fd != FD_INVALID) && ((req->cmd == cmdRender) || (req->cmd == cmdRenderPrio) || (req->cmd == cmdRenderBulk))) {
+        if ((item->fd != FD_INVALID) && ((req->cmd == cmdRender) || (req->cmd == cmdRenderPrio) || (req->cmd == cmdRenderBulk) ||
+                                         ((req->ver == PROTO_VER_FRAMED) && (req->cmd == cmdRenderLow)))) {
             req->cmd = rsp;
             //fprintf(stderr, "Sending message %s to %d\n", cmdStr(rsp), item->fd);
-            
-            send_cmd(req, item->fd);
-            
+
+            if (req->ver == PROTO_VER_FRAMED) {
+                struct protocol_v4_tile tile;
+                tile_from_request(&tile, item);
+                send_frame(&tile, 1, item->fd);
+            } else {
+                send_cmd(req, item->fd);
+            }
         }
         prev = item;
         item = item->duplicates;
-        free(prev);
+        request_queue_free_item(render_request_queue, prev);
     }
 }
 
-enum protoCmd rx_request(struct protocol *req, int fd)
+static enum protoCmd rx_request_id(struct protocol *req, int fd, uint64_t id, long long deadline)
 {
     struct item  *item;
 
@@ -100,7 +124,7 @@ enum protoCmd rx_request(struct protocol *req, int fd)
     if (req->ver < 3) {
         strcpy(req->mimetype,"image/png"); 
         strcpy(req->options,"");
-    } else if (req->ver != 3) {
+    } else if ((req->ver != 3) && (req->ver != PROTO_VER_FRAMED)) {
         syslog(LOG_ERR, "Bad protocol version %d", req->ver);
         return cmdNotDone;
     }
@@ -114,7 +138,7 @@ enum protoCmd rx_request(struct protocol *req, int fd)
         return cmdNotDone;
     }
 
-    item = (struct item *)malloc(sizeof(*item));
+    item = request_queue_alloc_item(render_request_queue);
     if (!item) {
             syslog(LOG_ERR, "malloc failed");
             return cmdNotDone;
@@ -123,6 +147,19 @@ enum protoCmd rx_request(struct protocol *req, int fd)
     item->req = *req;
     item->duplicates = NULL;
     item->fd = (req->cmd == cmdDirty) ? FD_INVALID : fd;
+    item->id = id;
+    item->deadline = deadline;
+    if ((deadline == 0) && (item->fd != FD_INVALID)) {
+        // Clients that can't tell us how long they wait get the configured timeout
+        int timeout = (req->cmd == cmdRenderPrio) ? config.request_timeout_prio :
+                      (req->cmd == cmdRender) ? config.request_timeout :
+                      (req->cmd == cmdRenderLow) ? config.request_timeout_low : 0;
+        if (timeout > 0) {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            item->deadline = (now.tv_sec + timeout) * 1000LL + now.tv_usec / 1000;
+        }
+    }
 
 #ifdef METATILE
     /* Round down request co-ordinates to the neareast N (should be a power of 2)
@@ -139,6 +176,54 @@ enum protoCmd rx_request(struct protocol *req, int fd)
     return request_queue_add_request(render_request_queue, item);
 }
 
+enum protoCmd rx_request(struct protocol *req, int fd)
+{
+    return rx_request_id(req, fd, 0, 0);
+}
+
+/*
+ * Queue the tiles of a version 4 frame. Tiles that are refused straight away
+ * are answered together in a single frame.
+ */
+static void rx_frame(const char *buf, int count, int fd)
+{
+    struct protocol_v4_tile tiles[PROTO_FRAME_MAX_TILES];
+    struct protocol req;
+    struct timeval now;
+    long long deadline;
+    int i, refused = 0;
+
+    gettimeofday(&now, NULL);
+    for (i = 0; i < count; i++) {
+        struct protocol_v4_tile *tile = &tiles[refused];
+
+        memcpy(tile, buf + i * sizeof(*tile), sizeof(*tile));
+        tile->xmlname[XMLCONFIG_MAX - 1] = 0;
+        tile->mimetype[XMLCONFIG_MAX - 1] = 0;
+        tile->options[XMLCONFIG_MAX - 1] = 0;
+
+        memset(&req, 0, sizeof(req));
+        req.ver = PROTO_VER_FRAMED;
+        req.cmd = tile->cmd;
+        req.x = tile->x;
+        req.y = tile->y;
+        req.z = tile->z;
+        strcpy(req.xmlname, tile->xmlname);
+        strcpy(req.mimetype, tile->mimetype[0] ? tile->mimetype : "image/png");
+        strcpy(req.options, tile->options);
+        deadline = tile->deadline ? (now.tv_sec * 1000LL + now.tv_usec / 1000 + tile->deadline) : 0;
+
+        if ((rx_request_id(&req, fd, tile->id, deadline) == cmdNotDone) && (tile->cmd != cmdDirty)) {
+            tile->cmd = cmdNotDone;
+            refused++;
+        }
+    }
+    if (refused) {
+        syslog(LOG_DEBUG, "DEBUG: Sending NotDone response for %d of %d tiles\n", refused, count);
+        send_frame(tiles, refused, fd);
+    }
+}
+
 void request_exit(void)
 {
   // Any write to the exit pipe will trigger a graceful exit
@@ -148,14 +233,158 @@ void request_exit(void)
   }
 }
 
+/*
+ * State of a client connection, handed to epoll as the event data so that a
+ * connection can be found and dropped in constant time. Received bytes are
+ * buffered until they form complete commands.
+ */
+struct connection {
+    int fd;
+    size_t len;
+    char buf[CONNECTION_BUFFER_SIZE];
+};
+
+static int num_connections = 0;
+
+static void connection_close(struct connection *conn)
+{
+    num_connections--;
+    syslog(LOG_DEBUG, "DEBUG: Connection fd %d closed, now %d left\n", conn->fd, num_connections);
+    request_queue_clear_requests_by_fd(render_request_queue, conn->fd);
+    // Closing the fd also removes it from the epoll set
+    close(conn->fd);
+    free(conn);
+}
+
+/*
+ * Handle the commands waiting on a connection. As the connection is polled
+ * edge triggered, this has to carry on until there is nothing left to read.
+ * Everything available is read in one go and every complete command in the
+ * buffer is handled, an incomplete one is kept until the rest arrives.
+ * Returns -1 if the connection got closed.
+ */
+static int connection_read(struct connection *conn)
+{
+    struct protocol cmd;
+    ssize_t ret;
+    size_t off;
+    int used, ver;
+
+    while (1) {
+        ret = recv(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len, MSG_DONTWAIT);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            syslog(LOG_INFO, "DEBUG: Failed to read cmd on fd %i", conn->fd);
+            return -1;
+        }
+        if (ret == 0) {
+            return -1;
+        }
+        conn->len += ret;
+
+        off = 0;
+        used = 0;
+        while (conn->len - off >= sizeof(int)) {
+            memcpy(&ver, conn->buf + off, sizeof(int));
+            if (ver == PROTO_VER_FRAMED) {
+                struct protocol_v4_header hdr;
+
+                used = parse_frame(&hdr, conn->buf + off, conn->len - off);
+                if (used > 0) {
+                    rx_frame(conn->buf + off + sizeof(hdr), hdr.count, conn->fd);
+                }
+            } else {
+                used = parse_cmd(&cmd, conn->buf + off, conn->len - off);
+                if (used > 0) {
+                    enum protoCmd rsp;
+
+                    syslog(LOG_DEBUG, "DEBUG: Got incoming request with protocol version %i\n", cmd.ver);
+                    rsp = rx_request(&cmd, conn->fd);
+                    if (rsp == cmdNotDone) {
+                        cmd.cmd = rsp;
+                        syslog(LOG_DEBUG, "DEBUG: Sending NotDone response(%d)\n", rsp);
+                        send_cmd(&cmd, conn->fd);
+                    }
+                }
+            }
+            if (used <= 0)
+                break;
+            off += used;
+        }
+        if (used < 0) {
+            return -1;
+        }
+        // Keep the start of an incomplete command for the next read
+        conn->len -= off;
+        if (conn->len && off) {
+            memmove(conn->buf, conn->buf + off, conn->len);
+        }
+    }
+}
+
+static void connection_accept(int epoll_fd, int listen_fd)
+{
+    struct sockaddr_un in_addr;
+    socklen_t in_addrlen;
+    struct epoll_event ev;
+    struct connection *conn;
+    int incoming;
+
+    while (1) {
+        in_addrlen = sizeof(in_addr);
+        incoming = accept(listen_fd, (struct sockaddr *) &in_addr, &in_addrlen);
+        if (incoming < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept()");
+            }
+            return;
+        }
+        if (num_connections >= config.max_connections) {
+            syslog(LOG_WARNING, "Connection limit(%d) reached. Dropping connection\n", config.max_connections);
+            close(incoming);
+            continue;
+        }
+        conn = (struct connection *)malloc(sizeof(struct connection));
+        if (!conn) {
+            syslog(LOG_ERR, "malloc failed");
+            close(incoming);
+            continue;
+        }
+        conn->fd = incoming;
+        conn->len = 0;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, incoming, &ev) < 0) {
+            syslog(LOG_ERR, "Failed to add connection fd %d to epoll: %s\n", incoming, strerror(errno));
+            close(incoming);
+            free(conn);
+            continue;
+        }
+        num_connections++;
+        syslog(LOG_DEBUG, "DEBUG: Got incoming connection, fd %d, number %d\n", incoming, num_connections);
+        // Commands may have arrived before the fd was added to the epoll set
+        if (connection_read(conn) < 0) {
+            connection_close(conn);
+        }
+    }
+}
+
 void process_loop(int listen_fd)
 {
-    int num_connections = 0;
-    int connections[MAX_CONNECTIONS];
     int pipefds[2];
     int exit_pipe_read;
-
-    bzero(connections, sizeof(connections));
+    int epoll_fd;
+    int flags;
+    struct epoll_event ev;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    // The listening socket and the exit pipe are told apart from client
+    // connections by the address of their state
+    struct connection listen_conn, exit_conn;
 
     // A pipe is used to allow the render threads to request an exit by the main process
     if (pipe(pipefds)) {
@@ -165,80 +394,60 @@ void process_loop(int listen_fd)
     exit_pipe_fd = pipefds[1];
     exit_pipe_read = pipefds[0];
 
+    epoll_fd = epoll_create(EPOLL_MAX_EVENTS);
+    if (epoll_fd < 0) {
+        fprintf(stderr, "Failed to create epoll instance: %s\n", strerror(errno));
+        return;
+    }
+
+    // New connections are accepted until EAGAIN, so the socket must not block
+    flags = fcntl(listen_fd, F_GETFL, 0);
+    if ((flags < 0) || (fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+        fprintf(stderr, "setting socket non-block failed\n");
+        close(epoll_fd);
+        return;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    listen_conn.fd = listen_fd;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &listen_conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        fprintf(stderr, "Failed to add listening socket to epoll: %s\n", strerror(errno));
+        close(epoll_fd);
+        return;
+    }
+    exit_conn.fd = exit_pipe_read;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &exit_conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, exit_pipe_read, &ev) < 0) {
+        fprintf(stderr, "Failed to add exit pipe to epoll: %s\n", strerror(errno));
+        close(epoll_fd);
+        return;
+    }
+
     while (1) {
-        struct sockaddr_un in_addr;
-        socklen_t in_addrlen = sizeof(in_addr);
-        fd_set rd;
-        int incoming, num, nfds, i;
-
-        FD_ZERO(&rd);
-        FD_SET(listen_fd, &rd);
-        nfds = listen_fd+1;
-
-        for (i=0; i<num_connections; i++) {
-            FD_SET(connections[i], &rd);
-            nfds = MAX(nfds, connections[i]+1);
-        }
-
-	FD_SET(exit_pipe_read, &rd);
-	nfds = MAX(nfds, exit_pipe_read+1);
-
-        num = select(nfds, &rd, NULL, NULL, NULL);
-        if (num == -1)
-            perror("select()");
-        else if (num) {
-	    if (FD_ISSET(exit_pipe_read, &rd)) {
-	      // A render thread wants us to exit
-	      break;
-	    }
-
-            //printf("Data is available now on %d fds\n", num);
-            if (FD_ISSET(listen_fd, &rd)) {
-                num--;
-                incoming = accept(listen_fd, (struct sockaddr *) &in_addr, &in_addrlen);
-                if (incoming < 0) {
-                    perror("accept()");
-                } else {
-                    if (num_connections == MAX_CONNECTIONS) {
-                        syslog(LOG_WARNING, "Connection limit(%d) reached. Dropping connection\n", MAX_CONNECTIONS);
-                        close(incoming);
-                    } else {
-                        connections[num_connections++] = incoming;
-                        syslog(LOG_DEBUG, "DEBUG: Got incoming connection, fd %d, number %d\n", incoming, num_connections);
-                    }
-                }
-            }
-            for (i=0; num && (i<num_connections); i++) {
-                int fd = connections[i];
-                if (FD_ISSET(fd, &rd)) {
-                    struct protocol cmd;
-                    int ret = 0;
-                    memset(&cmd,0,sizeof(cmd));
-
-                    // TODO: to get highest performance we should loop here until we get EAGAIN
-                    ret = recv_cmd(&cmd, fd, 0);
-                    if (ret < 1) {
-                        int j;
-
-                        num_connections--;
-                        syslog(LOG_DEBUG, "DEBUG: Connection %d, fd %d closed, now %d left\n", i, fd, num_connections);
-                        for (j=i; j < num_connections; j++)
-                            connections[j] = connections[j+1];
-                        request_queue_clear_requests_by_fd(render_request_queue, fd);
-                        close(fd);
-                    } else  {
-                        enum protoCmd rsp = rx_request(&cmd, fd);
-                            
-                        if (rsp == cmdNotDone) {
-                            cmd.cmd = rsp;
-                            syslog(LOG_DEBUG, "DEBUG: Sending NotDone response(%d)\n", rsp);
-                            ret = send_cmd(&cmd, fd);
-                        }
-                    }
-                }
+        int num, i;
+
+        num = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, -1);
+        if (num == -1) {
+            if (errno != EINTR)
+                perror("epoll_wait()");
+            continue;
+        }
+
+        for (i = 0; i < num; i++) {
+            struct connection *conn = (struct connection *)events[i].data.ptr;
+
+            if (conn == &exit_conn) {
+                // A render thread wants us to exit
+                close(epoll_fd);
+                return;
+            } else if (conn == &listen_conn) {
+                connection_accept(epoll_fd, listen_fd);
+            } else if ((events[i].events & (EPOLLERR | EPOLLHUP)) || (connection_read(conn) < 0)) {
+                connection_close(conn);
             }
-        } else {
-            syslog(LOG_ERR, "Select timeout");
         }
     }
 }
@@ -288,6 +497,10 @@ void *stats_writeout_thread(void * arg) {
             fprintf(statfile, "ReqBulkQueueLength: %i\n", reqBulkQueueLength);
             fprintf(statfile, "DirtQueueLength: %i\n", dirtQueueLength);
             fprintf(statfile, "DropedRequest: %li\n", lStats.noReqDroped);
+            fprintf(statfile, "PromotedRequest: %li\n", lStats.noReqPromoted);
+            fprintf(statfile, "ExpiredRequest: %li\n", lStats.noReqExpired);
+            fprintf(statfile, "WastedRequest: %li\n", lStats.noReqWasted);
+            fprintf(statfile, "TimeWasted: %li\n", lStats.timeReqWasted);
             fprintf(statfile, "ReqRendered: %li\n", lStats.noReqRender);
             fprintf(statfile, "TimeRendered: %li\n", lStats.timeReqRender);
             fprintf(statfile, "ReqPrioRendered: %li\n", lStats.noReqPrioRender);
@@ -515,6 +728,7 @@ void *slave_thread(void * arg) {
         }
 
         enum protoCmd ret;
+        // Only the shared pool is forwarded, styles with their own render threads stay here
         struct item *item = request_queue_fetch_request(render_request_queue);
         if (item) {
             struct protocol *req = &item->req;
@@ -811,10 +1025,36 @@ int main(int argc, char **argv)
             }
             strcpy(maps[iconf].parameterization, ini_parameterize);
 
+            /* The mapnik output format the tiles are encoded in, e.g.
+             * png256:z=9, png32, jpeg85 or webp:quality=80
+             */
+            sprintf(buffer, "%s:format", name);
+            char *ini_format = iniparser_getstring(ini, buffer, (char *) OUTPUT_FORMAT);
+            if (strlen(ini_format) >= (XMLCONFIG_MAX - 1)) {
+                fprintf(stderr, "Format too long: %s\n", ini_format);
+                exit(7);
+            }
+            strcpy(maps[iconf].output_format, ini_format);
+            maps[iconf].format = tile_format(ini_format);
+            if (maps[iconf].format == formatUnknown) {
+                fprintf(stderr, "Specified format (%s) for %s is not supported, use png, jpeg or webp\n", ini_format, name);
+                exit(7);
+            }
+
+            /* A style can have render threads of its own, which are
+             * created in addition to the shared ones
+             */
+            sprintf(buffer, "%s:num_threads", name);
+            maps[iconf].pool_threads = iniparser_getint(ini, buffer, 0);
+            if (maps[iconf].pool_threads < 0) {
+                fprintf(stderr, "Specified num_threads (%i) for %s is invalid\n", maps[iconf].pool_threads, name);
+                exit(7);
+            }
+
             /* Pass this information into the rendering threads,
              * as it is needed to configure mapniks number of connections
              */
-            maps[iconf].num_threads = config.num_threads;
+            maps[iconf].num_threads = (maps[iconf].pool_threads > 0) ? maps[iconf].pool_threads : config.num_threads;
 
         } else if (strncmp(name, "renderd", 7) == 0) {
             int render_sec = 0;
@@ -838,6 +1078,48 @@ int main(int argc, char **argv)
             sprintf(buffer, "%s:num_threads", name);
             config_slaves[render_sec].num_threads = iniparser_getint(ini,
                     buffer, NUM_THREADS);
+            sprintf(buffer, "%s:num_encode_threads", name);
+            config_slaves[render_sec].num_encode_threads = iniparser_getint(ini,
+                    buffer, NUM_ENCODE_THREADS);
+            sprintf(buffer, "%s:max_connections", name);
+            config_slaves[render_sec].max_connections = iniparser_getint(ini,
+                    buffer, MAX_CONNECTIONS);
+            sprintf(buffer, "%s:request_timeout_prio", name);
+            config_slaves[render_sec].request_timeout_prio = iniparser_getint(ini,
+                    buffer, 0);
+            sprintf(buffer, "%s:request_timeout", name);
+            config_slaves[render_sec].request_timeout = iniparser_getint(ini,
+                    buffer, 0);
+            sprintf(buffer, "%s:request_timeout_low", name);
+            config_slaves[render_sec].request_timeout_low = iniparser_getint(ini,
+                    buffer, 0);
+            sprintf(buffer, "%s:weight_prio", name);
+            config_slaves[render_sec].weight_prio = iniparser_getint(ini,
+                    buffer, QUEUE_WEIGHT_PRIO);
+            sprintf(buffer, "%s:weight_request", name);
+            config_slaves[render_sec].weight_request = iniparser_getint(ini,
+                    buffer, QUEUE_WEIGHT_REQUEST);
+            sprintf(buffer, "%s:weight_low", name);
+            config_slaves[render_sec].weight_low = iniparser_getint(ini,
+                    buffer, QUEUE_WEIGHT_LOW);
+            sprintf(buffer, "%s:weight_dirty", name);
+            config_slaves[render_sec].weight_dirty = iniparser_getint(ini,
+                    buffer, QUEUE_WEIGHT_DIRTY);
+            sprintf(buffer, "%s:weight_bulk", name);
+            config_slaves[render_sec].weight_bulk = iniparser_getint(ini,
+                    buffer, QUEUE_WEIGHT_BULK);
+            sprintf(buffer, "%s:max_queue_age", name);
+            config_slaves[render_sec].max_queue_age = iniparser_getint(ini,
+                    buffer, 0);
+            sprintf(buffer, "%s:dirty_log", name);
+            config_slaves[render_sec].dirty_log = iniparser_getstring(ini,
+                    buffer, NULL);
+            sprintf(buffer, "%s:dirty_log_size", name);
+            config_slaves[render_sec].dirty_log_size = iniparser_getint(ini,
+                    buffer, DIRTY_LOG_SIZE);
+            sprintf(buffer, "%s:map_unload_timeout", name);
+            config_slaves[render_sec].map_unload_timeout = iniparser_getint(ini,
+                    buffer, MAP_UNLOAD_TIMEOUT);
             sprintf(buffer, "%s:tile_dir", name);
             config_slaves[render_sec].tile_dir = iniparser_getstring(ini,
                     buffer, (char *) HASH_PATH);
@@ -850,6 +1132,20 @@ int main(int argc, char **argv)
                 config.iphostname = config_slaves[render_sec].iphostname;
                 config.ipport = config_slaves[render_sec].ipport;
                 config.num_threads = config_slaves[render_sec].num_threads;
+                config.num_encode_threads = config_slaves[render_sec].num_encode_threads;
+                config.max_connections = config_slaves[render_sec].max_connections;
+                config.request_timeout_prio = config_slaves[render_sec].request_timeout_prio;
+                config.request_timeout = config_slaves[render_sec].request_timeout;
+                config.request_timeout_low = config_slaves[render_sec].request_timeout_low;
+                config.weight_prio = config_slaves[render_sec].weight_prio;
+                config.weight_request = config_slaves[render_sec].weight_request;
+                config.weight_low = config_slaves[render_sec].weight_low;
+                config.weight_dirty = config_slaves[render_sec].weight_dirty;
+                config.weight_bulk = config_slaves[render_sec].weight_bulk;
+                config.max_queue_age = config_slaves[render_sec].max_queue_age;
+                config.dirty_log = config_slaves[render_sec].dirty_log;
+                config.dirty_log_size = config_slaves[render_sec].dirty_log_size;
+                config.map_unload_timeout = config_slaves[render_sec].map_unload_timeout;
                 config.tile_dir = config_slaves[render_sec].tile_dir;
                 config.stats_filename
                         = config_slaves[render_sec].stats_filename;
@@ -871,11 +1167,24 @@ int main(int argc, char **argv)
         syslog(LOG_INFO, "config renderd: unix socketname=%s\n", config.socketname);
     }
     syslog(LOG_INFO, "config renderd: num_threads=%d\n", config.num_threads);
+    syslog(LOG_INFO, "config renderd: num_encode_threads=%d\n", config.num_encode_threads);
+    syslog(LOG_INFO, "config renderd: max_connections=%d\n", config.max_connections);
+    syslog(LOG_INFO, "config renderd: request_timeout=%d/%d/%d (prio/normal/low)\n",
+           config.request_timeout_prio, config.request_timeout, config.request_timeout_low);
+    syslog(LOG_INFO, "config renderd: weights=%d/%d/%d/%d/%d (prio/normal/low/dirty/bulk) max_queue_age=%d\n",
+           config.weight_prio, config.weight_request, config.weight_low, config.weight_dirty, config.weight_bulk,
+           config.max_queue_age);
+    syslog(LOG_INFO, "config renderd: map_unload_timeout=%d\n", config.map_unload_timeout);
     if (active_slave == 0) {
         syslog(LOG_INFO, "config renderd: num_slaves=%d\n", noSlaveRenders);
     }
     syslog(LOG_INFO, "config renderd: tile_dir=%s\n", config.tile_dir);
     syslog(LOG_INFO, "config renderd: stats_file=%s\n", config.stats_filename);
+    if (config.dirty_log != NULL) {
+        syslog(LOG_INFO, "config renderd: dirty_log=%s (%d requests)\n", config.dirty_log, config.dirty_log_size);
+    } else {
+        syslog(LOG_INFO, "config renderd: dirty_log=none\n");
+    }
     syslog(LOG_INFO, "config mapnik:  plugins_dir=%s\n", config.mapnik_plugins_dir);
     syslog(LOG_INFO, "config mapnik:  font_dir=%s\n", config.mapnik_font_dir);
     syslog(LOG_INFO, "config mapnik:  font_dir_recurse=%d\n", config.mapnik_font_dir_recurse);
@@ -903,12 +1212,28 @@ int main(int argc, char **argv)
 
     for(iconf = 0; iconf < XMLCONFIGS_MAX; ++iconf) {
         if (maps[iconf].xmlname[0] != 0) {
-         syslog(LOG_INFO, "config map %d:   name(%s) file(%s) uri(%s) htcp(%s) host(%s)",
+         syslog(LOG_INFO, "config map %d:   name(%s) file(%s) uri(%s) htcp(%s) host(%s) num_threads(%d) format(%s)",
                  iconf, maps[iconf].xmlname, maps[iconf].xmlfile, maps[iconf].xmluri,
-                 maps[iconf].htcpip, maps[iconf].host);
+                 maps[iconf].htcpip, maps[iconf].host, maps[iconf].pool_threads, maps[iconf].output_format);
+         request_queue_add_style(render_request_queue, maps[iconf].xmlname);
+         if (maps[iconf].pool_threads > 0) {
+             maps[iconf].pool = request_queue_add_pool(render_request_queue, maps[iconf].xmlname);
+         }
         }
     }
 
+    request_queue_set_weight(render_request_queue, cmdRenderPrio, config.weight_prio);
+    request_queue_set_weight(render_request_queue, cmdRender, config.weight_request);
+    request_queue_set_weight(render_request_queue, cmdRenderLow, config.weight_low);
+    request_queue_set_weight(render_request_queue, cmdDirty, config.weight_dirty);
+    request_queue_set_weight(render_request_queue, cmdRenderBulk, config.weight_bulk);
+    request_queue_set_max_age(render_request_queue, config.max_queue_age);
+    if ((config.dirty_log != NULL) &&
+        (request_queue_open_dirty_log(render_request_queue, config.dirty_log, config.dirty_log_size) < 0)) {
+        fprintf(stderr, "Failed to open dirty log %s\n", config.dirty_log);
+        exit(7);
+    }
+
     fd = server_socket_init(&config);
 #if 0
     if (fcntl(fd, F_SETFD, O_RDWR | O_NONBLOCK) < 0) {
@@ -951,15 +1276,43 @@ int main(int argc, char **argv)
         syslog(LOG_INFO, "No stats file specified in config. Stats reporting disabled");
     }
 
-    render_threads = (pthread_t *) malloc(sizeof(pthread_t) * config.num_threads);
+    encode_init(config.num_encode_threads);
 
-    for(i=0; i<config.num_threads; i++) {
-        if (pthread_create(&render_threads[i], NULL, render_thread, (void *)maps)) {
+    /* The shared render threads fetch from pool 0, styles with threads of
+     * their own from their pool
+     */
+    k = config.num_threads;
+    for (iconf = 0; iconf < XMLCONFIGS_MAX; ++iconf) {
+        if ((maps[iconf].xmlname[0] != 0) && (maps[iconf].pool > 0)) {
+            k += maps[iconf].pool_threads;
+        }
+    }
+    render_threads = (pthread_t *) malloc(sizeof(pthread_t) * k);
+    render_pools[0].maps = maps;
+    render_pools[0].pool = 0;
+    render_pools[0].map_unload_timeout = config.map_unload_timeout;
+    for (k = 0; k < config.num_threads; k++) {
+        if (pthread_create(&render_threads[k], NULL, render_thread, (void *)&render_pools[0])) {
             fprintf(stderr, "error spawning render thread\n");
             close(fd);
             exit(7);
         }
     }
+    for (iconf = 0; iconf < XMLCONFIGS_MAX; ++iconf) {
+        if ((maps[iconf].xmlname[0] == 0) || (maps[iconf].pool == 0)) {
+            continue;
+        }
+        render_pools[maps[iconf].pool].maps = maps;
+        render_pools[maps[iconf].pool].pool = maps[iconf].pool;
+        render_pools[maps[iconf].pool].map_unload_timeout = config.map_unload_timeout;
+        for (i = 0; i < maps[iconf].pool_threads; i++) {
+            if (pthread_create(&render_threads[k++], NULL, render_thread, (void *)&render_pools[maps[iconf].pool])) {
+                fprintf(stderr, "error spawning render thread\n");
+                close(fd);
+                exit(7);
+            }
+        }
+    }
 
     if (active_slave == 0) {
         //Only the master renderd opens connections to its slaves
@@ -980,6 +1333,7 @@ int main(int argc, char **argv)
 
     process_loop(fd);
 
+    encode_close();
     unlink(config.socketname);
     close(fd);
     return 0;
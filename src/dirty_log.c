@@ -0,0 +1,385 @@
+/*
+ * Copyright © 2013 mod_tile contributors
+ *
+ * This file is part of renderd, a project to render OpenStreetMap tiles
+ * with Mapnik.
+ *
+ * renderd is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * mod_tile is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod_tile.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "render_config.h"
+#include "dirty_log.h"
+
+#define DIRTY_LOG_MAGIC "renderd dirty log 1"
+// The header takes the first page of the file, the records follow
+#define DIRTY_LOG_HEADER (4096)
+
+struct dirty_log_header {
+    char magic[24];
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t capacity;
+    uint64_t head;  // first record that has not been rendered yet
+    uint64_t tail;  // position the next record is written to
+};
+
+struct dirty_record {
+    char xmlname[XMLCONFIG_MAX];
+    char mimetype[XMLCONFIG_MAX];
+    char options[XMLCONFIG_MAX];
+    int z, x, y;
+    int done;
+};
+
+// Positions count up forever, the record of a position is at pos % capacity
+struct dirty_idx {
+    uint64_t hash;
+    uint64_t pos;   // position plus one, 0 for a free slot
+};
+
+struct dirty_log {
+    pthread_mutex_t lock;
+    int fd;
+    size_t map_size;
+    struct dirty_log_header * header;
+    struct dirty_record * records;
+    uint64_t next;  // next record to hand out, between head and tail
+    struct dirty_idx * idx;
+    uint64_t idxSize, idxUsed;
+};
+
+static struct dirty_record * record_at(struct dirty_log * log, uint64_t pos) {
+    return &(log->records[pos % log->header->capacity]);
+}
+
+// Records read back from disk may be damaged, so the strings are checked before use
+static int record_valid(const struct dirty_record * rec) {
+    return (strnlen(rec->xmlname, XMLCONFIG_MAX) < XMLCONFIG_MAX) &&
+           (strnlen(rec->mimetype, XMLCONFIG_MAX) < XMLCONFIG_MAX) &&
+           (strnlen(rec->options, XMLCONFIG_MAX) < XMLCONFIG_MAX);
+}
+
+static uint64_t record_hash(const struct dirty_record * rec) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const unsigned char *c;
+    size_t i, len;
+
+    c = (const unsigned char *)rec->xmlname;
+    len = strnlen(rec->xmlname, XMLCONFIG_MAX);
+    for (i = 0; i < len; i++) {
+        h = (h ^ c[i]) * 0x100000001b3ULL;
+    }
+    h = (h ^ 0xff) * 0x100000001b3ULL;
+    c = (const unsigned char *)rec->options;
+    len = strnlen(rec->options, XMLCONFIG_MAX);
+    for (i = 0; i < len; i++) {
+        h = (h ^ c[i]) * 0x100000001b3ULL;
+    }
+    for (i = 0; i < 4; i++) {
+        h = (h ^ ((rec->z >> (8 * i)) & 0xff)) * 0x100000001b3ULL;
+        h = (h ^ ((rec->x >> (8 * i)) & 0xff)) * 0x100000001b3ULL;
+        h = (h ^ ((rec->y >> (8 * i)) & 0xff)) * 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int same_record(const struct dirty_record * a, const struct dirty_record * b) {
+    return (a->x == b->x) && (a->y == b->y) && (a->z == b->z) &&
+           !strcmp(a->xmlname, b->xmlname) && !strcmp(a->options, b->options);
+}
+
+/*
+ * The index of queued records is an open addressing table with linear
+ * probing, kept at most half full. It only holds records that have not been
+ * rendered yet, so it grows with the backlog rather than with the log.
+ */
+static uint64_t lookup_idx(struct dirty_log * log, const struct dirty_record * rec, uint64_t hash) {
+    uint64_t mask = log->idxSize - 1;
+    uint64_t i;
+
+    for (i = hash & mask; log->idx[i].pos != 0; i = (i + 1) & mask) {
+        if ((log->idx[i].hash == hash) && same_record(rec, record_at(log, log->idx[i].pos - 1))) {
+            return log->idx[i].pos;
+        }
+    }
+    return 0;
+}
+
+static void place_idx(struct dirty_idx * table, uint64_t mask, uint64_t hash, uint64_t pos) {
+    uint64_t i;
+
+    for (i = hash & mask; table[i].pos != 0; i = (i + 1) & mask);
+    table[i].hash = hash;
+    table[i].pos = pos;
+}
+
+static int insert_idx(struct dirty_log * log, uint64_t hash, uint64_t pos) {
+    if (2 * (log->idxUsed + 1) > log->idxSize) {
+        struct dirty_idx * table = (struct dirty_idx *)calloc(2 * log->idxSize, sizeof(struct dirty_idx));
+        uint64_t i;
+
+        if (table == NULL) {
+            return 0;
+        }
+        for (i = 0; i < log->idxSize; i++) {
+            if (log->idx[i].pos != 0) {
+                place_idx(table, 2 * log->idxSize - 1, log->idx[i].hash, log->idx[i].pos);
+            }
+        }
+        free(log->idx);
+        log->idx = table;
+        log->idxSize *= 2;
+    }
+    place_idx(log->idx, log->idxSize - 1, hash, pos + 1);
+    log->idxUsed++;
+    return 1;
+}
+
+static void remove_idx(struct dirty_log * log, uint64_t hash, uint64_t pos) {
+    struct dirty_idx * table = log->idx;
+    uint64_t mask = log->idxSize - 1;
+    uint64_t i, j, home;
+
+    for (i = hash & mask; table[i].pos != pos + 1; i = (i + 1) & mask) {
+        if (table[i].pos == 0) {
+            return;
+        }
+    }
+    log->idxUsed--;
+
+    for (j = (i + 1) & mask; table[j].pos != 0; j = (j + 1) & mask) {
+        home = table[j].hash & mask;
+        if (((j > i) && ((home <= i) || (home > j))) || ((j < i) && (home <= i) && (home > j))) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i].pos = 0;
+}
+
+/*
+ * Open or create the log at path with room for capacity records. Records
+ * left over from a previous run are queued again. The file is created sparse,
+ * so it only takes up disk space for records actually written. The log is
+ * locked, so that two renderds can't share it.
+ */
+struct dirty_log * dirty_log_open(const char * path, long capacity) {
+    struct dirty_log * log;
+    struct dirty_log_header old;
+    uint64_t pos;
+    int replay = 0;
+
+    log = (struct dirty_log *)calloc(1, sizeof(struct dirty_log));
+    if (log == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&(log->lock), NULL);
+    log->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (log->fd < 0) {
+        syslog(LOG_ERR, "Failed to open dirty log %s: %s", path, strerror(errno));
+        dirty_log_close(log);
+        return NULL;
+    }
+    if (flock(log->fd, LOCK_EX | LOCK_NB) < 0) {
+        syslog(LOG_ERR, "Failed to lock dirty log %s, is another renderd using it? %s", path, strerror(errno));
+        dirty_log_close(log);
+        return NULL;
+    }
+
+    memset(&old, 0, sizeof(old));
+    if ((pread(log->fd, &old, sizeof(old), 0) == sizeof(old)) && !strncmp(old.magic, DIRTY_LOG_MAGIC, sizeof(old.magic))) {
+        if ((old.record_size == sizeof(struct dirty_record)) && (old.capacity == capacity) &&
+            (old.head <= old.tail) && (old.tail - old.head <= old.capacity)) {
+            replay = 1;
+        } else {
+            syslog(LOG_WARNING, "Dirty log %s has a different layout, starting a new one", path);
+        }
+    }
+
+    log->map_size = DIRTY_LOG_HEADER + capacity * sizeof(struct dirty_record);
+    if (ftruncate(log->fd, log->map_size) < 0) {
+        syslog(LOG_ERR, "Failed to size dirty log %s: %s", path, strerror(errno));
+        dirty_log_close(log);
+        return NULL;
+    }
+    log->header = (struct dirty_log_header *)mmap(NULL, log->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0);
+    if (log->header == MAP_FAILED) {
+        syslog(LOG_ERR, "Failed to map dirty log %s: %s", path, strerror(errno));
+        log->header = NULL;
+        dirty_log_close(log);
+        return NULL;
+    }
+    log->records = (struct dirty_record *)((char *)log->header + DIRTY_LOG_HEADER);
+
+    if (!replay) {
+        memset(log->header, 0, sizeof(struct dirty_log_header));
+        strcpy(log->header->magic, DIRTY_LOG_MAGIC);
+        log->header->record_size = sizeof(struct dirty_record);
+        log->header->capacity = capacity;
+    }
+
+    log->idxSize = 1024;
+    log->idx = (struct dirty_idx *)calloc(log->idxSize, sizeof(struct dirty_idx));
+    if (log->idx == NULL) {
+        dirty_log_close(log);
+        return NULL;
+    }
+    for (pos = log->header->head; pos < log->header->tail; pos++) {
+        struct dirty_record * rec = record_at(log, pos);
+        if (!rec->done && !record_valid(rec)) {
+            syslog(LOG_WARNING, "Skipping damaged record %lu of dirty log %s", (unsigned long)pos, path);
+            rec->done = 1;
+        }
+        if (!rec->done && !insert_idx(log, record_hash(rec), pos)) {
+            dirty_log_close(log);
+            return NULL;
+        }
+    }
+    log->next = log->header->head;
+    if (log->idxUsed > 0) {
+        syslog(LOG_INFO, "Replaying %lu dirty requests from %s", (unsigned long)log->idxUsed, path);
+    }
+    return log;
+}
+
+void dirty_log_close(struct dirty_log * log) {
+    if (log->header != NULL) {
+        msync(log->header, log->map_size, MS_SYNC);
+        munmap(log->header, log->map_size);
+    }
+    if (log->fd >= 0) {
+        close(log->fd);
+    }
+    free(log->idx);
+    pthread_mutex_destroy(&(log->lock));
+    free(log);
+}
+
+/*
+ * Queue the metatile of a dirty request. Returns 1 if it is in the log
+ * afterwards, which includes it having been there already, and 0 if the log
+ * is full.
+ */
+int dirty_log_append(struct dirty_log * log, const struct item * item) {
+    struct dirty_record rec;
+    uint64_t hash, pos;
+
+    memset(&rec, 0, sizeof(rec));
+    strncpy(rec.xmlname, item->req.xmlname, XMLCONFIG_MAX - 1);
+    strncpy(rec.mimetype, item->req.mimetype, XMLCONFIG_MAX - 1);
+    strncpy(rec.options, item->req.options, XMLCONFIG_MAX - 1);
+    rec.z = item->req.z;
+    rec.x = item->mx;
+    rec.y = item->my;
+    hash = record_hash(&rec);
+
+    pthread_mutex_lock(&(log->lock));
+    if (lookup_idx(log, &rec, hash)) {
+        pthread_mutex_unlock(&(log->lock));
+        return 1;
+    }
+    pos = log->header->tail;
+    if ((pos - log->header->head >= log->header->capacity) || !insert_idx(log, hash, pos)) {
+        pthread_mutex_unlock(&(log->lock));
+        return 0;
+    }
+    *record_at(log, pos) = rec;
+    log->header->tail = pos + 1;
+    pthread_mutex_unlock(&(log->lock));
+    return 1;
+}
+
+/*
+ * Fill in the next queued record as a dirty request. Returns 0 if there is
+ * none.
+ */
+int dirty_log_next(struct dirty_log * log, struct item * item) {
+    struct dirty_record * rec;
+
+    pthread_mutex_lock(&(log->lock));
+    // Records of a previous run may have been rendered out of order
+    while ((log->next < log->header->tail) && record_at(log, log->next)->done) {
+        log->next++;
+    }
+    if (log->next == log->header->tail) {
+        pthread_mutex_unlock(&(log->lock));
+        return 0;
+    }
+    rec = record_at(log, log->next);
+
+    item->req.ver = PROTO_VER;
+    item->req.cmd = cmdDirty;
+    strcpy(item->req.xmlname, rec->xmlname);
+    strcpy(item->req.mimetype, rec->mimetype);
+    strcpy(item->req.options, rec->options);
+    item->req.z = rec->z;
+    item->req.x = item->mx = rec->x;
+    item->req.y = item->my = rec->y;
+    item->fd = FD_INVALID;
+    item->logpos = log->next + 1;
+    log->next++;
+    pthread_mutex_unlock(&(log->lock));
+    return 1;
+}
+
+/*
+ * The tile of a record handed out by dirty_log_next has been rendered, or
+ * does not need to be. The space of records is reused once every record
+ * before it is done.
+ */
+void dirty_log_done(struct dirty_log * log, long long logpos) {
+    struct dirty_record * rec;
+    uint64_t pos = logpos - 1;
+
+    pthread_mutex_lock(&(log->lock));
+    if ((pos < log->header->head) || (pos >= log->next)) {
+        pthread_mutex_unlock(&(log->lock));
+        return;
+    }
+    rec = record_at(log, pos);
+    if (!rec->done) {
+        rec->done = 1;
+        remove_idx(log, record_hash(rec), pos);
+    }
+    while ((log->header->head < log->next) && record_at(log, log->header->head)->done) {
+        log->header->head++;
+    }
+    pthread_mutex_unlock(&(log->lock));
+}
+
+// Number of records not yet handed out
+long dirty_log_pending(struct dirty_log * log) {
+    long pending;
+
+    pthread_mutex_lock(&(log->lock));
+    pending = log->header->tail - log->next;
+    pthread_mutex_unlock(&(log->lock));
+    return pending;
+}
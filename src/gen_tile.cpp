@@ -19,6 +19,9 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <string>
+#include <list>
+#include <map>
+#include <utility>
 #include <stdlib.h>
 
 #include "gen_tile.h"
@@ -90,12 +93,19 @@ struct xmlmapconfig {
     int htcpsock;
     int tilesize;
     double scale;
+    char output_format[XMLCONFIG_MAX];
+    int format;
     int minzoom;
     int maxzoom;
     int ok;
+    int loaded;
+    time_t loaded_at;
+    time_t last_used;
     parameterize_function_ptr parameterize_function; 
+    // Parameterized copies of map by options, most recently used first
+    std::list<std::pair<std::string, Map> > parameterized;
     xmlmapconfig() :
-        map(256,256) {}
+        map(256,256), loaded(0), loaded_at(0), last_used(0) {}
 };
 
 
@@ -239,45 +249,326 @@ mapnik::box2d<double> tile2prjbounds(struct projectionconfig * prj, int x, int y
     return  bbox;
 }
 
-static enum protoCmd render(struct xmlmapconfig * map, int x, int y, int z, char *options, metaTile &tiles)
+/*
+ * The map to render a request with. Without parameterization that is the
+ * style's map itself. Otherwise the thread keeps the most recently used
+ * parameterized copies, so the copy and its datasources are only built the
+ * first time a set of options comes along.
+ */
+static Map & parameterized_map(struct xmlmapconfig * map, char *options)
 {
-    unsigned int render_size_tx = MIN(METATILE, map->prj->aspect_x * (1 << z));
-    unsigned int render_size_ty = MIN(METATILE, map->prj->aspect_y * (1 << z));
+    std::list<std::pair<std::string, Map> >::iterator it;
 
-    map->map.resize(render_size_tx*map->tilesize, render_size_ty*map->tilesize);
-    map->map.zoom_to_box(tile2prjbounds(map->prj, x, y, z));
-    if (map->map.buffer_size() == 0) { // Only set buffer size if the buffer size isn't explicitly set in the mapnik stylesheet.
-        map->map.set_buffer_size((map->tilesize >> 1) * map->scale);
+    if (!map->parameterize_function) {
+        return map->map;
+    }
+    for (it = map->parameterized.begin(); it != map->parameterized.end(); ++it) {
+        if (it->first == options) {
+            map->parameterized.splice(map->parameterized.begin(), map->parameterized, it);
+            return map->parameterized.front().second;
+        }
+    }
+    if (map->parameterized.size() >= PARAMETERIZED_MAPS_MAX) {
+        map->parameterized.pop_back();
     }
-    //m.zoom(size+1);
+    map->parameterized.push_front(std::make_pair(std::string(options), map->map));
+    try {
+        map->parameterize_function(map->parameterized.front().second, options);
+    } catch (...) {
+        map->parameterized.pop_front();
+        throw;
+    }
+    return map->parameterized.front().second;
+}
 
-    mapnik::image_32 buf(render_size_tx*map->tilesize, render_size_ty*map->tilesize);
+/*
+ * Render a metatile into a new image, which the caller deletes. Cutting it
+ * into tiles and encoding them is left to encode_tile.
+ */
+static enum protoCmd render(struct xmlmapconfig * map, int x, int y, int z, char *options, mapnik::image_32 **image)
+{
+    unsigned int render_size_tx = MIN(METATILE, map->prj->aspect_x * (1 << z));
+    unsigned int render_size_ty = MIN(METATILE, map->prj->aspect_y * (1 << z));
+
+    *image = new mapnik::image_32(render_size_tx*map->tilesize, render_size_ty*map->tilesize);
+    mapnik::image_32 &buf = **image;
     try {
-        Map map_parameterized = map->map; 
-        if (map->parameterize_function) 
-            map->parameterize_function(map_parameterized, options); 
-        mapnik::agg_renderer<mapnik::image_32> ren(map_parameterized,buf,map->scale);
+        Map &m = parameterized_map(map, options);
+        m.resize(render_size_tx*map->tilesize, render_size_ty*map->tilesize);
+        m.zoom_to_box(tile2prjbounds(map->prj, x, y, z));
+        if (m.buffer_size() == 0) { // Only set buffer size if the buffer size isn't explicitly set in the mapnik stylesheet.
+            m.set_buffer_size((map->tilesize >> 1) * map->scale);
+        }
+        mapnik::agg_renderer<mapnik::image_32> ren(m,buf,map->scale);
         ren.apply();
     } catch (std::exception const& ex) {
       syslog(LOG_ERR, "ERROR: failed to render TILE %s %d %d-%d %d-%d", map->xmlname, z, x, x+render_size_tx-1, y, y+render_size_ty-1);
       syslog(LOG_ERR, "   reason: %s", ex.what());
       return cmdNotDone;
     }
+    return cmdDone; // OK
+}
+
+/*
+ * Whether all pixels of a tile have the same colour. Each row is compared
+ * without branching, so the compiler can vectorize the scan.
+ */
+static int uniform_tile(mapnik::image_32 &buf, unsigned int x0, unsigned int y0, int tilesize, uint32_t *colour)
+{
+    uint32_t diff = 0;
+    int x, y;
 
-    // Split the meta tile into an NxN grid of tiles
-    unsigned int xx, yy;
-    for (yy = 0; yy < render_size_ty; yy++) {
-        for (xx = 0; xx < render_size_tx; xx++) {
+    for (y = 0; (y < tilesize) && (diff == 0); y++) {
 #if MAPNIK_VERSION >= 300000
-            mapnik::image_view<mapnik::image<mapnik::rgba8_t>> vw1(xx * map->tilesize, yy * map->tilesize, map->tilesize, map->tilesize, buf);
-            struct mapnik::image_view_any vw(vw1);
+        const uint32_t *row = buf.get_row(y0 + y) + x0;
 #else
-            mapnik::image_view<mapnik::image_data_32> vw(xx * map->tilesize, yy * map->tilesize, map->tilesize, map->tilesize, buf.data());
+        const uint32_t *row = buf.data().getRow(y0 + y) + x0;
 #endif
-            tiles.set(xx, yy, save_to_string(vw, "png256"));
+        if (y == 0) {
+            *colour = row[0];
+        }
+        for (x = 0; x < tilesize; x++) {
+            diff |= row[x] ^ *colour;
         }
     }
-    return cmdDone; // OK
+    return diff == 0;
+}
+
+/*
+ * Encoded tiles of a single colour, by output format, size and colour. Shared
+ * by all threads, as the same few colours come up in every style.
+ */
+typedef std::pair<std::string, std::pair<int, uint32_t> > uniform_tile_key;
+static pthread_mutex_t uniform_tiles_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<uniform_tile_key, std::string> uniform_tiles;
+
+// Encode the tilesize square at x0,y0 of the image in the given mapnik output format
+static std::string encode_view(mapnik::image_32 &buf, unsigned int x0, unsigned int y0, int tilesize, const char *output_format)
+{
+#if MAPNIK_VERSION >= 300000
+    mapnik::image_view<mapnik::image<mapnik::rgba8_t>> vw1(x0, y0, tilesize, tilesize, buf);
+    struct mapnik::image_view_any vw(vw1);
+#else
+    mapnik::image_view<mapnik::image_data_32> vw(x0, y0, tilesize, tilesize, buf.data());
+#endif
+    return save_to_string(vw, output_format);
+}
+
+// Cut tile n, counting rows of the metatile left to right, out of the image and encode it
+static void encode_tile(mapnik::image_32 &buf, metaTile &tiles, struct xmlmapconfig *map, int n)
+{
+    int tilesize = map->tilesize;
+    unsigned int xx = n % (buf.width() / tilesize);
+    unsigned int yy = n / (buf.width() / tilesize);
+    std::map<uniform_tile_key, std::string>::iterator it;
+    uint32_t colour;
+    int uniform;
+
+    uniform = uniform_tile(buf, xx * tilesize, yy * tilesize, tilesize, &colour);
+    uniform_tile_key key(map->output_format, std::make_pair(tilesize, colour));
+    if (uniform) {
+        pthread_mutex_lock(&uniform_tiles_lock);
+        it = uniform_tiles.find(key);
+        if (it != uniform_tiles.end()) {
+            tiles.set(xx, yy, it->second);
+            pthread_mutex_unlock(&uniform_tiles_lock);
+            return;
+        }
+        pthread_mutex_unlock(&uniform_tiles_lock);
+    }
+
+    std::string data = encode_view(buf, xx * tilesize, yy * tilesize, tilesize, map->output_format);
+    tiles.set(xx, yy, data);
+
+    if (uniform) {
+        pthread_mutex_lock(&uniform_tiles_lock);
+        if (uniform_tiles.size() < UNIFORM_TILES_MAX) {
+            uniform_tiles[key] = data;
+        }
+        pthread_mutex_unlock(&uniform_tiles_lock);
+    }
+}
+
+static enum protoCmd save_metatile(metaTile &tiles, struct storage_backend * store, struct xmlmapconfig * map)
+{
+    try {
+        tiles.save(store);
+#ifdef HTCP_EXPIRE_CACHE
+        tiles.expire_tiles(map->htcpsock,map->host,map->xmluri);
+#endif
+
+    } catch (std::exception const& ex) {
+        syslog(LOG_ERR, "Received exception when writing metatile to disk: %s", ex.what());
+        return cmdNotDone;
+    } catch (...) {
+        // Treat any error as fatal and request end of processing
+        syslog(LOG_ERR, "Failed writing metatile to disk with unknown error, requesting exit.");
+        request_exit();
+        return cmdNotDone;
+    }
+    return cmdDone;
+}
+
+/*
+ * Rendered metatiles waiting to be encoded. The encode threads take the tiles
+ * of the oldest metatile one at a time, so the tiles of a metatile are encoded
+ * in parallel while its render thread already renders the next one. Whoever
+ * encodes the last tile saves the metatile and answers the request. Each
+ * render thread has at most one metatile with the encode threads.
+ */
+struct encode_job {
+    struct item *item;
+    struct xmlmapconfig *map;
+    const char *tile_dir;
+    mapnik::image_32 *buf;
+    metaTile *tiles;
+    long t1;
+    int count;  // tiles in the metatile
+    int next;   // next tile to encode
+    int left;   // tiles not encoded yet
+    int done;   // request answered
+    enum protoCmd ret;
+};
+
+static pthread_mutex_t encode_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t encode_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t encode_done_cond = PTHREAD_COND_INITIALIZER;
+static std::list<struct encode_job *> encode_jobs;
+static std::list<pthread_t> encode_thread_ids;
+// Both are protected by encode_lock
+static int encode_threads = 0;
+static int encode_exit = 0;
+
+static void finish_encode_job(struct encode_job *job, std::map<std::string, struct storage_backend *> &stores)
+{
+    struct protocol *req = &job->item->req;
+    unsigned int size = MIN(METATILE, 1 << req->z);
+    struct storage_backend *store;
+    enum protoCmd ret;
+
+    delete job->buf;
+    job->buf = NULL;
+
+    timeval tim;
+    gettimeofday(&tim, NULL);
+    long t2=tim.tv_sec*1000+(tim.tv_usec/1000);
+
+    syslog(LOG_DEBUG, "DEBUG: DONE TILE %s %d %d-%d %d-%d in %.3lf seconds",
+            req->xmlname, req->z, job->item->mx, job->item->mx+size-1, job->item->my, job->item->my+size-1, (t2 - job->t1)/1000.0);
+
+    // Storage backends are not shared between threads, each encode thread opens its own
+    store = stores[job->tile_dir];
+    if (store == NULL) {
+        store = stores[job->tile_dir] = init_storage_backend(job->tile_dir);
+    }
+    if (store) {
+        ret = save_metatile(*(job->tiles), store, job->map);
+    } else {
+        ret = cmdNotDone;
+    }
+    delete job->tiles;
+    job->tiles = NULL;
+
+    send_response(job->item, ret, t2 - job->t1);
+
+    pthread_mutex_lock(&encode_lock);
+    job->ret = ret;
+    job->done = 1;
+    pthread_cond_broadcast(&encode_done_cond);
+    pthread_mutex_unlock(&encode_lock);
+}
+
+static void *encode_thread(void *arg)
+{
+    std::map<std::string, struct storage_backend *> stores;
+    struct encode_job *job;
+    int n, last;
+
+    while (1) {
+        pthread_mutex_lock(&encode_lock);
+        while (encode_jobs.empty() && !encode_exit) {
+            pthread_cond_wait(&encode_cond, &encode_lock);
+        }
+        if (encode_jobs.empty()) {
+            pthread_mutex_unlock(&encode_lock);
+            break;
+        }
+        job = encode_jobs.front();
+        n = job->next++;
+        if (job->next == job->count) {
+            encode_jobs.pop_front();
+        }
+        pthread_mutex_unlock(&encode_lock);
+
+        encode_tile(*(job->buf), *(job->tiles), job->map, n);
+
+        pthread_mutex_lock(&encode_lock);
+        last = (--job->left == 0);
+        pthread_mutex_unlock(&encode_lock);
+        if (last) {
+            finish_encode_job(job, stores);
+        }
+    }
+
+    for (std::map<std::string, struct storage_backend *>::iterator it = stores.begin(); it != stores.end(); ++it) {
+        if (it->second != NULL) {
+            it->second->close_storage(it->second);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Hand a rendered metatile to the encode threads. Returns NULL if there are
+ * none, or they have exited, in which case the caller encodes it itself.
+ */
+static struct encode_job *encode_submit(struct item *item, struct xmlmapconfig *map, const char *tile_dir, mapnik::image_32 *buf, long t1)
+{
+    struct protocol *req = &item->req;
+    struct encode_job *job = new encode_job;
+
+    job->item = item;
+    job->map = map;
+    job->tile_dir = tile_dir;
+    job->buf = buf;
+    job->tiles = new metaTile(req->xmlname, req->options, item->mx, item->my, req->z);
+    job->tiles->set_format(map->format);
+    job->t1 = t1;
+    job->count = (buf->width() / map->tilesize) * (buf->height() / map->tilesize);
+    job->next = 0;
+    job->left = job->count;
+    job->done = 0;
+    job->ret = cmdNotDone;
+
+    pthread_mutex_lock(&encode_lock);
+    if ((encode_threads == 0) || encode_exit) {
+        pthread_mutex_unlock(&encode_lock);
+        delete job->tiles;
+        delete job;
+        return NULL;
+    }
+    encode_jobs.push_back(job);
+    pthread_cond_broadcast(&encode_cond);
+    pthread_mutex_unlock(&encode_lock);
+    return job;
+}
+
+// Wait for the request of a job to be answered, returns 0 if it could not be rendered
+static int encode_wait(struct encode_job *job)
+{
+    int ok;
+
+    if (job == NULL) {
+        return 1;
+    }
+    pthread_mutex_lock(&encode_lock);
+    while (!job->done) {
+        pthread_cond_wait(&encode_done_cond, &encode_lock);
+    }
+    pthread_mutex_unlock(&encode_lock);
+    ok = (job->ret == cmdDone);
+    delete job;
+    return ok;
 }
 #else //METATILE
 static enum protoCmd render(Map &m, const char *tile_dir, char *xmlname, projection &prj, int x, int y, int z)
@@ -333,72 +624,167 @@ void render_init(const char *plugins_dir, const char* font_dir, int font_dir_rec
     load_fonts(font_dir, font_dir_recurse);
 }
 
+void encode_init(int num_threads)
+{
+#ifdef METATILE
+    pthread_t thread;
+    int i;
+
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&thread, NULL, encode_thread, NULL)) {
+            syslog(LOG_ERR, "Could not create encode thread, encoding on the render threads");
+            return;
+        }
+        encode_thread_ids.push_back(thread);
+        pthread_mutex_lock(&encode_lock);
+        encode_threads++;
+        pthread_mutex_unlock(&encode_lock);
+    }
+#endif
+}
+
+/*
+ * Let the encode threads finish the metatiles they have and wait for them to
+ * exit, closing their storage backends.
+ */
+void encode_close(void)
+{
+#ifdef METATILE
+    pthread_mutex_lock(&encode_lock);
+    encode_exit = 1;
+    // Render threads go back to encoding their metatiles themselves
+    encode_threads = 0;
+    pthread_cond_broadcast(&encode_cond);
+    pthread_mutex_unlock(&encode_lock);
+
+    for (std::list<pthread_t>::iterator it = encode_thread_ids.begin(); it != encode_thread_ids.end(); ++it) {
+        pthread_join(*it, NULL);
+    }
+    encode_thread_ids.clear();
+#endif
+}
+
+/*
+ * Load a style into a render thread. This happens when the thread gets its
+ * first request for the style, so threads only hold the maps they render.
+ */
+static void load_map_config(struct xmlmapconfig * map, xmlconfigitem * config)
+{
+    map->loaded = 1;
+    map->loaded_at = time(NULL);
+    map->store = init_storage_backend(config->tile_dir);
+
+    if (map->store) {
+        map->ok = 1;
+
+        map->map.resize(RENDER_SIZE, RENDER_SIZE);
+
+        try {
+            mapnik::load_map(map->map, map->xmlfile);
+            /* If we have more than 10 rendering threads configured, we need to fix
+             * up the mapnik datasources to support larger postgres connection pools
+             */
+            if (config->num_threads > 10) {
+                syslog(LOG_INFO, "Updating max_connection parameter for mapnik layers to reflect thread count");
+                parameterize_map_max_connections(map->map, config->num_threads);
+            }
+            map->prj = get_projection(map->map.srs().c_str());
+            // Find out about an output format this mapnik can't write now, rather than on every tile
+            mapnik::image_32 probe(map->tilesize, map->tilesize);
+            encode_view(probe, 0, 0, map->tilesize, map->output_format);
+        } catch (std::exception const& ex) {
+            syslog(LOG_ERR, "An error occurred while loading the map layer '%s': %s", map->xmlname, ex.what());
+            map->ok = 0;
+        } catch (...) {
+            syslog(LOG_ERR, "An unknown error occurred while loading the map layer '%s'", map->xmlname);
+            map->ok = 0;
+        }
+
+#ifdef HTCP_EXPIRE_CACHE
+        strcpy(map->xmluri, config->xmluri);
+        strcpy(map->host, config->host);
+        strcpy(map->htcphost, config->htcpip);
+        if (strlen(map->htcphost) > 0) {
+            map->htcpsock = init_cache_expire(
+                    map->htcphost);
+            if (map->htcpsock > 0) {
+                syslog(LOG_INFO, "Successfully opened socket for HTCP cache expiry");
+            } else {
+                syslog(LOG_ERR, "Failed to opened socket for HTCP cache expiry");
+            }
+        } else {
+            map->htcpsock = -1;
+        }
+
+#endif
+    } else
+        map->ok = 0;
+
+    if (!map->ok) {
+        syslog(LOG_ERR, "Failed to load map layer '%s', trying again in %i seconds", map->xmlname, MAP_RETRY_DELAY);
+    }
+}
+
+/*
+ * Give back the memory of a style, whether it loaded or not, so that it is
+ * loaded again on its next request.
+ */
+static void unload_map_config(struct xmlmapconfig * map)
+{
+    if (!map->loaded) {
+        return;
+    }
+    map->map = Map(256, 256);
+    map->parameterized.clear();
+    free(map->prj);
+    map->prj = NULL;
+    if (map->store) {
+        map->store->close_storage(map->store);
+        map->store = NULL;
+    }
+#ifdef HTCP_EXPIRE_CACHE
+    if (map->htcpsock > 0) {
+        close(map->htcpsock);
+    }
+    map->htcpsock = -1;
+#endif
+    map->ok = 0;
+    map->loaded = 0;
+}
+
 void *render_thread(void * arg)
 {
-    xmlconfigitem * parentxmlconfig = (xmlconfigitem *)arg;
+    render_thread_config * threadconfig = (render_thread_config *)arg;
+    xmlconfigitem * parentxmlconfig = threadconfig->maps;
     xmlmapconfig maps[XMLCONFIGS_MAX];
     int i,iMaxConfigs;
     int render_time;
+#ifdef METATILE
+    struct encode_job *pending = NULL;
+#endif
 
     for (iMaxConfigs = 0; iMaxConfigs < XMLCONFIGS_MAX; ++iMaxConfigs) {
         if (parentxmlconfig[iMaxConfigs].xmlname[0] == 0 || parentxmlconfig[iMaxConfigs].xmlfile[0] == 0) break;
         strcpy(maps[iMaxConfigs].xmlname, parentxmlconfig[iMaxConfigs].xmlname);
         strcpy(maps[iMaxConfigs].xmlfile, parentxmlconfig[iMaxConfigs].xmlfile);
-        maps[iMaxConfigs].store = init_storage_backend(parentxmlconfig[iMaxConfigs].tile_dir);
+        maps[iMaxConfigs].store = NULL;
+        maps[iMaxConfigs].prj = NULL;
         maps[iMaxConfigs].tilesize  = parentxmlconfig[iMaxConfigs].tile_px_size;
         maps[iMaxConfigs].scale  = parentxmlconfig[iMaxConfigs].scale_factor;
+        strcpy(maps[iMaxConfigs].output_format, parentxmlconfig[iMaxConfigs].output_format);
+        maps[iMaxConfigs].format = parentxmlconfig[iMaxConfigs].format;
         maps[iMaxConfigs].minzoom = parentxmlconfig[iMaxConfigs].min_zoom;
         maps[iMaxConfigs].maxzoom = parentxmlconfig[iMaxConfigs].max_zoom;
         maps[iMaxConfigs].parameterize_function = init_parameterization_function(parentxmlconfig[iMaxConfigs].parameterization);
-
-
-        if (maps[iMaxConfigs].store) {
-            maps[iMaxConfigs].ok = 1;
-
-            maps[iMaxConfigs].map.resize(RENDER_SIZE, RENDER_SIZE);
-
-            try {
-                mapnik::load_map(maps[iMaxConfigs].map, maps[iMaxConfigs].xmlfile);
-                /* If we have more than 10 rendering threads configured, we need to fix
-                 * up the mapnik datasources to support larger postgres connection pools
-                 */
-                if (parentxmlconfig[iMaxConfigs].num_threads > 10) {
-                    syslog(LOG_INFO, "Updating max_connection parameter for mapnik layers to reflect thread count");
-                    parameterize_map_max_connections(maps[iMaxConfigs].map, parentxmlconfig[iMaxConfigs].num_threads);
-                }
-                maps[iMaxConfigs].prj = get_projection(maps[iMaxConfigs].map.srs().c_str());
-            } catch (std::exception const& ex) {
-                syslog(LOG_ERR, "An error occurred while loading the map layer '%s': %s", maps[iMaxConfigs].xmlname, ex.what());
-                maps[iMaxConfigs].ok = 0;
-            } catch (...) {
-                syslog(LOG_ERR, "An unknown error occurred while loading the map layer '%s'", maps[iMaxConfigs].xmlname);
-                maps[iMaxConfigs].ok = 0;
-            }
-
+        maps[iMaxConfigs].ok = 0;
 #ifdef HTCP_EXPIRE_CACHE
-            strcpy(maps[iMaxConfigs].xmluri, parentxmlconfig[iMaxConfigs].xmluri);
-            strcpy(maps[iMaxConfigs].host, parentxmlconfig[iMaxConfigs].host);
-            strcpy(maps[iMaxConfigs].htcphost, parentxmlconfig[iMaxConfigs].htcpip);
-            if (strlen(maps[iMaxConfigs].htcphost) > 0) {
-                maps[iMaxConfigs].htcpsock = init_cache_expire(
-                        maps[iMaxConfigs].htcphost);
-                if (maps[iMaxConfigs].htcpsock > 0) {
-                    syslog(LOG_INFO, "Successfully opened socket for HTCP cache expiry");
-                } else {
-                    syslog(LOG_ERR, "Failed to opened socket for HTCP cache expiry");
-                }
-            } else {
-                maps[iMaxConfigs].htcpsock = -1;
-            }
-
+        maps[iMaxConfigs].htcpsock = -1;
 #endif
-        } else
-            maps[iMaxConfigs].ok = 0;
     }
 
     while (1) {
         enum protoCmd ret;
-        struct item *item = request_queue_fetch_request(render_request_queue);
+        struct item *item = request_queue_fetch_pool_request(render_request_queue, threadconfig->pool);
         render_time = -1;
         if (item) {
             struct protocol *req = &item->req;
@@ -407,10 +793,18 @@ void *render_thread(void * arg)
             unsigned int size = MIN(METATILE, 1 << req->z);
             for (i = 0; i < iMaxConfigs; ++i) {
                 if (!strcmp(maps[i].xmlname, req->xmlname)) {
+                    if (maps[i].loaded && !maps[i].ok && (time(NULL) - maps[i].loaded_at >= MAP_RETRY_DELAY)) {
+                        // Whatever kept the style from loading may be fixed by now
+                        unload_map_config(&(maps[i]));
+                    }
+                    if (!maps[i].loaded) {
+                        load_map_config(&(maps[i]), &(parentxmlconfig[i]));
+                    }
+                    maps[i].last_used = time(NULL);
                     if (maps[i].ok) {
                         if (check_xyz(item->mx, item->my, req->z, &(maps[i]))) {
 
-                            metaTile tiles(req->xmlname, req->options, item->mx, item->my, req->z);
+                            mapnik::image_32 *buf = NULL;
 
                             timeval tim;
                             gettimeofday(&tim, NULL);
@@ -426,7 +820,28 @@ void *render_thread(void * arg)
                                 syslog(LOG_DEBUG, "DEBUG: START TILE %s %d %d-%d %d-%d, new metatile",
                                        req->xmlname, req->z, item->mx, item->mx+size-1, item->my, item->my+size-1);
 
-                            ret = render(&(maps[i]), item->mx, item->my, req->z, req->options, tiles);
+                            ret = render(&(maps[i]), item->mx, item->my, req->z, req->options, &buf);
+
+                            if (ret == cmdDone) {
+                                // The encode threads answer the request once the metatile is saved
+                                if (!encode_wait(pending)) {
+                                    sleep(10);
+                                }
+                                pending = encode_submit(item, &(maps[i]), parentxmlconfig[i].tile_dir, buf, t1);
+                                if (pending) {
+                                    break;
+                                }
+                            }
+
+                            metaTile tiles(req->xmlname, req->options, item->mx, item->my, req->z);
+                            tiles.set_format(maps[i].format);
+                            if (ret == cmdDone) {
+                                int count = (buf->width() / maps[i].tilesize) * (buf->height() / maps[i].tilesize);
+                                for (int n = 0; n < count; n++) {
+                                    encode_tile(*buf, tiles, &(maps[i]), n);
+                                }
+                            }
+                            delete buf;
 
                             gettimeofday(&tim, NULL);
                             long t2=tim.tv_sec*1000+(tim.tv_usec/1000);
@@ -437,21 +852,7 @@ void *render_thread(void * arg)
                             render_time = t2 - t1;
 
                             if (ret == cmdDone) {
-                                try {
-                                    tiles.save(maps[i].store);
-#ifdef HTCP_EXPIRE_CACHE
-                                    tiles.expire_tiles(maps[i].htcpsock,maps[i].host,maps[i].xmluri);
-#endif
-
-                                } catch (std::exception const& ex) {
-                                    syslog(LOG_ERR, "Received exception when writing metatile to disk: %s", ex.what());
-                                    ret = cmdNotDone;
-                                } catch (...) {
-                                    // Treat any error as fatal and request end of processing
-                                    syslog(LOG_ERR, "Failed writing metatile to disk with unknown error, requesting exit.");
-                                    ret = cmdNotDone;
-                                    request_exit();
-                                }
+                                ret = save_metatile(tiles, maps[i].store, &(maps[i]));
                             }
 #else //METATILE
                         ret = render(maps[i].map, maps[i].tile_dir, req->xmlname, maps[i].prj, req->x, req->y, req->z);
@@ -476,6 +877,20 @@ void *render_thread(void * arg)
             if (i == iMaxConfigs){
                 syslog(LOG_ERR, "No map for: %s", req->xmlname);
             }
+            if (threadconfig->map_unload_timeout > 0) {
+                time_t now = time(NULL);
+                for (i = 0; i < iMaxConfigs; ++i) {
+                    if (maps[i].loaded && maps[i].ok && (now - maps[i].last_used > threadconfig->map_unload_timeout)) {
+#ifdef METATILE
+                        // The metatile with the encode threads may still use the style's HTCP socket
+                        encode_wait(pending);
+                        pending = NULL;
+#endif
+                        syslog(LOG_INFO, "Unloading map layer '%s', unused for %li seconds", maps[i].xmlname, (long)(now - maps[i].last_used));
+                        unload_map_config(&(maps[i]));
+                    }
+                }
+            }
         } else {
             sleep(1); // TODO: Use an event to indicate there are new requests
         }
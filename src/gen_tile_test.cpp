@@ -31,7 +31,9 @@
 #include "gen_tile.h"
 #include "render_config.h"
 #include "request_queue.h"
+#include "protocol_helper.h"
 #include "store.h"
+#include "latency_stats.h"
 #include <syslog.h>
 #include <sstream>
 #include "string.h"
@@ -94,6 +96,8 @@ struct item * init_render_request(enum protoCmd type) {
     return item;
 }
 
+static int unique_mx;
+
 void *addition_thread(void * arg) {
     struct request_queue * queue = (struct request_queue *)arg;
     struct item * item;
@@ -115,7 +119,9 @@ void *addition_thread(void * arg) {
     for (int i = 0; i < NO_QUEUE_REQUESTS; i++) {
         item = init_render_request(cmdDirty);
         item->my = rand_r(&seed);
-        item->mx = rand_r(&seed);
+        // rand_r sequences of different threads can overlap, so keep the
+        // requests unique or they get de-duplicated and the counts are off
+        item->mx = __sync_fetch_and_add(&unique_mx, 1);
         request_queue_add_request(queue, item);
     }
     return NULL;
@@ -130,6 +136,77 @@ void * fetch_thread(void * arg) {
     return NULL;
 }
 
+/*
+ * Threads for a full request life cycle under contention: every addition
+ * thread submits the same few tiles, so most requests end up as duplicates
+ * while the render threads are fetching, answering and removing them.
+ */
+struct lifecycle_state {
+    struct request_queue * queue;
+    int delivered;
+    int stop;
+    int stats_ok;
+};
+
+void * lifecycle_addition_thread(void * arg) {
+    static const enum protoCmd cmds[] = {cmdRenderPrio, cmdRender, cmdRenderBulk};
+    static int next_cmd;
+    struct lifecycle_state * state = (struct lifecycle_state *)arg;
+    struct item * item;
+
+    for (int i = 0; i < NO_QUEUE_REQUESTS; i++) {
+        item = request_queue_alloc_item(state->queue);
+        item->req.ver = PROTO_VER;
+        // Mix the priorities per tile, so bulk items get promoted on the way
+        item->req.cmd = cmds[__sync_fetch_and_add(&next_cmd, 1) % 3];
+        strcpy(item->req.xmlname, "default");
+        item->mx = i;
+        if (request_queue_add_request(state->queue, item) == cmdNotDone) {
+            // A bulk request for a tile already waiting in the bulk queue is
+            // answered straight away
+            __sync_fetch_and_add(&(state->delivered), 1);
+        }
+    }
+    return NULL;
+}
+
+void * lifecycle_render_thread(void * arg) {
+    struct lifecycle_state * state = (struct lifecycle_state *)arg;
+    struct item * item, * prev;
+
+    while (1) {
+        item = request_queue_fetch_request(state->queue);
+        if (item->mx < 0) {
+            // Told to stop
+            request_queue_remove_request(state->queue, item, 0);
+            request_queue_free_item(state->queue, item);
+            return NULL;
+        }
+        request_queue_remove_request(state->queue, item, 1);
+        while (item) {
+            __sync_fetch_and_add(&(state->delivered), 1);
+            prev = item;
+            item = item->duplicates;
+            request_queue_free_item(state->queue, prev);
+        }
+    }
+}
+
+void * lifecycle_stats_thread(void * arg) {
+    struct lifecycle_state * state = (struct lifecycle_state *)arg;
+    stats_struct stats;
+    long last = 0;
+
+    while (!__sync_fetch_and_add(&(state->stop), 0)) {
+        request_queue_copy_stats(state->queue, &stats);
+        if ((stats.noReqPrioRender + stats.noReqRender < last) || (request_queue_no_requests_queued(state->queue, cmdRender) < 0)) {
+            state->stats_ok = 0;
+        }
+        last = stats.noReqPrioRender + stats.noReqRender;
+    }
+    return NULL;
+}
+
 TEST_CASE( "renderd/queueing", "request queueing") {
     SECTION("renderd/queueing/initialisation", "test the initialisation of the request queue") {
         request_queue * queue = request_queue_init();
@@ -291,6 +368,111 @@ TEST_CASE( "renderd/queueing", "request queueing") {
         request_queue_close(queue);
         }
 
+    SECTION("renderd/queueing/fair share", "test that the priorities and styles share the render threads by weight") {
+        struct item * item;
+        struct item * old;
+        int prio = 0;
+        request_queue * queue = request_queue_init();
+
+        //Dirty tiles get a share even while priority requests keep coming
+        request_queue_set_weight(queue, cmdRenderPrio, 3);
+        request_queue_set_weight(queue, cmdDirty, 1);
+        for (int i = 0; i < 8; i++) {
+            request_queue_add_request(queue, init_render_request(cmdRenderPrio));
+        }
+        for (int i = 0; i < 4; i++) {
+            request_queue_add_request(queue, init_render_request(cmdDirty));
+        }
+        for (int i = 0; i < 8; i++) {
+            item = request_queue_fetch_request(queue);
+            if (item->originatedQueue == queueRequestPrio) {
+                prio++;
+            }
+            request_queue_remove_request(queue, item, 0);
+        }
+        REQUIRE( prio == 6 );
+        REQUIRE( request_queue_no_requests_queued(queue, cmdRenderPrio) == 2 );
+        REQUIRE( request_queue_no_requests_queued(queue, cmdDirty) == 2 );
+        for (int i = 0; i < 4; i++) {
+            request_queue_remove_request(queue, request_queue_fetch_request(queue), 0);
+        }
+
+        //Styles within a priority take turns
+        request_queue_add_style(queue, "a");
+        request_queue_add_style(queue, "b");
+        for (int i = 0; i < 6; i++) {
+            item = init_render_request(cmdRender);
+            strcpy(item->req.xmlname, (i < 4) ? "a" : "b");
+            request_queue_add_request(queue, item);
+        }
+        const char * expected[] = {"a", "b", "a", "b", "a", "a"};
+        for (int i = 0; i < 6; i++) {
+            item = request_queue_fetch_request(queue);
+            INFO("i: " << i);
+            REQUIRE( strcmp(item->req.xmlname, expected[i]) == 0 );
+            request_queue_remove_request(queue, item, 0);
+        }
+
+        //A request waiting longer than the maximum age goes first
+        request_queue_set_max_age(queue, 1);
+        old = init_render_request(cmdRenderBulk);
+        request_queue_add_request(queue, old);
+        old->queued -= 5000;
+        request_queue_add_request(queue, init_render_request(cmdRenderPrio));
+        item = request_queue_fetch_request(queue);
+        REQUIRE( item == old );
+        request_queue_remove_request(queue, item, 0);
+        item = request_queue_fetch_request(queue);
+        REQUIRE( item->originatedQueue == queueRequestPrio );
+        request_queue_remove_request(queue, item, 0);
+
+        request_queue_close(queue);
+    }
+
+    SECTION("renderd/queueing/style pools", "test that a style with its own render threads is only served by them") {
+        struct item * item;
+        request_queue * queue = request_queue_init();
+
+        request_queue_add_style(queue, "a");
+        int pool = request_queue_add_pool(queue, "b");
+        REQUIRE( pool == 1 );
+        REQUIRE( request_queue_add_pool(queue, "b") == pool );
+
+        for (int i = 0; i < 6; i++) {
+            item = init_render_request((i % 2) ? cmdRenderPrio : cmdDirty);
+            strcpy(item->req.xmlname, (i < 3) ? "a" : "b");
+            request_queue_add_request(queue, item);
+        }
+        for (int i = 0; i < 3; i++) {
+            item = request_queue_fetch_pool_request(queue, pool);
+            REQUIRE( strcmp(item->req.xmlname, "b") == 0 );
+            request_queue_remove_request(queue, item, 0);
+        }
+        for (int i = 0; i < 3; i++) {
+            item = request_queue_fetch_request(queue);
+            REQUIRE( strcmp(item->req.xmlname, "a") == 0 );
+            request_queue_remove_request(queue, item, 0);
+        }
+        REQUIRE( request_queue_no_requests_queued(queue, cmdRenderPrio) == 0 );
+        REQUIRE( request_queue_no_requests_queued(queue, cmdDirty) == 0 );
+
+        //A full pool does not push the requests of another to the dirty queue
+        for (int i = 0; i < REQ_LIMIT; i++) {
+            item = init_render_request(cmdRender);
+            strcpy(item->req.xmlname, "b");
+            REQUIRE( request_queue_add_request(queue, item) == cmdIgnore );
+        }
+        item = init_render_request(cmdRender);
+        strcpy(item->req.xmlname, "b");
+        REQUIRE( request_queue_add_request(queue, item) == cmdNotDone );
+        item = init_render_request(cmdRender);
+        strcpy(item->req.xmlname, "a");
+        REQUIRE( request_queue_add_request(queue, item) == cmdIgnore );
+        REQUIRE( request_queue_no_requests_queued(queue, cmdRender) == REQ_LIMIT + 1 );
+
+        request_queue_close(queue);
+    }
+
     SECTION("renderd/queueing/pending requests", "test if de-duplication of requests work") {
         enum protoCmd res;
         struct item * item;
@@ -370,6 +552,274 @@ TEST_CASE( "renderd/queueing", "request queueing") {
         request_queue_close(queue);
     }
 
+    SECTION("renderd/queueing/pending requests options", "test that requests with different options are not de-duplicated") {
+        struct item * item;
+        request_queue * queue = request_queue_init();
+
+        item = init_render_request(cmdRender);
+        item->mx = 0;
+        REQUIRE( request_queue_add_request(queue, item) == cmdIgnore );
+        item = init_render_request(cmdRender);
+        item->mx = 0;
+        strcpy(item->req.options, "lang=de");
+        REQUIRE( request_queue_add_request(queue, item) == cmdIgnore );
+        REQUIRE( request_queue_no_requests_queued(queue, cmdRender) == 2 );
+        item = init_render_request(cmdRender);
+        item->mx = 0;
+        strcpy(item->req.options, "lang=de");
+        REQUIRE( request_queue_add_request(queue, item) == cmdIgnore );
+        REQUIRE( request_queue_no_requests_queued(queue, cmdRender) == 2 );
+
+        request_queue_close(queue);
+    }
+
+    SECTION("renderd/queueing/promote requests", "test that requests waiting in the dirty or bulk queue move up when a user asks for them") {
+        struct item * item;
+        struct item * dupe;
+        stats_struct stats;
+        request_queue * queue = request_queue_init();
+
+        item = init_render_request(cmdDirty);
+        item->mx = 0;
+        REQUIRE( request_queue_add_request(queue, item) == cmdNotDone );
+        item = init_render_request(cmdRenderBulk);
+        item->mx = 1;
+        REQUIRE( request_queue_add_request(queue, item) == cmdIgnore );
+        item = init_render_request(cmdRenderBulk);
+        item->mx = 2;
+        REQUIRE( request_queue_add_request(queue, item) == cmdIgnore );
+
+        //Another background request does not move anything
+        item = init_render_request(cmdDirty);
+        item->mx = 1;
+        REQUIRE( request_queue_add_request(queue, item) == cmdNotDone );
+        REQUIRE( request_queue_no_requests_queued(queue, cmdRenderBulk) == 2 );
+
+        //A priority request takes the dirty item to the priority queue
+        dupe = init_render_request(cmdRenderPrio);
+        dupe->mx = 0;
+        dupe->fd = 7;
+        REQUIRE( request_queue_add_request(queue, dupe) == cmdIgnore );
+        REQUIRE( request_queue_no_requests_queued(queue, cmdDirty) == 0 );
+        REQUIRE( request_queue_no_requests_queued(queue, cmdRenderPrio) == 1 );
+
+        //A normal request takes a bulk item to the request queue
+        item = init_render_request(cmdRender);
+        item->mx = 2;
+        REQUIRE( request_queue_add_request(queue, item) == cmdIgnore );
+        REQUIRE( request_queue_no_requests_queued(queue, cmdRenderBulk) == 1 );
+        REQUIRE( request_queue_no_requests_queued(queue, cmdRender) == 1 );
+
+        //Promoted items are served in their new order, with the new requester attached
+        item = request_queue_fetch_request(queue);
+        REQUIRE( item->mx == 0 );
+        REQUIRE( item->duplicates == dupe );
+        REQUIRE( dupe->fd == 7 );
+        request_queue_remove_request(queue, item, 0);
+        item = request_queue_fetch_request(queue);
+        REQUIRE( item->mx == 2 );
+        request_queue_remove_request(queue, item, 0);
+        item = request_queue_fetch_request(queue);
+        REQUIRE( item->mx == 1 );
+        REQUIRE( item->duplicates == NULL );
+        request_queue_remove_request(queue, item, 0);
+
+        request_queue_copy_stats(queue, &stats);
+        REQUIRE( stats.noReqPromoted == 2 );
+        REQUIRE( stats.noReqPrioRender == 1 );
+        REQUIRE( stats.noReqRender == 1 );
+        REQUIRE( stats.noReqBulkRender == 1 );
+        REQUIRE( stats.noDirtyRender == 0 );
+
+        request_queue_close(queue);
+    }
+
+    SECTION("renderd/queueing/deadlines", "test that requests nobody waits for any more are not rendered ahead of the others") {
+        struct item * item;
+        stats_struct stats;
+        long long past = (time(NULL) - 60) * 1000LL;
+        long long future = (time(NULL) + 60) * 1000LL;
+        request_queue * queue = request_queue_init();
+
+        //Expired priority request
+        item = init_render_request(cmdRenderPrio);
+        item->mx = 0;
+        item->deadline = past;
+        REQUIRE( request_queue_add_request(queue, item) == cmdIgnore );
+        //Expired, but a duplicate is still waiting
+        item = init_render_request(cmdRenderPrio);
+        item->mx = 1;
+        item->deadline = past;
+        REQUIRE( request_queue_add_request(queue, item) == cmdIgnore );
+        item = init_render_request(cmdRender);
+        item->mx = 1;
+        item->deadline = future;
+        REQUIRE( request_queue_add_request(queue, item) == cmdIgnore );
+        //Expired along with its duplicate
+        item = init_render_request(cmdRender);
+        item->mx = 2;
+        item->deadline = past;
+        REQUIRE( request_queue_add_request(queue, item) == cmdIgnore );
+        item = init_render_request(cmdRender);
+        item->mx = 2;
+        item->deadline = past;
+        REQUIRE( request_queue_add_request(queue, item) == cmdIgnore );
+        //No deadline at all
+        item = init_render_request(cmdRenderLow);
+        item->mx = 3;
+        REQUIRE( request_queue_add_request(queue, item) == cmdIgnore );
+
+        item = request_queue_fetch_request(queue);
+        REQUIRE( item->mx == 1 );
+        REQUIRE( item->duplicates != NULL );
+        request_queue_remove_request(queue, item, 0);
+        item = request_queue_fetch_request(queue);
+        REQUIRE( item->mx == 3 );
+        request_queue_remove_request(queue, item, 0);
+
+        //The expired requests were demoted to the dirty queue, without their duplicates
+        REQUIRE( request_queue_no_requests_queued(queue, cmdDirty) == 2 );
+        item = request_queue_fetch_request(queue);
+        REQUIRE( item->mx == 0 );
+        REQUIRE( item->fd == FD_INVALID );
+        request_queue_remove_request(queue, item, 0);
+        item = request_queue_fetch_request(queue);
+        REQUIRE( item->mx == 2 );
+        REQUIRE( item->duplicates == NULL );
+        request_queue_remove_request(queue, item, 0);
+
+        //A request that expires while it is rendered is wasted work
+        item = init_render_request(cmdRender);
+        item->mx = 4;
+        item->deadline = future;
+        REQUIRE( request_queue_add_request(queue, item) == cmdIgnore );
+        item = request_queue_fetch_request(queue);
+        REQUIRE( item->mx == 4 );
+        item->deadline = past;
+        request_queue_remove_request(queue, item, 1000);
+
+        request_queue_copy_stats(queue, &stats);
+        REQUIRE( stats.noReqExpired == 3 );
+        REQUIRE( stats.noReqWasted == 1 );
+        REQUIRE( stats.timeReqWasted == 1000 );
+        REQUIRE( stats.noDirtyRender == 2 );
+        REQUIRE( request_queue_no_requests_queued(queue, cmdRender) == 0 );
+
+        request_queue_close(queue);
+    }
+
+    SECTION("renderd/queueing/index churn", "test that de-duplication keeps working while the index fills and empties") {
+        struct item * item;
+        request_queue * queue = request_queue_init();
+
+        for (int i = 0; i < DIRTY_LIMIT; i++) {
+            item = request_queue_alloc_item(queue);
+            item->req.cmd = cmdDirty;
+            strcpy(item->req.xmlname, "default");
+            item->mx = i * 8;
+            item->my = (i % 7) * 8;
+            REQUIRE( request_queue_add_request(queue, item) == cmdNotDone );
+        }
+        REQUIRE( request_queue_no_requests_queued(queue, cmdDirty) == DIRTY_LIMIT );
+
+        for (int i = 0; i < DIRTY_LIMIT / 2; i++) {
+            item = request_queue_fetch_request(queue);
+            REQUIRE( item->mx == i * 8 );
+            request_queue_remove_request(queue, item, 0);
+            request_queue_free_item(queue, item);
+        }
+        REQUIRE( request_queue_no_requests_queued(queue, cmdDirty) == DIRTY_LIMIT - DIRTY_LIMIT / 2 );
+
+        //Everything that is still queued is found again, everything that got removed is not
+        for (int i = 0; i < DIRTY_LIMIT; i++) {
+            item = request_queue_alloc_item(queue);
+            item->req.cmd = cmdRender;
+            strcpy(item->req.xmlname, "default");
+            item->mx = i * 8;
+            item->my = (i % 7) * 8;
+            INFO("i: " << i);
+            if (i < REQ_LIMIT) {
+                REQUIRE( request_queue_add_request(queue, item) == cmdIgnore );
+                REQUIRE( request_queue_no_requests_queued(queue, cmdRender) == i + 1 );
+            } else if (i < DIRTY_LIMIT / 2) {
+                //Overflows into the dirty queue
+                REQUIRE( request_queue_add_request(queue, item) == cmdNotDone );
+                REQUIRE( request_queue_no_requests_queued(queue, cmdDirty) == DIRTY_LIMIT - DIRTY_LIMIT / 2 + i - REQ_LIMIT + 1 );
+            } else {
+                REQUIRE( request_queue_add_request(queue, item) == cmdNotDone );
+                REQUIRE( request_queue_no_requests_queued(queue, cmdDirty) == DIRTY_LIMIT - REQ_LIMIT );
+            }
+        }
+
+        request_queue_close(queue);
+    }
+
+    SECTION("renderd/queueing/dirty log", "test that dirty requests beyond the dirty queue go to disk and survive a restart") {
+        struct item * item;
+        stats_struct stats;
+        const char * tmp = getenv("TMPDIR");
+        std::string path = std::string(tmp ? tmp : P_tmpdir) + "/mod_tile_test_dirty.log";
+        unlink(path.c_str());
+
+        request_queue * queue = request_queue_init();
+        REQUIRE( request_queue_open_dirty_log(queue, path.c_str(), 2 * DIRTY_LIMIT) == 0 );
+        for (int i = 0; i < DIRTY_LIMIT + 100; i++) {
+            item = init_render_request(cmdDirty);
+            item->mx = i;
+            REQUIRE( request_queue_add_request(queue, item) == cmdNotDone );
+        }
+        //Duplicates are not logged twice
+        item = init_render_request(cmdDirty);
+        item->mx = 5;
+        REQUIRE( request_queue_add_request(queue, item) == cmdNotDone );
+        request_queue_copy_stats(queue, &stats);
+        REQUIRE( stats.noReqDroped == 0 );
+        REQUIRE( request_queue_no_requests_queued(queue, cmdDirty) == DIRTY_LIMIT + 100 );
+
+        item = request_queue_fetch_request(queue);
+        REQUIRE( item->mx == 0 );
+        REQUIRE( item->fd == FD_INVALID );
+        request_queue_remove_request(queue, item, 0);
+        request_queue_close(queue);
+
+        //Everything not rendered yet is replayed, including what was in memory
+        queue = request_queue_init();
+        REQUIRE( request_queue_open_dirty_log(queue, path.c_str(), 2 * DIRTY_LIMIT) == 0 );
+        REQUIRE( request_queue_no_requests_queued(queue, cmdDirty) == DIRTY_LIMIT + 99 );
+        for (int i = 1; i < DIRTY_LIMIT + 100; i++) {
+            item = request_queue_fetch_request(queue);
+            INFO("i: " << i);
+            REQUIRE( item->mx == i );
+            request_queue_remove_request(queue, item, 0);
+        }
+        REQUIRE( request_queue_no_requests_queued(queue, cmdDirty) == 0 );
+        request_queue_close(queue);
+
+        queue = request_queue_init();
+        REQUIRE( request_queue_open_dirty_log(queue, path.c_str(), 2 * DIRTY_LIMIT) == 0 );
+        REQUIRE( request_queue_no_requests_queued(queue, cmdDirty) == 0 );
+
+        //The log can only be used by one queue at a time
+        request_queue * other = request_queue_init();
+        REQUIRE( request_queue_open_dirty_log(other, path.c_str(), 2 * DIRTY_LIMIT) < 0 );
+        request_queue_close(other);
+        request_queue_close(queue);
+
+        //A full log drops requests
+        queue = request_queue_init();
+        REQUIRE( request_queue_open_dirty_log(queue, path.c_str(), 10) == 0 );
+        for (int i = 0; i < 12; i++) {
+            item = init_render_request(cmdDirty);
+            item->mx = i;
+            request_queue_add_request(queue, item);
+        }
+        request_queue_copy_stats(queue, &stats);
+        REQUIRE( stats.noReqDroped == 2 );
+        REQUIRE( request_queue_no_requests_queued(queue, cmdDirty) == 10 );
+        request_queue_close(queue);
+        unlink(path.c_str());
+    }
+
     SECTION("renderd/queueing/overflow requests", "test if requests correctly overflow from one request priority to the next") {
         enum protoCmd res;
         struct item * item;
@@ -511,6 +961,66 @@ TEST_CASE( "renderd/queueing", "request queueing") {
     }
 
 
+    SECTION("renderd/queueing/multithreading request life cycle", "test de-duplication and stats while requests are added, rendered and removed concurrently") {
+        pthread_t * addition_threads;
+        pthread_t * render_threads;
+        pthread_t stats_thread;
+        struct lifecycle_state state;
+        struct item * item;
+        int render_count = NO_THREADS / 4;
+
+        for (int j = 0; j < NO_TEST_REPEATS / 10; j++) { //As we are looking for race conditions, repeat this test many times
+            addition_threads = (pthread_t *)calloc(NO_THREADS,sizeof(pthread_t));
+            render_threads = (pthread_t *)calloc(render_count,sizeof(pthread_t));
+            memset(&state, 0, sizeof(state));
+            state.queue = request_queue_init();
+            state.stats_ok = 1;
+            void *status;
+
+            REQUIRE( pthread_create(&stats_thread, NULL, lifecycle_stats_thread, (void *) &state) == 0 );
+            for (int i = 0; i < render_count; i++) {
+                REQUIRE( pthread_create(&render_threads[i], NULL, lifecycle_render_thread, (void *) &state) == 0 );
+            }
+            for (int i = 0; i < NO_THREADS; i++) {
+                REQUIRE( pthread_create(&addition_threads[i], NULL, lifecycle_addition_thread, (void *) &state) == 0 );
+            }
+            for (int i = 0; i < NO_THREADS; i++) {
+                pthread_join(addition_threads[i], &status);
+            }
+
+            //Every request has to be answered exactly once, either on its own or as a duplicate
+            for (int i = 0; (i < 10000) && (__sync_fetch_and_add(&(state.delivered), 0) < NO_THREADS * NO_QUEUE_REQUESTS); i++) {
+                usleep(1000);
+            }
+            INFO("Itteration " << j);
+            REQUIRE( __sync_fetch_and_add(&(state.delivered), 0) == NO_THREADS * NO_QUEUE_REQUESTS );
+
+            for (int i = 0; i < render_count; i++) {
+                item = request_queue_alloc_item(state.queue);
+                item->req.cmd = cmdRenderPrio;
+                strcpy(item->req.xmlname, "default");
+                item->mx = -1 - i;
+                request_queue_add_request(state.queue, item);
+            }
+            for (int i = 0; i < render_count; i++) {
+                pthread_join(render_threads[i], &status);
+            }
+            __sync_fetch_and_add(&(state.stop), 1);
+            pthread_join(stats_thread, &status);
+
+            REQUIRE( state.delivered == NO_THREADS * NO_QUEUE_REQUESTS );
+            REQUIRE( state.stats_ok == 1 );
+            REQUIRE( request_queue_no_requests_queued(state.queue, cmdRenderPrio) == 0 );
+            REQUIRE( request_queue_no_requests_queued(state.queue, cmdRender) == 0 );
+            REQUIRE( request_queue_no_requests_queued(state.queue, cmdDirty) == 0 );
+            REQUIRE( request_queue_no_requests_queued(state.queue, cmdRenderBulk) == 0 );
+
+            request_queue_close(state.queue);
+            free(addition_threads);
+            free(render_threads);
+        }
+    }
+
     SECTION("renderd/queueing/clear fd", "Test if the clearing of fd work for queues") {
         struct request_queue * queue = request_queue_init();
         struct item * item;
@@ -564,6 +1074,105 @@ TEST_CASE( "renderd/queueing", "request queueing") {
     }
 }
 
+TEST_CASE( "renderd/protocol", "command framing" ) {
+
+    SECTION("renderd/protocol/parse pipelined", "should split a buffer into commands of all versions") {
+        char buf[sizeof(struct protocol) * 3];
+        struct protocol cmd;
+        size_t len = 0, off = 0;
+        int ret;
+
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.ver = 1; cmd.cmd = cmdRender; cmd.z = 1;
+        memcpy(buf + len, &cmd, sizeof(struct protocol_v1));
+        len += sizeof(struct protocol_v1);
+        cmd.ver = 3; cmd.z = 3;
+        strcpy(cmd.xmlname, "style3");
+        memcpy(buf + len, &cmd, sizeof(struct protocol));
+        len += sizeof(struct protocol);
+        cmd.ver = 2; cmd.z = 2;
+        strcpy(cmd.xmlname, "style2");
+        memcpy(buf + len, &cmd, sizeof(struct protocol_v2));
+        len += sizeof(struct protocol_v2);
+
+        ret = parse_cmd(&cmd, buf, len);
+        REQUIRE( ret == sizeof(struct protocol_v1) );
+        REQUIRE( cmd.z == 1 );
+        REQUIRE( cmd.xmlname[0] == 0 );
+        off += ret;
+        ret = parse_cmd(&cmd, buf + off, len - off);
+        REQUIRE( ret == sizeof(struct protocol) );
+        REQUIRE( cmd.z == 3 );
+        REQUIRE( strcmp(cmd.xmlname, "style3") == 0 );
+        off += ret;
+        // An incomplete command must wait for more data
+        REQUIRE( parse_cmd(&cmd, buf + off, 2) == 0 );
+        REQUIRE( parse_cmd(&cmd, buf + off, sizeof(struct protocol_v2) - 1) == 0 );
+        ret = parse_cmd(&cmd, buf + off, len - off);
+        REQUIRE( ret == sizeof(struct protocol_v2) );
+        REQUIRE( cmd.z == 2 );
+        REQUIRE( strcmp(cmd.xmlname, "style2") == 0 );
+        off += ret;
+        REQUIRE( off == len );
+    }
+
+    SECTION("renderd/protocol/parse bad version", "should reject unknown protocol versions") {
+        struct protocol cmd;
+
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.ver = 42;
+        REQUIRE( parse_cmd(&cmd, (const char *)&cmd, sizeof(cmd)) == -1 );
+    }
+
+    SECTION("renderd/protocol/parse frame", "should decode a version 4 frame of several tiles") {
+        char buf[PROTO_FRAME_MAX];
+        struct protocol_v4_header hdr;
+        struct protocol_v4_tile tile;
+        int i, len;
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.ver = PROTO_VER_FRAMED;
+        hdr.count = 3;
+        hdr.len = len = sizeof(hdr) + 3 * sizeof(tile);
+        memcpy(buf, &hdr, sizeof(hdr));
+        for (i = 0; i < 3; i++) {
+            memset(&tile, 0, sizeof(tile));
+            tile.id = 100 + i;
+            tile.cmd = cmdRender;
+            tile.z = i;
+            strcpy(tile.xmlname, "default");
+            memcpy(buf + sizeof(hdr) + i * sizeof(tile), &tile, sizeof(tile));
+        }
+
+        memset(&hdr, 0, sizeof(hdr));
+        REQUIRE( parse_frame(&hdr, buf, 4) == 0 );
+        REQUIRE( parse_frame(&hdr, buf, len - 1) == 0 );
+        REQUIRE( parse_frame(&hdr, buf, len) == len );
+        REQUIRE( hdr.count == 3 );
+        memcpy(&tile, buf + sizeof(hdr) + 2 * sizeof(tile), sizeof(tile));
+        REQUIRE( tile.id == 102 );
+        REQUIRE( tile.z == 2 );
+    }
+
+    SECTION("renderd/protocol/parse bad frame", "should reject frames whose length does not fit the tiles") {
+        char buf[PROTO_FRAME_MAX];
+        struct protocol_v4_header hdr;
+
+        memset(buf, 0, sizeof(buf));
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.ver = PROTO_VER_FRAMED;
+        hdr.count = 2;
+        hdr.len = sizeof(hdr) + sizeof(struct protocol_v4_tile);
+        memcpy(buf, &hdr, sizeof(hdr));
+        REQUIRE( parse_frame(&hdr, buf, sizeof(buf)) == -1 );
+
+        hdr.count = PROTO_FRAME_MAX_TILES + 1;
+        hdr.len = PROTO_FRAME_MAX + sizeof(struct protocol_v4_tile);
+        memcpy(buf, &hdr, sizeof(hdr));
+        REQUIRE( parse_frame(&hdr, buf, sizeof(buf)) == -1 );
+    }
+}
+
 TEST_CASE( "renderd", "tile generation" ) {
 
       SECTION("render_init 1", "should throw nice error if paths are invalid") {
@@ -802,6 +1411,297 @@ TEST_CASE( "storage-backend", "Tile storage backend" ) {
         store->close_storage(store);
     }
 
+    SECTION("storage/read slice/full metatile", "should locate the tile data within the metatile") {
+        struct storage_backend * store = NULL;
+        char * buf;
+        char * buf_tmp;
+        char msg[4096];
+        int compressed;
+        int fd;
+        off_t offset;
+        size_t len;
+        char etag[TILE_ETAG_MAX];
+        char etag_prev[TILE_ETAG_MAX];
+
+        etag_prev[0] = 0;
+
+        buf = (char *)malloc(8196);
+        buf_tmp = (char *)malloc(8196);
+
+        store = init_storage_backend(tile_dir);
+        REQUIRE( store != NULL );
+        REQUIRE( store->tile_read_slice != NULL );
+
+        metaTile tiles("default", "", 1024 + METATILE, 1024, 10);
+        for (int yy = 0; yy < METATILE; yy++) {
+            for (int xx = 0; xx < METATILE; xx++) {
+                sprintf(buf, "DEADBEAF %i %i", xx, yy);
+                std::string tile_data(buf);
+                tiles.set(xx, yy, tile_data);
+            }
+        }
+        tiles.save(store);
+
+        for (int yy = 0; yy < METATILE; yy++) {
+            for (int xx = 0; xx < METATILE; xx++) {
+                REQUIRE( store->tile_read_slice(store, "default", "", 1024 + METATILE + xx, 1024 + yy, 10, &fd, &offset, &len, &compressed, NULL, etag, NULL, msg) == 0 );
+                REQUIRE( fd >= 0 );
+                REQUIRE( len == 12 );
+                REQUIRE( pread(fd, buf, len, offset) == 12 );
+                sprintf(buf_tmp, "DEADBEAF %i %i", xx, yy);
+                REQUIRE ( memcmp(buf_tmp, buf, 11) == 0 );
+                REQUIRE( strlen(etag) == 16 );
+                REQUIRE( strcmp(etag, etag_prev) != 0 );
+                strcpy(etag_prev, etag);
+                close(fd);
+            }
+        }
+
+        REQUIRE( store->tile_read_slice(store, "default", "", 0, 0, 0, &fd, &offset, &len, &compressed, NULL, etag, NULL, msg) < 0 );
+        REQUIRE( fd < 0 );
+
+        free(buf);
+        free(buf_tmp);
+        store->close_storage(store);
+    }
+
+    SECTION("storage/write/shared tiles", "should store identical tiles of a metatile once") {
+        struct storage_backend * store = NULL;
+        char buf[64];
+        char msg[4096];
+        char etag[TILE_ETAG_MAX];
+        int compressed;
+        int fd;
+        off_t offset, blank_offset = -1;
+        size_t len;
+
+        store = init_storage_backend(tile_dir);
+        REQUIRE( store != NULL );
+
+        metaTile tiles("default", "", 1024 + 3*METATILE, 1024, 10);
+        for (int yy = 0; yy < METATILE; yy++) {
+            for (int xx = 0; xx < METATILE; xx++) {
+                if (xx % 2) {
+                    sprintf(buf, "DEADBEAF %i %i", xx, yy);
+                } else {
+                    sprintf(buf, "BLANK TILE");
+                }
+                tiles.set(xx, yy, std::string(buf));
+            }
+        }
+        tiles.save(store);
+
+        for (int yy = 0; yy < METATILE; yy++) {
+            for (int xx = 0; xx < METATILE; xx++) {
+                REQUIRE( store->tile_read_slice(store, "default", "", 1024 + 3*METATILE + xx, 1024 + yy, 10, &fd, &offset, &len, &compressed, NULL, etag, NULL, msg) == 0 );
+                REQUIRE( pread(fd, buf, len, offset) == (ssize_t)len );
+                close(fd);
+                if (xx % 2) {
+                    REQUIRE( len == 12 );
+                    REQUIRE( offset != blank_offset );
+                } else {
+                    REQUIRE( len == 10 );
+                    REQUIRE( memcmp(buf, "BLANK TILE", 10) == 0 );
+                    if (blank_offset < 0) {
+                        blank_offset = offset;
+                    }
+                    REQUIRE( offset == blank_offset );
+                }
+            }
+        }
+
+        store->close_storage(store);
+    }
+
+    SECTION("storage/dedup/shared tiles", "should store identical tiles of all metatiles once") {
+        struct storage_backend * store = NULL;
+        char dedup_dir[4096];
+        char buf[64];
+        char msg[4096];
+        char etag[TILE_ETAG_MAX];
+        int compressed;
+        int fd;
+        off_t offset, blank_offset = -1;
+        size_t len;
+
+        sprintf(dedup_dir, "dedup://%s", tile_dir);
+        store = init_storage_backend(dedup_dir);
+        REQUIRE( store != NULL );
+
+        for (int m = 0; m < 2; m++) {
+            metaTile tiles("default", "", 1024 + m*METATILE, 2048, 10);
+            for (int yy = 0; yy < METATILE; yy++) {
+                for (int xx = 0; xx < METATILE; xx++) {
+                    if ((xx + m) % 2) {
+                        sprintf(buf, "DEADBEAF %i %i %i", m, xx, yy);
+                    } else {
+                        sprintf(buf, "BLANK TILE");
+                    }
+                    tiles.set(xx, yy, std::string(buf));
+                }
+            }
+            tiles.save(store);
+        }
+
+        for (int m = 0; m < 2; m++) {
+            for (int yy = 0; yy < METATILE; yy++) {
+                for (int xx = 0; xx < METATILE; xx++) {
+                    REQUIRE( store->tile_read(store, "default", "", 1024 + m*METATILE + xx, 2048 + yy, 10, buf, sizeof(buf), &compressed, msg) > 0 );
+                    REQUIRE( store->tile_read_slice(store, "default", "", 1024 + m*METATILE + xx, 2048 + yy, 10, &fd, &offset, &len, &compressed, NULL, etag, NULL, msg) == 0 );
+                    REQUIRE( pread(fd, buf, len, offset) == (ssize_t)len );
+                    close(fd);
+                    REQUIRE( strlen(etag) > 0 );
+                    if ((xx + m) % 2) {
+                        REQUIRE( len == 14 );
+                        REQUIRE( offset != blank_offset );
+                    } else {
+                        REQUIRE( len == 10 );
+                        REQUIRE( memcmp(buf, "BLANK TILE", 10) == 0 );
+                        if (blank_offset < 0) {
+                            blank_offset = offset;
+                        }
+                        REQUIRE( offset == blank_offset );
+                    }
+                }
+            }
+        }
+
+        //A record pointing past the end of the pack is an error, not a short tile
+        sprintf(dedup_dir, "%s/dedup.pack", tile_dir);
+        REQUIRE( truncate(dedup_dir, blank_offset + 5) == 0 );
+        REQUIRE( store->tile_read(store, "default", "", 1024, 2048, 10, buf, sizeof(buf), &compressed, msg) < 0 );
+        REQUIRE( store->tile_read_slice(store, "default", "", 1024, 2048, 10, &fd, &offset, &len, &compressed, NULL, etag, NULL, msg) < 0 );
+
+        REQUIRE( store->metatile_delete(store, "default", 1024, 2048, 10) == 0 );
+        REQUIRE( store->metatile_delete(store, "default", 1024 + METATILE, 2048, 10) == 0 );
+        store->close_storage(store);
+        unlink(dedup_dir);
+        sprintf(dedup_dir, "%s/dedup.idx", tile_dir);
+        unlink(dedup_dir);
+    }
+
+    SECTION("storage/fetch/partial metatile", "should return stat info and tile data in one go") {
+        struct storage_backend * store = NULL;
+        struct stat_info sinfo;
+        char * buf;
+        char * buf_tmp;
+        char msg[4096];
+        char etag[TILE_ETAG_MAX];
+        char etag_empty[TILE_ETAG_MAX];
+        int compressed;
+        int tile_size;
+
+        buf = (char *)malloc(8196);
+        buf_tmp = (char *)malloc(8196);
+        etag_empty[0] = 0;
+
+        store = init_storage_backend(tile_dir);
+        REQUIRE( store != NULL );
+
+        metaTile tiles("default", "", 1024 + 2*METATILE, 1024, 10);
+        for (int yy = 0; yy < METATILE; yy++) {
+            for (int xx = 0; xx < (METATILE >> 1); xx++) {
+                sprintf(buf, "DEADBEAF %i %i", xx, yy);
+                std::string tile_data(buf);
+                tiles.set(xx, yy, tile_data);
+            }
+        }
+        tiles.save(store);
+
+        for (int yy = 0; yy < METATILE; yy++) {
+            for (int xx = 0; xx < METATILE; xx++) {
+                tile_size = store->tile_fetch(store, "default", "", 1024 + 2*METATILE + xx, 1024 + yy, 10, buf, 8195, &compressed, &sinfo, etag, NULL, msg);
+                REQUIRE( sinfo.size > 0 );
+                REQUIRE( sinfo.expired == 0 );
+                REQUIRE( sinfo.mtime > 0 );
+                REQUIRE( strlen(etag) == 16 );
+                if (xx >= (METATILE >> 1)) {
+                    REQUIRE ( tile_size == 0 );
+                    // All empty tiles have the same content and therefore ETag
+                    if (etag_empty[0]) {
+                        REQUIRE( strcmp(etag, etag_empty) == 0 );
+                    }
+                    strcpy(etag_empty, etag);
+                } else {
+                    REQUIRE ( tile_size == 12 );
+                    sprintf(buf_tmp, "DEADBEAF %i %i", xx, yy);
+                    REQUIRE ( memcmp(buf_tmp, buf, 11) == 0 );
+                }
+            }
+        }
+
+        tile_size = store->tile_fetch(store, "default", "", 0, 0, 0, buf, 8195, &compressed, &sinfo, etag, NULL, msg);
+        REQUIRE( tile_size < 0 );
+        REQUIRE( sinfo.size < 0 );
+        REQUIRE( etag[0] == 0 );
+
+        free(buf);
+        free(buf_tmp);
+        store->close_storage(store);
+    }
+
+    SECTION("storage/fetch/format", "should return the format the tiles were encoded in") {
+        struct storage_backend * store = NULL;
+        char backend[4096];
+        char buf[64];
+        char msg[4096];
+        int compressed;
+        int format;
+        int fd;
+        off_t offset;
+        size_t len;
+
+        REQUIRE( tile_format("png256:z=9:t=0") == formatPng );
+        REQUIRE( tile_format("png32") == formatPng );
+        REQUIRE( tile_format("jpeg85") == formatJpeg );
+        REQUIRE( tile_format("webp:quality=80") == formatWebp );
+        REQUIRE( tile_format("tiff") == formatUnknown );
+        REQUIRE( strcmp(tile_format_mimetype(formatJpeg), "image/jpeg") == 0 );
+        REQUIRE( strcmp(tile_format_extension(formatWebp), "webp") == 0 );
+        REQUIRE( tile_format_mimetype(formatUnknown) == NULL );
+
+        for (int b = 0; b < 2; b++) {
+            if (b) {
+                sprintf(backend, "dedup://%s", tile_dir);
+            } else {
+                strcpy(backend, tile_dir);
+            }
+            store = init_storage_backend(backend);
+            REQUIRE( store != NULL );
+
+            metaTile tiles("default", "", 1024 + 4*METATILE, 1024, 10);
+            metaTile old_tiles("default", "", 1024 + 5*METATILE, 1024, 10);
+            tiles.set_format(formatJpeg);
+            for (int yy = 0; yy < METATILE; yy++) {
+                for (int xx = 0; xx < METATILE; xx++) {
+                    sprintf(buf, "JPEG %i %i", xx, yy);
+                    tiles.set(xx, yy, std::string(buf));
+                    old_tiles.set(xx, yy, std::string(buf));
+                }
+            }
+            tiles.save(store);
+            old_tiles.save(store);
+
+            REQUIRE( store->tile_fetch(store, "default", "", 1024 + 4*METATILE + 1, 1024 + 2, 10, buf, sizeof(buf), &compressed, NULL, NULL, &format, msg) == 8 );
+            REQUIRE( format == formatJpeg );
+            REQUIRE( store->tile_read_slice(store, "default", "", 1024 + 4*METATILE + 1, 1024 + 2, 10, &fd, &offset, &len, &compressed, NULL, NULL, &format, msg) == 0 );
+            close(fd);
+            REQUIRE( format == formatJpeg );
+
+            // Metatiles of styles without a format fall back to the configured type
+            REQUIRE( store->tile_fetch(store, "default", "", 1024 + 5*METATILE + 1, 1024 + 2, 10, buf, sizeof(buf), &compressed, NULL, NULL, &format, msg) == 8 );
+            REQUIRE( format == formatUnknown );
+
+            REQUIRE( store->metatile_delete(store, "default", 1024 + 4*METATILE, 1024, 10) == 0 );
+            REQUIRE( store->metatile_delete(store, "default", 1024 + 5*METATILE, 1024, 10) == 0 );
+            store->close_storage(store);
+        }
+        sprintf(backend, "%s/dedup.pack", tile_dir);
+        unlink(backend);
+        sprintf(backend, "%s/dedup.idx", tile_dir);
+        unlink(backend);
+    }
+
      SECTION("storage/expire/delete metatile", "should delete tile from disk") {
         struct storage_backend * store = NULL;
         struct stat_info sinfo;
@@ -883,6 +1783,45 @@ TEST_CASE( "storage-backend", "Tile storage backend" ) {
     free(tile_dir);
 }
 
+TEST_CASE( "mod_tile/stats", "latency statistics" ) {
+
+    SECTION("mod_tile/stats/latency buckets", "should put latencies in power of two buckets") {
+        REQUIRE( latency_bucket(0) == 0 );
+        REQUIRE( latency_bucket(1) == 1 );
+        REQUIRE( latency_bucket(1000) == 10 );
+        REQUIRE( latency_bucket(1024) == 11 );
+        REQUIRE( latency_bucket(~0ULL) == LATENCY_BUCKETS - 1 );
+    }
+
+    SECTION("mod_tile/stats/latency layers", "should find the counters of a layer whatever the number of layers") {
+        // Counters allocated for the layers of all virtual hosts, read back for the 3 of one of them
+        const int allocated = 5, layers = 3;
+        uint64_t counters[allocated * LATENCY_KINDS * LATENCY_BUCKETS];
+        uint64_t seen[layers * LATENCY_KINDS * LATENCY_BUCKETS];
+
+        memset(counters, 0, sizeof(counters));
+        for (int layer = 0; layer < layers; layer++) {
+            for (int kind = 0; kind < LATENCY_KINDS; kind++) {
+                counters[LATENCY_LAYER_OFFSET(layer, kind) + latency_bucket(1 << layer)] += 1 + layer * LATENCY_KINDS + kind;
+            }
+        }
+        memcpy(seen, counters, sizeof(seen));
+
+        for (int layer = 0; layer < layers; layer++) {
+            for (int kind = 0; kind < LATENCY_KINDS; kind++) {
+                uint64_t * hist = seen + LATENCY_LAYER_OFFSET(layer, kind);
+                for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                    if (b == latency_bucket(1 << layer)) {
+                        REQUIRE( hist[b] == (uint64_t)(1 + layer * LATENCY_KINDS + kind) );
+                    } else {
+                        REQUIRE( hist[b] == 0 );
+                    }
+                }
+            }
+        }
+    }
+}
+
 TEST_CASE( "projections", "Test projections" ) {
 
     SECTION("projections/bounds/spherical", "should return 1") {
@@ -34,7 +34,7 @@
 
 
 metaTile::metaTile(const std::string &xmlconfig, const std::string &options, int x, int y, int z):
-    x_(x), y_(y), z_(z), xmlconfig_(xmlconfig), options_(options) {
+    x_(x), y_(y), z_(z), format_(formatUnknown), xmlconfig_(xmlconfig), options_(options) {
     clear();
 }
 
@@ -48,6 +48,11 @@ void metaTile::set(int x, int y, const std::string &data) {
     tile[x][y] = data;
 }
 
+// The format the tiles were encoded in, recorded in the metatile header
+void metaTile::set_format(int format) {
+    format_ = format;
+}
+
 const std::string metaTile::get(int x, int y) {
     return tile[x][y];
 }
@@ -63,11 +68,19 @@ void metaTile::save(struct storage_backend * store) {
     ssize_t offset;
     struct meta_layout m;
     struct entry offsets[METATILE * METATILE];
+    struct meta_etags e;
+    struct meta_format f;
+    uint64_t hashes[METATILE * METATILE];
+    bool shared[METATILE * METATILE];
     char * metatilebuffer;
     char *tmp;
 
     memset(&m, 0, sizeof(m));
     memset(&offsets, 0, sizeof(offsets));
+    memset(&e, 0, sizeof(e));
+    memset(&f, 0, sizeof(f));
+    memset(&hashes, 0, sizeof(hashes));
+    memset(&shared, 0, sizeof(shared));
     
     // Create and write header
     m.count = METATILE * METATILE;
@@ -75,19 +88,36 @@ void metaTile::save(struct storage_backend * store) {
     m.x = x_;
     m.y = y_;
     m.z = z_;
+    memcpy(e.magic, META_ETAG_MAGIC, strlen(META_ETAG_MAGIC));
+    e.count = METATILE * METATILE;
+    memcpy(f.magic, META_FORMAT_MAGIC, strlen(META_FORMAT_MAGIC));
+    f.format = format_;
     
-    offset = header_size;
+    offset = header_size + META_ETAGS_SIZE + META_FORMAT_SIZE;
     limit = (1 << z_);
     limit = MIN(limit, METATILE);
     limit = METATILE;
     
-    // Generate offset table
+    // Generate offset table. Tiles that are the same as an earlier one, like
+    // the blank tiles of sea or empty land, point at the earlier one's data.
     for (ox=0; ox < limit; ox++) {
         for (oy=0; oy < limit; oy++) {
             int mt = xyz_to_meta_offset(x_ + ox, y_ + oy, z_);
             offsets[mt].offset = offset;
             offsets[mt].size   = tile[ox][oy].size();
-            offset += offsets[mt].size;
+            hashes[mt] = meta_tile_hash(tile[ox][oy].data(), tile[ox][oy].size());
+            for (int prev = 0; (prev < ox * limit + oy) && (offsets[mt].size > 0); prev++) {
+                int px = prev / limit, py = prev % limit;
+                int pmt = xyz_to_meta_offset(x_ + px, y_ + py, z_);
+                if ((hashes[pmt] == hashes[mt]) && (tile[px][py] == tile[ox][oy])) {
+                    offsets[mt].offset = offsets[pmt].offset;
+                    shared[mt] = true;
+                    break;
+                }
+            }
+            if (!shared[mt]) {
+                offset += offsets[mt].size;
+            }
         }
     }
     
@@ -99,11 +129,17 @@ void metaTile::save(struct storage_backend * store) {
     memset(metatilebuffer, 0, offset);
     memcpy(metatilebuffer,&m,sizeof(m));
     memcpy(metatilebuffer + sizeof(m), &offsets, sizeof(offsets));
+    memcpy(metatilebuffer + header_size, &e, sizeof(e));
+    memcpy(metatilebuffer + header_size + sizeof(e), &hashes, sizeof(hashes));
+    memcpy(metatilebuffer + header_size + META_ETAGS_SIZE, &f, sizeof(f));
     
     // Write tiles
     for (ox=0; ox < limit; ox++) {
         for (oy=0; oy < limit; oy++) {
-            memcpy(metatilebuffer + offsets[xyz_to_meta_offset(x_ + ox, y_ + oy, z_)].offset, (const void *)tile[ox][oy].data(), tile[ox][oy].size());
+            int mt = xyz_to_meta_offset(x_ + ox, y_ + oy, z_);
+            if (!shared[mt]) {
+                memcpy(metatilebuffer + offsets[mt].offset, (const void *)tile[ox][oy].data(), tile[ox][oy].size());
+            }
         }
     }
     
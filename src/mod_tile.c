@@ -5,6 +5,7 @@
 #include "apr_buckets.h"
 #include "apr_lib.h"
 #include "apr_poll.h"
+#include "apr_hash.h"
 
 #define APR_WANT_STRFUNC
 #define APR_WANT_MEMFUNC
@@ -36,6 +37,7 @@ module AP_MODULE_DECLARE_DATA tile_module;
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -65,15 +67,19 @@ APLOG_USE_MODULE(tile);
 #define APACHE24 1
 #endif
 
+#ifndef HTTP_TOO_MANY_REQUESTS
+#define HTTP_TOO_MANY_REQUESTS 429
+#endif
+
 apr_shm_t *stats_shm;
 apr_shm_t *delaypool_shm;
 char *shmfilename;
 char *shmfilename_delaypool;
-apr_global_mutex_t *stats_mutex;
-apr_global_mutex_t *delay_mutex;
 apr_global_mutex_t *storage_mutex;
 
 char *mutexfilename;
+/* Distance between two stats shards in the shared memory segment */
+apr_size_t stats_shard_size = 0;
 int layerCount = 0;
 int global_max_zoom = 0;
 
@@ -194,17 +200,248 @@ static int socket_init(request_rec *r)
     return fd;
 }
 
+/*
+ * A connection to renderd that is kept open across requests. With Apache 2.4
+ * there is one per worker thread, attached to the thread's lifecycle pool like
+ * the storage backends, so it is never used by two requests at the same time.
+ */
+struct renderd_conn {
+    int fd;
+    int framed;             /* RENDERD_FRAMED_* */
+    apr_uint64_t next_id;   /* id of the last version 4 request */
+    apr_time_t framed_retry; /* when to try version 4 again after falling back */
+};
+
+/* Whether renderd is spoken to in version 4 frames. A new connection is
+ * probed before it carries requests, see renderd_conn_negotiate */
+#define RENDERD_FRAMED_OFF 0
+#define RENDERD_FRAMED_TRY 1
+#define RENDERD_FRAMED_ON 2
+/* Seconds to stay with version 3 before trying version 4 again */
+#define RENDERD_FRAMED_RETRY 300
+/* Seconds to wait for the answer to the probe */
+#define RENDERD_FRAMED_PROBE_TIMEOUT 5
+
+static apr_status_t cleanup_renderd_conn(void * data) {
+    struct renderd_conn * conn = (struct renderd_conn *)data;
+    if (conn->fd != FD_INVALID) {
+        close(conn->fd);
+        conn->fd = FD_INVALID;
+    }
+    return APR_SUCCESS;
+}
+
+static struct renderd_conn * get_renderd_conn(request_rec *r) {
+#ifdef APACHE24
+    struct renderd_conn * conn = NULL;
+    apr_pool_t *lifecycle_pool = apr_thread_pool_get(r->connection->current_thread);
+    const char * memkey = "mod_tile_renderd_conn";
+
+    if (apr_pool_userdata_get((void **)&conn, memkey, lifecycle_pool) != APR_SUCCESS) {
+        conn = NULL;
+    }
+    if (conn == NULL) {
+        conn = apr_pcalloc(lifecycle_pool, sizeof(struct renderd_conn));
+        conn->fd = FD_INVALID;
+        conn->framed = RENDERD_FRAMED_TRY;
+        if (apr_pool_userdata_set(conn, memkey, &cleanup_renderd_conn, lifecycle_pool) != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "get_renderd_conn: Failed to set user_data");
+            return NULL;
+        }
+    }
+    return conn;
+#else
+    /* Apache 2.2 only gives us the process pool, which is shared between the
+     * threads of a worker process, so fall back to a connection per request */
+    return NULL;
+#endif
+}
+
+static void renderd_conn_close(struct renderd_conn *conn, int fd)
+{
+    close(fd);
+    if (conn)
+        conn->fd = FD_INVALID;
+}
+
+/*
+ * Send a request as a version 4 frame of a single tile, tagged with a new id.
+ */
+static int renderd_send_frame(int fd, struct renderd_conn *conn, struct protocol *cmd, int timeout)
+{
+    char buf[sizeof(struct protocol_v4_header) + sizeof(struct protocol_v4_tile)];
+    struct protocol_v4_header hdr;
+    struct protocol_v4_tile tile;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.ver = PROTO_VER_FRAMED;
+    hdr.len = sizeof(buf);
+    hdr.count = 1;
+    memset(&tile, 0, sizeof(tile));
+    tile.id = ++conn->next_id;
+    tile.deadline = timeout * 1000;
+    tile.cmd = cmd->cmd;
+    tile.x = cmd->x;
+    tile.y = cmd->y;
+    tile.z = cmd->z;
+    strcpy(tile.xmlname, cmd->xmlname);
+    if (cmd->ver == 3) {
+        strcpy(tile.mimetype, cmd->mimetype);
+        strcpy(tile.options, cmd->options);
+    }
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), &tile, sizeof(tile));
+    return send(fd, buf, sizeof(buf), 0) == sizeof(buf);
+}
+
+/*
+ * Read a version 4 frame and look for the reply to the request with the given
+ * id in it. Returns 1 with the reply filled in, 0 if the frame only holds
+ * replies to other requests, or -1 if the connection can not be used anymore.
+ */
+static int renderd_recv_frame(request_rec *r, int fd, apr_uint64_t id, struct protocol_v4_tile *resp)
+{
+    char buf[PROTO_FRAME_MAX];
+    struct protocol_v4_header hdr;
+    unsigned int i;
+    int ret;
+
+    ret = recv(fd, &hdr, sizeof(hdr), MSG_WAITALL);
+    if (ret != sizeof(hdr)) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "request_tile: Failed to read response from rendering socket %s",
+                      ret ? strerror(errno) : "connection closed");
+        return -1;
+    }
+    if ((hdr.ver != PROTO_VER_FRAMED) || (hdr.len > sizeof(buf)) || (hdr.count > PROTO_FRAME_MAX_TILES) ||
+        (hdr.len < sizeof(hdr) + hdr.count * sizeof(struct protocol_v4_tile))) {
+        /* Lost track of the message boundaries, start over on a fresh connection */
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "request_tile: Malformed response from rendering socket");
+        return -1;
+    }
+    ret = recv(fd, buf, hdr.len - sizeof(hdr), MSG_WAITALL);
+    if (ret != (int)(hdr.len - sizeof(hdr))) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "request_tile: Failed to read response from rendering socket %s", strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < hdr.count; i++) {
+        memcpy(resp, buf + i * sizeof(*resp), sizeof(*resp));
+        if (resp->id == id)
+            return 1;
+    }
+    /* With a persistent connection this is usually the late reply to a request that timed out earlier */
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "Response does not match request id %" APR_UINT64_T_FMT, id);
+    return 0;
+}
+
+/*
+ * Check that an idle connection is still usable. Anything waiting on it is a
+ * late reply to an earlier request that timed out, or a NotDone for a dirty
+ * request, and is discarded. On a version 4 connection whole frames are
+ * skipped, so that the next read starts at a frame boundary. Returns 0 if
+ * renderd has closed the connection.
+ */
+static int renderd_conn_alive(request_rec *r, struct renderd_conn *conn)
+{
+    char buf[sizeof(struct protocol)];
+    struct protocol_v4_tile tile;
+    int ret;
+
+    while (1) {
+        if (conn->framed == RENDERD_FRAMED_ON) {
+            ret = recv(conn->fd, buf, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (ret > 0) {
+                /* Ids start at 1, so nothing matches and the frame is dropped */
+                if (renderd_recv_frame(r, conn->fd, 0, &tile) < 0)
+                    return 0;
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "request_tile: Discarded a stale response frame");
+                continue;
+            }
+        } else {
+            ret = recv(conn->fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (ret > 0) {
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "request_tile: Discarding %i bytes of stale responses", ret);
+                continue;
+            }
+        }
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 1;
+        if (ret < 0 && errno == EINTR)
+            continue;
+        return 0;
+    }
+}
+
+/*
+ * Find out whether renderd speaks version 4 before a request is sent to it, so
+ * that no request is lost to an older renderd. The probe is a frame without a
+ * command, which a version 4 renderd refuses straight away, while an older one
+ * drops the connection. As a renderd that restarts or fails does the same,
+ * version 3 is only used for a while and a later connection probes again.
+ * Returns the connection to use, a fresh one after falling back.
+ */
+static int renderd_conn_negotiate(request_rec *r, struct renderd_conn *conn)
+{
+    struct protocol probe;
+    struct protocol_v4_tile tile;
+    struct timeval tv = { RENDERD_FRAMED_PROBE_TIMEOUT, 0 };
+    fd_set rx;
+
+    memset(&probe, 0, sizeof(probe));
+    probe.ver = 3;
+    probe.cmd = cmdIgnore;
+    FD_ZERO(&rx);
+    FD_SET(conn->fd, &rx);
+    if (renderd_send_frame(conn->fd, conn, &probe, 0) &&
+        (select(conn->fd + 1, &rx, NULL, NULL, &tv) == 1) &&
+        (renderd_recv_frame(r, conn->fd, conn->next_id, &tile) > 0)) {
+        conn->framed = RENDERD_FRAMED_ON;
+        return conn->fd;
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "request_tile: Rendering daemon does not answer protocol version %d, using version 3 for %d seconds",
+                  PROTO_VER_FRAMED, RENDERD_FRAMED_RETRY);
+    conn->framed = RENDERD_FRAMED_OFF;
+    conn->framed_retry = apr_time_now() + apr_time_from_sec(RENDERD_FRAMED_RETRY);
+    close(conn->fd);
+    conn->fd = socket_init(r);
+    return conn->fd;
+}
+
+static int renderd_conn_open(request_rec *r, struct renderd_conn *conn)
+{
+    if (conn && conn->fd != FD_INVALID) {
+        if (renderd_conn_alive(r, conn))
+            return conn->fd;
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "request_tile: Rendering daemon closed the connection, reconnecting");
+        close(conn->fd);
+        conn->fd = FD_INVALID;
+    }
+    if (conn) {
+        // A new connection may be to a different renderd, so its version is found out again
+        if (conn->framed != RENDERD_FRAMED_OFF || apr_time_now() >= conn->framed_retry)
+            conn->framed = RENDERD_FRAMED_TRY;
+        conn->fd = socket_init(r);
+        if (conn->fd != FD_INVALID && conn->framed == RENDERD_FRAMED_TRY)
+            return renderd_conn_negotiate(r, conn);
+        return conn->fd;
+    }
+    return socket_init(r);
+}
+
 static int request_tile(request_rec *r, struct protocol *cmd, int renderImmediately)
 {
     int fd;
     int ret = 0;
     int retry = 1;
+    int timeout;
     struct protocol resp;
+    struct renderd_conn *conn;
 
     ap_conf_vector_t *sconf = r->server->module_config;
     tile_server_conf *scfg = ap_get_module_config(sconf, &tile_module);
 
-    fd = socket_init(r);
+    conn = get_renderd_conn(r);
+    fd = renderd_conn_open(r, conn);
 
     if (fd == FD_INVALID) {
         ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "Failed to connect to renderer");
@@ -221,9 +458,15 @@ static int request_tile(request_rec *r, struct protocol *cmd, int renderImmediat
 
     if (scfg->bulkMode) cmd->cmd = cmdRenderBulk; 
 
+    timeout = renderImmediately ? (renderImmediately > 2?scfg->request_timeout_priority:scfg->request_timeout) : 0;
+
     ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Requesting style(%s) z(%d) x(%d) y(%d) from renderer with priority %d", cmd->xmlname, cmd->z, cmd->x, cmd->y, cmd->cmd);
     do {
-        switch (cmd->ver) {
+        if (conn && conn->framed == RENDERD_FRAMED_ON) {
+            if (renderd_send_frame(fd, conn, cmd, timeout))
+                break;
+            ret = -1;
+        } else switch (cmd->ver) {
         case 2: 
             ret = send(fd, cmd, sizeof(struct protocol_v2), 0);
             break;
@@ -234,23 +477,23 @@ static int request_tile(request_rec *r, struct protocol *cmd, int renderImmediat
 
         if ((ret == sizeof(struct protocol_v2)) || (ret == sizeof(struct protocol)))
             break;
-        
-        if (errno != EPIPE) {
+
+        if (errno != EPIPE && errno != ECONNRESET) {
             ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "request_tile: Failed to send request to renderer: %s", strerror(errno));
-            close(fd);
+            renderd_conn_close(conn, fd);
             return 0;
         }
-        close(fd);
+        renderd_conn_close(conn, fd);
 
         ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "request_tile: Reconnecting to rendering socket after failed request due to sigpipe");
 
-        fd = socket_init(r);
+        fd = renderd_conn_open(r, conn);
         if (fd == FD_INVALID)
             return 0;
     } while (retry--);
 
     if (renderImmediately) {
-        struct timeval tv = {(renderImmediately > 2?scfg->request_timeout_priority:scfg->request_timeout), 0 };
+        struct timeval tv = { timeout, 0 };
         fd_set rx;
         int s;
 
@@ -258,40 +501,61 @@ static int request_tile(request_rec *r, struct protocol *cmd, int renderImmediat
             FD_ZERO(&rx);
             FD_SET(fd, &rx);
             s = select(fd+1, &rx, NULL, NULL, &tv);
-            if (s == 1) {
+            if (s == 1 && conn && conn->framed == RENDERD_FRAMED_ON) {
+                struct protocol_v4_tile tile;
+
+                ret = renderd_recv_frame(r, fd, conn->next_id, &tile);
+                if (ret < 0) {
+                    renderd_conn_close(conn, fd);
+                    return 0;
+                }
+                if (ret > 0)
+                    return (tile.cmd == cmdDone);
+            } else if (s == 1) {
                 bzero(&resp, sizeof(struct protocol));
-                ret = recv(fd, &resp, sizeof(struct protocol_v2), 0);
+                ret = recv(fd, &resp, sizeof(struct protocol_v2), MSG_WAITALL);
                 if (ret != sizeof(struct protocol_v2)) {
                     ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "request_tile: Failed to read response from rendering socket %s",
                                   strerror(errno));
-                    break;
+                    renderd_conn_close(conn, fd);
+                    return 0;
                 }
                 if (resp.ver == 3) {
-                    ret += recv(fd, ((void*)&resp) + sizeof(struct protocol_v2), sizeof(struct protocol) - sizeof(struct protocol_v2), 0); 
+                    ret += recv(fd, ((void*)&resp) + sizeof(struct protocol_v2), sizeof(struct protocol) - sizeof(struct protocol_v2), MSG_WAITALL); 
+                }
+                if ((resp.ver != 2 && resp.ver != 3) || (resp.ver == 3 && ret != sizeof(struct protocol))) {
+                    /* Lost track of the message boundaries, start over on a fresh connection */
+                    ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "request_tile: Malformed response from rendering socket");
+                    renderd_conn_close(conn, fd);
+                    return 0;
                 }
 
                 if (cmd->x == resp.x && cmd->y == resp.y && cmd->z == resp.z && !strcmp(cmd->xmlname, resp.xmlname)) {
-                    close(fd);
+                    if (!conn)
+                        close(fd);
                     if (resp.cmd == cmdDone)
                         return 1;
                     else
                         return 0;
                 } else {
-                    ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                    /* With a persistent connection this is usually the late reply to a request that timed out earlier */
+                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
                        "Response does not match request: xml(%s,%s) z(%d,%d) x(%d,%d) y(%d,%d)", cmd->xmlname,
                        resp.xmlname, cmd->z, resp.z, cmd->x, resp.x, cmd->y, resp.y);
                 }
             } else {
                 ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
                               "request_tile: Request xml(%s) z(%d) x(%d) y(%d) could not be rendered in %i seconds",
-                              cmd->xmlname, cmd->z, cmd->x, cmd->y,
-                              (renderImmediately > 1?scfg->request_timeout_priority:scfg->request_timeout));
+                              cmd->xmlname, cmd->z, cmd->x, cmd->y, timeout);
                 break;
             }
         }
     }
 
-    close(fd);
+    /* Keep the connection for the next request. A reply that is still
+     * outstanding is discarded by renderd_conn_alive before the next send. */
+    if (!conn)
+        close(fd);
     return 0;
 }
 
@@ -361,6 +625,74 @@ static struct storage_backend * get_storage_backend(request_rec *r, int tile_lay
     return stores->stores[tile_layer];
 }
 
+/*
+ * Drop the result of a previous tile_fetch_request. Also registered as cleanup
+ * on the request pool.
+ */
+static apr_status_t tile_fetch_release(void * data)
+{
+    struct tile_request_data * rdata = (struct tile_request_data *)data;
+
+    if (rdata->slice_fd >= 0) {
+        close(rdata->slice_fd);
+        rdata->slice_fd = -1;
+    }
+    free(rdata->tile);
+    rdata->tile = NULL;
+    rdata->tile_len = -1;
+    rdata->etag[0] = 0;
+    rdata->format = formatUnknown;
+    rdata->stat_fetched = 0;
+    rdata->tile_fetched = 0;
+    return APR_SUCCESS;
+}
+
+/*
+ * Look up the tile in the storage backend and keep the result with the request,
+ * so that tile_state, add_expiry and tile_handler_serve don't each have to go back
+ * to the storage. If with_tile is set, the tile data is retrieved together with
+ * the stat info in a single pass, otherwise only the stat info is retrieved.
+ */
+static void tile_fetch_request(request_rec *r, struct protocol *cmd, int with_tile)
+{
+    struct tile_request_data * rdata = (struct tile_request_data *)ap_get_module_config(r->request_config, &tile_module);
+    struct storage_backend * store = rdata->store;
+    char err_msg[PATH_MAX];
+    size_t slice_len;
+    struct timeval start, end;
+
+    tile_fetch_release(rdata);
+    err_msg[0] = 0;
+
+    gettimeofday(&start, NULL);
+    if (!with_tile) {
+        rdata->stat = store->tile_stat(store, cmd->xmlname, cmd->options, cmd->x, cmd->y, cmd->z);
+    } else if (store->tile_read_slice) {
+        // Zero-copy path: the storage backend tells us where the tile lives and we let the kernel send it
+        if (store->tile_read_slice(store, cmd->xmlname, cmd->options, cmd->x, cmd->y, cmd->z, &rdata->slice_fd, &rdata->slice_offset, &slice_len, &rdata->compressed, &rdata->stat, rdata->etag, &rdata->format, err_msg) == 0) {
+            rdata->tile_len = (slice_len > (size_t)MAX_SIZE) ? -1 : (int)slice_len;
+        }
+        rdata->tile_fetched = 1;
+    } else {
+        rdata->tile = malloc(MAX_SIZE);
+        if (!rdata->tile) {
+            snprintf(err_msg, PATH_MAX - 1, "Failed to allocate tile buffer");
+            rdata->stat = store->tile_stat(store, cmd->xmlname, cmd->options, cmd->x, cmd->y, cmd->z);
+        } else if (store->tile_fetch) {
+            rdata->tile_len = store->tile_fetch(store, cmd->xmlname, cmd->options, cmd->x, cmd->y, cmd->z, rdata->tile, MAX_SIZE, &rdata->compressed, &rdata->stat, rdata->etag, &rdata->format, err_msg);
+        } else {
+            rdata->stat = store->tile_stat(store, cmd->xmlname, cmd->options, cmd->x, cmd->y, cmd->z);
+            rdata->tile_len = store->tile_read(store, cmd->xmlname, cmd->options, cmd->x, cmd->y, cmd->z, rdata->tile, MAX_SIZE, &rdata->compressed, err_msg);
+        }
+        rdata->tile_fetched = 1;
+    }
+    gettimeofday(&end, NULL);
+
+    rdata->stat_fetched = 1;
+    rdata->fetch_time = (end.tv_sec*1000000 + end.tv_usec) - (start.tv_sec*1000000 + start.tv_usec);
+    rdata->fetch_err = apr_pstrdup(r->pool, err_msg);
+}
+
 static enum tileState tile_state(request_rec *r, struct protocol *cmd)
 {
     ap_conf_vector_t *sconf = r->server->module_config;
@@ -369,7 +701,10 @@ static enum tileState tile_state(request_rec *r, struct protocol *cmd)
     struct stat_info stat;
     struct tile_request_data * rdata = (struct tile_request_data *)ap_get_module_config(r->request_config, &tile_module);
 
-    stat = rdata->store->tile_stat(rdata->store, cmd->xmlname, cmd->options, cmd->x, cmd->y, cmd->z);
+    if (!rdata->stat_fetched) {
+        tile_fetch_request(r, cmd, 0);
+    }
+    stat = rdata->stat;
 
     ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_state: determined state of %s %i %i %i on store %pp: Tile size: %li, expired: %i created: %li",
                       cmd->xmlname, cmd->x, cmd->y, cmd->z, rdata->store, stat.size, stat.expired, stat.mtime);
@@ -510,32 +845,59 @@ static void add_expiry(request_rec *r, struct protocol * cmd)
 
 
 
-static int get_global_lock(request_rec *r, apr_global_mutex_t * mutex) {
-    apr_status_t rs;
-    int camped;
+#define STATS_ADD(counter, value) __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+#define STATS_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
 
-    for (camped = 0; camped < MAXCAMP; camped++) {
-        rs = apr_global_mutex_trylock(mutex);
-        if (APR_STATUS_IS_EBUSY(rs)) {
-            apr_sleep(CAMPOUT);
-        } else if (rs == APR_SUCCESS) {
-            return 1;
-        } else if (APR_STATUS_IS_ENOTIMPL(rs)) {
-            /* If it's not implemented, just hang in the mutex. */
-            rs = apr_global_mutex_lock(mutex);
-            if (rs == APR_SUCCESS) {
-                return 1;
-            } else {
-                ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "Could not get hardlock");
-                return 0;
-            }
-        } else {
-            ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "Unknown return status from trylock");
-            return 0;
+/*
+ * Pick the stats shard of the current thread. Hashing pid and thread id
+ * together spreads the threads of one process as well as the processes.
+ */
+static stats_data * stats_shard(void) {
+    apr_uint64_t h = (apr_uint64_t)(unsigned long)apr_os_thread_current() ^ ((apr_uint64_t)getpid() << 32);
+    h *= 0x9E3779B97F4A7C15ull;
+    return (stats_data *)((char *)apr_shm_baseaddr_get(stats_shm) + stats_shard_size * ((h >> 32) % STATS_SHARDS));
+}
+
+/*
+ * Sum up the counters of all shards into local_stats. The per layer arrays
+ * of local_stats have to be allocated and zeroed by the caller.
+ */
+static void stats_aggregate(stats_data * local_stats, int noLayers) {
+    char * base = (char *)apr_shm_baseaddr_get(stats_shm);
+    int i, j;
+
+    for (i = 0; i < STATS_SHARDS; i++) {
+        stats_data * shard = (stats_data *)(base + stats_shard_size * i);
+        local_stats->noResp200 += STATS_LOAD(shard->noResp200);
+        local_stats->noResp304 += STATS_LOAD(shard->noResp304);
+        local_stats->noResp404 += STATS_LOAD(shard->noResp404);
+        local_stats->noResp503 += STATS_LOAD(shard->noResp503);
+        local_stats->noResp5XX += STATS_LOAD(shard->noResp5XX);
+        local_stats->noRespOther += STATS_LOAD(shard->noRespOther);
+        local_stats->noFreshCache += STATS_LOAD(shard->noFreshCache);
+        local_stats->noFreshRender += STATS_LOAD(shard->noFreshRender);
+        local_stats->noOldCache += STATS_LOAD(shard->noOldCache);
+        local_stats->noOldRender += STATS_LOAD(shard->noOldRender);
+        local_stats->noVeryOldCache += STATS_LOAD(shard->noVeryOldCache);
+        local_stats->noVeryOldRender += STATS_LOAD(shard->noVeryOldRender);
+        local_stats->totalBufferRetrievalTime += STATS_LOAD(shard->totalBufferRetrievalTime);
+        local_stats->noTotalBufferRetrieval += STATS_LOAD(shard->noTotalBufferRetrieval);
+        for (j = 0; j <= MAX_ZOOM_SERVER; j++) {
+            local_stats->noRespZoom[j] += STATS_LOAD(shard->noRespZoom[j]);
+            local_stats->zoomBufferRetrievalTime[j] += STATS_LOAD(shard->zoomBufferRetrievalTime[j]);
+            local_stats->noZoomBufferRetrieval[j] += STATS_LOAD(shard->noZoomBufferRetrieval[j]);
+        }
+        for (j = 0; j < noLayers; j++) {
+            local_stats->noResp200Layer[j] += STATS_LOAD(shard->noResp200Layer[j]);
+            local_stats->noResp404Layer[j] += STATS_LOAD(shard->noResp404Layer[j]);
+        }
+        for (j = 0; j < LATENCY_KINDS * (MAX_ZOOM_SERVER + 1) * LATENCY_BUCKETS; j++) {
+            (&local_stats->latencyZoom[0][0][0])[j] += STATS_LOAD((&shard->latencyZoom[0][0][0])[j]);
+        }
+        for (j = 0; j < LATENCY_KINDS * noLayers * LATENCY_BUCKETS; j++) {
+            local_stats->latencyLayer[j] += STATS_LOAD(shard->latencyLayer[j]);
         }
     }
-    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "Timedout trylock");
-    return 0;
 }
 
 static int incRespCounter(int resp, request_rec *r, struct protocol * cmd, int layerNumber) {
@@ -553,51 +915,45 @@ static int incRespCounter(int resp, request_rec *r, struct protocol * cmd, int l
         return 1;
     }
 
-    if (get_global_lock(r, stats_mutex) != 0) {
-        stats = (stats_data *)apr_shm_baseaddr_get(stats_shm);
-        switch (resp) {
-        case OK: {
-            stats->noResp200++;
-            if (cmd != NULL) {
-                stats->noRespZoom[cmd->z]++;
-                stats->noResp200Layer[layerNumber]++;
-            }
-            break;
-        }
-        case HTTP_NOT_MODIFIED: {
-            stats->noResp304++;
-            if (cmd != NULL) {
-                stats->noRespZoom[cmd->z]++;
-                stats->noResp200Layer[layerNumber]++;
-            }
-            break;
-        }
-        case HTTP_NOT_FOUND: {
-            stats->noResp404++;
-            stats->noResp404Layer[layerNumber]++;
-            break;
+    stats = stats_shard();
+    switch (resp) {
+    case OK: {
+        STATS_ADD(stats->noResp200, 1);
+        if (cmd != NULL) {
+            STATS_ADD(stats->noRespZoom[cmd->z], 1);
+            STATS_ADD(stats->noResp200Layer[layerNumber], 1);
         }
-        case HTTP_SERVICE_UNAVAILABLE: {
-            stats->noResp503++;
-            break;
-        }
-        case HTTP_INTERNAL_SERVER_ERROR: {
-            stats->noResp5XX++;
-            break;
-        }
-        default: {
-            stats->noRespOther++;
+        break;
+    }
+    case HTTP_NOT_MODIFIED: {
+        STATS_ADD(stats->noResp304, 1);
+        if (cmd != NULL) {
+            STATS_ADD(stats->noRespZoom[cmd->z], 1);
+            STATS_ADD(stats->noResp200Layer[layerNumber], 1);
         }
+        break;
+    }
+    case HTTP_NOT_FOUND: {
+        STATS_ADD(stats->noResp404, 1);
+        STATS_ADD(stats->noResp404Layer[layerNumber], 1);
+        break;
+    }
+    /* Throttled requests are counted as 503, which they used to be */
+    case HTTP_TOO_MANY_REQUESTS:
+    case HTTP_SERVICE_UNAVAILABLE: {
+        STATS_ADD(stats->noResp503, 1);
+        break;
+    }
+    case HTTP_INTERNAL_SERVER_ERROR: {
+        STATS_ADD(stats->noResp5XX, 1);
+        break;
+    }
+    default: {
+        STATS_ADD(stats->noRespOther, 1);
+    }
 
-        }
-        apr_global_mutex_unlock(stats_mutex);
-        /* Swallowing the result because what are we going to do with it at
-         * this stage?
-         */
-        return 1;
-    } else {
-        return 0;
     }
+    return 1;
 }
 
 static int incFreshCounter(int status, request_rec *r) {
@@ -615,43 +971,35 @@ static int incFreshCounter(int status, request_rec *r) {
         return 1;
     }
 
-    if (get_global_lock(r, stats_mutex) != 0) {
-        stats = (stats_data *)apr_shm_baseaddr_get(stats_shm);
-        switch (status) {
-        case FRESH: {
-            stats->noFreshCache++;
-            break;
-        }
-        case FRESH_RENDER: {
-            stats->noFreshRender++;
-            break;
-        }
-        case OLD: {
-            stats->noOldCache++;
-            break;
-        }
-        case VERYOLD: {
-            stats->noVeryOldCache++;
-            break;
-        }
-        case OLD_RENDER: {
-            stats->noOldRender++;
-            break;
-        }
-        case VERYOLD_RENDER: {
-            stats->noVeryOldRender++;
-            break;
-        }
+    stats = stats_shard();
+    switch (status) {
+    case FRESH: {
+        STATS_ADD(stats->noFreshCache, 1);
+        break;
+    }
+    case FRESH_RENDER: {
+        STATS_ADD(stats->noFreshRender, 1);
+        break;
+    }
+    case OLD: {
+        STATS_ADD(stats->noOldCache, 1);
+        break;
+    }
+    case VERYOLD: {
+        STATS_ADD(stats->noVeryOldCache, 1);
+        break;
+    }
+    case OLD_RENDER: {
+        STATS_ADD(stats->noOldRender, 1);
+        break;
+    }
+    case VERYOLD_RENDER: {
+        STATS_ADD(stats->noVeryOldRender, 1);
+        break;
+    }
 
-        }
-        apr_global_mutex_unlock(stats_mutex);
-        /* Swallowing the result because what are we going to do with it at
-         * this stage?
-         */
-        return 1;
-    } else {
-        return 0;
     }
+    return 1;
 }
 
 static int incTimingCounter(apr_uint64_t duration, int z, request_rec *r) {
@@ -669,32 +1017,121 @@ static int incTimingCounter(apr_uint64_t duration, int z, request_rec *r) {
         return 1;
     }
 
-    if (get_global_lock(r, stats_mutex) != 0) {
-        stats = (stats_data *)apr_shm_baseaddr_get(stats_shm);
-        stats->totalBufferRetrievalTime += duration;
-        stats->zoomBufferRetrievalTime[z] += duration;
-        stats->noTotalBufferRetrieval++;
-        stats->noZoomBufferRetrieval[z]++;
-        apr_global_mutex_unlock(stats_mutex);
-        /* Swallowing the result because what are we going to do with it at
-         * this stage?
-         */
-        return 1;
-    } else {
+    stats = stats_shard();
+    STATS_ADD(stats->totalBufferRetrievalTime, duration);
+    STATS_ADD(stats->zoomBufferRetrievalTime[z], duration);
+    STATS_ADD(stats->noTotalBufferRetrieval, 1);
+    STATS_ADD(stats->noZoomBufferRetrieval[z], 1);
+    return 1;
+}
+
+/*
+ * Record the time it took to serve a tile request in the histograms of its
+ * zoom level and layer.
+ */
+static void incLatencyCounter(apr_uint64_t duration, int kind, int z, int layerNumber, request_rec *r) {
+    stats_data *stats;
+    int b = latency_bucket(duration);
+
+    ap_conf_vector_t *sconf = r->server->module_config;
+    tile_server_conf *scfg = ap_get_module_config(sconf, &tile_module);
+
+    if (!scfg->enableGlobalStats) {
+        return;
+    }
+
+    stats = stats_shard();
+    STATS_ADD(stats->latencyZoom[kind][z][b], 1);
+    STATS_ADD(stats->latencyLayer[LATENCY_LAYER_OFFSET(layerNumber, kind) + b], 1);
+}
+
+/*
+ * Estimate the q quantile of a latency histogram, as the upper bound of the
+ * bucket it falls into.
+ */
+static apr_uint64_t latency_quantile(const apr_uint64_t * hist, apr_uint64_t count, double q) {
+    apr_uint64_t rank = (apr_uint64_t)(q * count);
+    apr_uint64_t seen = 0;
+    int b;
+
+    if (count == 0)
         return 0;
+    if (rank >= count)
+        rank = count - 1;
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > rank)
+            break;
     }
+    return (apr_uint64_t)1 << b;
 }
 
-static int delay_allowed(request_rec *r, enum tileState state) {
+static void latency_print(request_rec *r, const char * name, const apr_uint64_t * hist) {
+    apr_uint64_t count = 0;
+    int b;
+
+    for (b = 0; b < LATENCY_BUCKETS; b++)
+        count += hist[b];
+    ap_rprintf(r, "%sCount: %li\n", name, count);
+    ap_rprintf(r, "%sP50: %li\n", name, latency_quantile(hist, count, 0.5));
+    ap_rprintf(r, "%sP99: %li\n", name, latency_quantile(hist, count, 0.99));
+    ap_rprintf(r, "%sP999: %li\n", name, latency_quantile(hist, count, 0.999));
+}
+
+/*
+ * Take a token from a bucket that holds up to size tokens and gains one
+ * every rate microseconds. full_at is the time at which the bucket will be
+ * full again; taking a token pushes it back by one rate, and there is no
+ * token left if that would push it beyond size rates from now.
+ */
+static int delay_bucket_take(apr_time_t * full_at, apr_time_t now, long rate, int size) {
+    apr_time_t old = __atomic_load_n(full_at, __ATOMIC_RELAXED);
+    apr_time_t new;
+
+    do {
+        new = ((old > now) ? old : now) + rate;
+        if (new - now > (apr_time_t)rate * size) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(full_at, &old, new, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/*
+ * Take tiles tokens from a bucket regardless of how many are left. The
+ * bucket can go into debt by at most that many tokens.
+ */
+static void delay_bucket_charge(apr_time_t * full_at, apr_time_t now, long rate, int size, int tiles) {
+    apr_time_t old = __atomic_load_n(full_at, __ATOMIC_RELAXED);
+    apr_time_t limit = now + (apr_time_t)rate * (size + tiles);
+    apr_time_t new;
+
+    do {
+        new = ((old > now) ? old : now) + (apr_time_t)rate * tiles;
+        if (new > limit) {
+            new = limit;
+        }
+    } while (!__atomic_compare_exchange_n(full_at, &old, new, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Number of microseconds until the next token arrives in an empty bucket */
+static apr_time_t delay_bucket_wait(apr_time_t * full_at, apr_time_t now, long rate, int size) {
+    apr_time_t wait = __atomic_load_n(full_at, __ATOMIC_RELAXED) + rate - (apr_time_t)rate * size - now;
+    return (wait > 0) ? wait : 0;
+}
+
+/*
+ * Find the delay pool entry of the client making the request. Returns 1 and
+ * sets user if the client is subject to throttling, 0 for whitelisted
+ * clients and -1 if the client address can't be parsed. is_new is set if the
+ * entry was handed over to this client, in which case its buckets are full.
+ */
+static int delay_pool_user(request_rec *r, const char ** client_ip, delaypool_entry ** user, int * is_new) {
     delaypool * delayp;
-    int delay = 0;
-    int i,j;
     char ** strtok_state;
     char * tmp;
     const char * ip_addr = NULL;
-    apr_time_t now;
-    int tiles_topup;
-    int render_topup;
+    apr_uint64_t ip_tag, old_tag;
     uint32_t hashkey;
     struct in_addr sin_addr;
     struct in6_addr ip;
@@ -736,7 +1173,7 @@ static int delay_allowed(request_rec *r, enum tileState state) {
 #endif
         }
     }
-
+    *client_ip = ip_addr;
 
     if (inet_pton(AF_INET,ip_addr,&sin_addr) > 0) {
         //ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "Checking delays: for IP %s appears to be an IPv4 address", ip_addr);
@@ -744,94 +1181,79 @@ static int delay_allowed(request_rec *r, enum tileState state) {
         memcpy(&(ip.s6_addr[12]), &(sin_addr.s_addr), 4);
         hashkey = sin_addr.s_addr % DELAY_HASHTABLE_WHITELIST_SIZE;
         if (delayp->whitelist[hashkey] == sin_addr.s_addr) {
-            return 1;
+            return 0;
         }
     } else {
         if (inet_pton(AF_INET6,ip_addr,&ip) <= 0) {
             ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "Checking delays: for IP %s. Don't know what it is", ip_addr);
-            return 0;
+            return -1;
         }
     }
 
     hashkey = (ip.s6_addr32[0] ^ ip.s6_addr32[1] ^ ip.s6_addr32[2] ^ ip.s6_addr32[3]) % DELAY_HASHTABLE_SIZE;
-    
-    /* If a delaypool fillup is ongoing, just skip accounting to not block on a lock */
-    if (delayp->locked) {
-        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "skipping delay pool accounting, during fillup procedure\n");
+    /* Tag 0 marks an unused entry */
+    ip_tag = ((((apr_uint64_t)ip.s6_addr32[0] << 32) | ip.s6_addr32[1]) ^ (((apr_uint64_t)ip.s6_addr32[2] << 32) | ip.s6_addr32[3])) | 1;
+    *user = &(delayp->users[hashkey]);
+    *is_new = 0;
+
+    old_tag = __atomic_load_n(&((*user)->ip_tag), __ATOMIC_ACQUIRE);
+    if (old_tag != ip_tag) {
+        /* Whoever wins the swap hands out full buckets to the new client */
+        if (__atomic_compare_exchange_n(&((*user)->ip_tag), &old_tag, ip_tag, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "Creating a new delaypool for ip %s\n", ip_addr);
+            __atomic_store_n(&((*user)->tiles_full_at), 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&((*user)->render_full_at), 0, __ATOMIC_RELAXED);
+        }
+        *is_new = 1;
+    }
+    return 1;
+}
+
+/*
+ * Check if the client still has tokens in its buckets. As the buckets are
+ * topped up on access, there is no separate fillup procedure. If it doesn't,
+ * a Retry-After header is set telling it when the next token arrives.
+ */
+static int delay_allowed(request_rec *r, enum tileState state) {
+    delaypool_entry * user;
+    int delay = 0;
+    int is_new;
+    const char * ip_addr = NULL;
+    apr_time_t now;
+    apr_time_t wait;
+
+    ap_conf_vector_t *sconf = r->server->module_config;
+    tile_server_conf *scfg = ap_get_module_config(sconf, &tile_module);
+
+    switch (delay_pool_user(r, &ip_addr, &user, &is_new)) {
+    case 0:
         return 1;
+    case -1:
+        return 0;
     }
-    
-    if (get_global_lock(r,delay_mutex) == 0) {
-        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Could not acquire lock, skipping delay pool accounting\n");
+    if (is_new) {
         return 1;
-    };
-
-    if (memcmp(&(delayp->users[hashkey].ip_addr), &ip, sizeof(struct in6_addr)) == 0) {
-        /* Repeat the process to determine if we have tockens in the bucket, as the fillup only runs once a client hits an empty bucket,
-           so in the mean time, the bucket might have been filled */
-        for (j = 0; j < 3; j++) {
-            //ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "Checking delays: Current poolsize: %i tiles and %i renders\n", delayp->users[hashkey].available_tiles, delayp->users[hashkey].available_render_req);
-            delay = 0;
-            if (delayp->users[hashkey].available_tiles > 0) {
-                delayp->users[hashkey].available_tiles--;
-            } else {
-                delay = 1;
-            }
-            if (state == tileMissing) {
-                if (delayp->users[hashkey].available_render_req > 0) {
-                    delayp->users[hashkey].available_render_req--;
-                } else {
-                    delay = 2;
-                }
-            }
+    }
 
-            if (delay > 0) {
-                /* If we are on the second round, we really  hit an empty delaypool, timeout for a while to slow down clients */
-                if (j > 0) {
-                    apr_global_mutex_unlock(delay_mutex);
-                    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Delaypool: Client %s has hit its limits, throttling (%i)\n", ip_addr, delay);
-                    sleep(CLIENT_PENALTY);
-                    if (get_global_lock(r,delay_mutex) == 0) {
-                        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Could not acquire lock, but had to delay\n");
-                        return 0;
-                    };
-                }
-                /* We hit an empty bucket, so run the bucket fillup procedure to check if new tokens should have arrived in the mean time. */
-                now = apr_time_now();
-                tiles_topup = (now - delayp->last_tile_fillup) / scfg->delaypoolTileRate;
-                render_topup = (now - delayp->last_render_fillup) / scfg->delaypoolRenderRate;
-                //ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "Filling up pools with %i tiles and %i renders\n", tiles_topup, render_topup);
-                if ((tiles_topup > 0) || (render_topup > 0)) {
-                    delayp->locked = 1;
-                    for (i = 0; i < DELAY_HASHTABLE_SIZE; i++) {
-                        delayp->users[i].available_tiles += tiles_topup;
-                        delayp->users[i].available_render_req += render_topup;
-                        if (delayp->users[i].available_tiles > scfg->delaypoolTileSize) {
-                            delayp->users[i].available_tiles = scfg->delaypoolTileSize;
-                        }
-                        if (delayp->users[i].available_render_req > scfg->delaypoolRenderSize) {
-                            delayp->users[i].available_render_req = scfg->delaypoolRenderSize;
-                        }
-                    }
-                    delayp->locked = 0;
-                }
-                delayp->last_tile_fillup += scfg->delaypoolTileRate*tiles_topup;
-                delayp->last_render_fillup += scfg->delaypoolRenderRate*render_topup;                
-                
-            } else {
-                break;
-            }
+    now = apr_time_now();
+    if (!delay_bucket_take(&(user->tiles_full_at), now, scfg->delaypoolTileRate, scfg->delaypoolTileSize)) {
+        delay = 1;
+    }
+    if (state == tileMissing) {
+        if (!delay_bucket_take(&(user->render_full_at), now, scfg->delaypoolRenderRate, scfg->delaypoolRenderSize)) {
+            delay = 2;
         }
-    } else {
-        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "Creating a new delaypool for ip %s\n", ip_addr);
-        memcpy(&(delayp->users[hashkey].ip_addr), &ip, sizeof(struct in6_addr));
-        delayp->users[hashkey].available_tiles = scfg->delaypoolTileSize;
-        delayp->users[hashkey].available_render_req = scfg->delaypoolRenderSize;
-        delay = 0;
     }
-    apr_global_mutex_unlock(delay_mutex);
 
     if (delay > 0) {
+        if (delay == 1) {
+            wait = delay_bucket_wait(&(user->tiles_full_at), now, scfg->delaypoolTileRate, scfg->delaypoolTileSize);
+        } else {
+            wait = delay_bucket_wait(&(user->render_full_at), now, scfg->delaypoolRenderRate, scfg->delaypoolRenderSize);
+        }
+        wait = (wait + APR_USEC_PER_SEC - 1) / APR_USEC_PER_SEC;
+        apr_table_setn(r->err_headers_out, "Retry-After",
+                       apr_psprintf(r->pool, "%" APR_TIME_T_FMT, (wait > 0) ? wait : 1));
         ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Delaypool: Client %s has hit its limits, rejecting (%i)\n", ip_addr, delay);
         return 0;
     } else {
@@ -839,6 +1261,29 @@ static int delay_allowed(request_rec *r, enum tileState state) {
     }
 }
 
+/*
+ * Penalise a client for an invalid request by taking CLIENT_PENALTY tiles
+ * from its delay pool, instead of holding up a worker thread. Clients that
+ * keep making invalid requests end up being throttled.
+ */
+static void delay_penalize(request_rec *r) {
+    delaypool_entry * user;
+    int is_new;
+    const char * ip_addr = NULL;
+
+    ap_conf_vector_t *sconf = r->server->module_config;
+    tile_server_conf *scfg = ap_get_module_config(sconf, &tile_module);
+
+    if (!scfg->enableTileThrottling) {
+        return;
+    }
+    if (delay_pool_user(r, &ip_addr, &user, &is_new) <= 0) {
+        return;
+    }
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "Delaypool: Penalising client %s for an invalid request", ip_addr);
+    delay_bucket_charge(&(user->tiles_full_at), apr_time_now(), scfg->delaypoolTileRate, scfg->delaypoolTileSize, CLIENT_PENALTY);
+}
+
 static int tile_handler_dirty(request_rec *r)
 {
     ap_conf_vector_t *sconf;
@@ -893,18 +1338,23 @@ static int tile_storage_hook(request_rec *r)
         return DECLINED;
 
     avg = get_load_avg();
+    /* Locating a slice is as cheap as a stat, so it is done together with it.
+     * Other backends would transfer the whole tile, even for requests that are
+     * throttled or rendered, so they only read it in tile_handler_serve */
+    tile_fetch_request(r, cmd, rdata->store->tile_read_slice != NULL);
     state = tile_state(r, cmd);
 
     sconf = r->server->module_config;
     scfg = ap_get_module_config(sconf, &tile_module);
 
     if (scfg->enableTileThrottling && !delay_allowed(r, state)) {
-        if (!incRespCounter(HTTP_SERVICE_UNAVAILABLE, r, cmd, rdata->layerNumber)) {
+        if (!incRespCounter(HTTP_TOO_MANY_REQUESTS, r, cmd, rdata->layerNumber)) {
                    ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
                         "Failed to increase response stats counter");
         }
-        return HTTP_SERVICE_UNAVAILABLE;        
+        return HTTP_TOO_MANY_REQUESTS;
     }
+    rdata->latency_kind = LATENCY_HIT;
 
     switch (state) {
         case tileCurrent:
@@ -945,13 +1395,16 @@ static int tile_storage_hook(request_rec *r)
     }
 
     if (request_tile(r, cmd, renderPrio)) {
-        //TODO: update finfo
+        // The tile has been rendered, so what we fetched before is stale now
+        tile_fetch_release(rdata);
+        rdata->latency_kind = LATENCY_RENDER;
         if (!incFreshCounter(FRESH_RENDER, r)) {
             ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
                     "Failed to increase fresh stats counter");
         }
         return OK;
     }
+    rdata->latency_kind = LATENCY_TIMEOUT;
 
     if (state == tileOld) {
         if (!incFreshCounter(OLD_RENDER, r)) {
@@ -991,7 +1444,7 @@ static int tile_handler_status(request_rec *r)
     rdata = (struct tile_request_data *)ap_get_module_config(r->request_config, &tile_module);
     cmd = rdata->cmd;
     if (cmd == NULL){
-        sleep(CLIENT_PENALTY);
+        delay_penalize(r);
         return HTTP_NOT_FOUND;
     }
 
@@ -1093,9 +1546,9 @@ static int tile_handler_json(request_rec *r)
 
 static int tile_handler_mod_stats(request_rec *r)
 {
-    stats_data * stats;
+    static const char * latency_names[LATENCY_KINDS] = {"Hit", "Render", "Timeout"};
     stats_data local_stats;
-    int i;
+    int i, j, k;
     ap_conf_vector_t *sconf;
     tile_server_conf *scfg;
     tile_config_rec *tile_configs;
@@ -1111,20 +1564,11 @@ static int tile_handler_mod_stats(request_rec *r)
         return error_message(r, "Stats are not enabled for this server");
     }
 
-    if (get_global_lock(r,stats_mutex) != 0) {
-        //Copy over the global counter variable into
-        //local variables, that we can immediately
-        //release the lock again
-        stats = (stats_data *) apr_shm_baseaddr_get(stats_shm);
-        memcpy(&local_stats, stats, sizeof(stats_data));
-        local_stats.noResp200Layer = malloc(sizeof(apr_uint64_t) * scfg->configs->nelts);
-        memcpy(local_stats.noResp200Layer, stats->noResp200Layer, sizeof(apr_uint64_t) * scfg->configs->nelts);
-        local_stats.noResp404Layer = malloc(sizeof(apr_uint64_t) * scfg->configs->nelts);
-        memcpy(local_stats.noResp404Layer, stats->noResp404Layer, sizeof(apr_uint64_t) * scfg->configs->nelts);
-        apr_global_mutex_unlock(stats_mutex);
-    } else {
-        return error_message(r, "Failed to acquire lock, can't display stats");
-    }
+    memset(&local_stats, 0, sizeof(stats_data));
+    local_stats.noResp200Layer = calloc(scfg->configs->nelts, sizeof(apr_uint64_t));
+    local_stats.noResp404Layer = calloc(scfg->configs->nelts, sizeof(apr_uint64_t));
+    local_stats.latencyLayer = calloc(LATENCY_KINDS * scfg->configs->nelts * LATENCY_BUCKETS, sizeof(apr_uint64_t));
+    stats_aggregate(&local_stats, scfg->configs->nelts);
 
     ap_rprintf(r, "NoResp200: %li\n", local_stats.noResp200);
     ap_rprintf(r, "NoResp304: %li\n", local_stats.noResp304);
@@ -1153,22 +1597,96 @@ static int tile_handler_mod_stats(request_rec *r)
         ap_rprintf(r,"NoRes200Layer%s: %li\n", tile_config->baseuri, local_stats.noResp200Layer[i]);
         ap_rprintf(r,"NoRes404Layer%s: %li\n", tile_config->baseuri, local_stats.noResp404Layer[i]);
     }
+
+    /* Latencies in microseconds, split by whether the tile came from the cache,
+     * was rendered while the client waited, or the render timed out */
+    for (k = 0; k < LATENCY_KINDS; k++) {
+        apr_uint64_t total[LATENCY_BUCKETS];
+        memset(total, 0, sizeof(total));
+        for (i = 0; i <= global_max_zoom; i++) {
+            for (j = 0; j < LATENCY_BUCKETS; j++) {
+                total[j] += local_stats.latencyZoom[k][i][j];
+            }
+        }
+        latency_print(r, apr_psprintf(r->pool, "Latency%s", latency_names[k]), total);
+        for (j = 0; j < LATENCY_BUCKETS; j++) {
+            ap_rprintf(r, "Latency%sBucket%02i: %li\n", latency_names[k], j, total[j]);
+        }
+        for (i = 0; i <= global_max_zoom; i++) {
+            latency_print(r, apr_psprintf(r->pool, "Latency%sZoom%02i", latency_names[k], i), local_stats.latencyZoom[k][i]);
+        }
+        for (i = 0; i < scfg->configs->nelts; ++i) {
+            tile_config_rec *tile_config = &tile_configs[i];
+            latency_print(r, apr_psprintf(r->pool, "Latency%sLayer%s", latency_names[k], tile_config->baseuri),
+                          local_stats.latencyLayer + LATENCY_LAYER_OFFSET(i, k));
+        }
+    }
+
     free(local_stats.noResp200Layer);
     free(local_stats.noResp404Layer);
+    free(local_stats.latencyLayer);
     return OK;
 }
 
+static apr_status_t tile_slice_cleanup(void *data)
+{
+    return apr_file_close((apr_file_t *)data);
+}
+
+/*
+ * Calculate the MD5 of a tile that lives at offset within the open
+ * metatile fd, by mapping the pages it spans rather than reading it.
+ */
+static char * tile_slice_md5(request_rec *r, int fd, off_t offset, size_t len)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    off_t map_offset = offset - (offset % pagesize);
+    size_t map_len = len + (offset - map_offset);
+    char *map;
+    char *md5;
+
+    map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, map_offset);
+    if (map == MAP_FAILED) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "Failed to map tile slice: %s", strerror(errno));
+        return NULL;
+    }
+    md5 = ap_md5_binary(r->pool, (unsigned char *)map + (offset - map_offset), len);
+    munmap(map, map_len);
+    return md5;
+}
+
+/*
+ * Hand the tile slice to Apache as a file bucket, so that the core output
+ * filter can sendfile it to the client without copying it through user space.
+ * The fd is owned by the request pool from here on.
+ */
+static apr_status_t tile_send_slice(request_rec *r, int fd, off_t offset, size_t len)
+{
+    apr_file_t *file = NULL;
+    apr_os_file_t os_fd = fd;
+    apr_bucket_brigade *bb;
+    apr_status_t rv;
+
+    rv = apr_os_file_put(&file, &os_fd, APR_FOPEN_READ | APR_FOPEN_SENDFILE_ENABLED, r->pool);
+    if (rv != APR_SUCCESS) {
+        close(fd);
+        return rv;
+    }
+    apr_pool_cleanup_register(r->pool, file, tile_slice_cleanup, apr_pool_cleanup_null);
+
+    bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    apr_brigade_insert_file(bb, file, offset, len, r->pool);
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(r->connection->bucket_alloc));
+    return ap_pass_brigade(r->output_filters, bb);
+}
+
 static int tile_handler_serve(request_rec *r)
 {
-    const int tile_max = MAX_SIZE;
-    char err_msg[PATH_MAX];
     char id[PATH_MAX];
-    char *buf;
     int len;
-    int compressed;
     apr_status_t errstatus;
-    struct timeval start, end;
-    char *md5;
+    const char *etag = NULL;
+    const char *mimetype;
     tile_config_rec *tile_configs;
     struct tile_request_data * rdata;
     struct protocol * cmd;
@@ -1182,7 +1700,7 @@ static int tile_handler_serve(request_rec *r)
     rdata = (struct tile_request_data *)ap_get_module_config(r->request_config, &tile_module);
     cmd = rdata->cmd;
     if (cmd == NULL){
-        sleep(CLIENT_PENALTY);
+        delay_penalize(r);
         if (!incRespCounter(HTTP_NOT_FOUND, r, cmd, rdata->layerNumber)) {
             ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
                     "Failed to increase response stats counter");
@@ -1199,25 +1717,31 @@ static int tile_handler_serve(request_rec *r)
         if (resp != DONE) return resp;
     }
 
-    gettimeofday(&start,NULL);
+    // Backends with slices have already located the tile together with its state in tile_storage_hook
+    if (!rdata->tile_fetched) {
+        tile_fetch_request(r, cmd, 1);
+    }
+    len = rdata->tile_len;
 
-    // FIXME: It is a waste to do the malloc + read if we are fulfilling a HEAD or returning a 304.
-    buf = malloc(tile_max);
-    if (!buf) {
-        if (!incRespCounter(HTTP_INTERNAL_SERVER_ERROR, r, cmd, rdata->layerNumber)) {
-            ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
-                    "Failed to increase response stats counter");
+    // Use a hash of the content as only cache attribute.
+    // If a tile is re-rendered and produces the same output
+    // then we can continue to use the previous cached copy.
+    // Metatiles written by renderd carry this hash for each tile in their header,
+    // so that a 304 or HEAD response doesn't need to touch the tile data at all.
+    if (len > 0) {
+        if (rdata->etag[0]) {
+            etag = rdata->etag;
+        } else if (rdata->slice_fd >= 0) {
+            etag = tile_slice_md5(r, rdata->slice_fd, rdata->slice_offset, len);
+            if (!etag) len = -1;
+        } else {
+            etag = ap_md5_binary(r->pool, (unsigned char *)rdata->tile, len);
         }
-        return HTTP_INTERNAL_SERVER_ERROR;
     }
-
-    err_msg[0] = 0;
-
-    len = rdata->store->tile_read(rdata->store, cmd->xmlname, cmd->options, cmd->x, cmd->y, cmd->z, buf, tile_max, &compressed, err_msg);
     ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                  "Read tile of length %i from %s: %s", len, rdata->store->tile_storage_id(rdata->store, cmd->xmlname, cmd->options, cmd->x, cmd->y, cmd->z, id), err_msg);
+                  "Read tile of length %i from %s: %s", len, rdata->store->tile_storage_id(rdata->store, cmd->xmlname, cmd->options, cmd->x, cmd->y, cmd->z, id), rdata->fetch_err);
     if (len > 0) {
-        if (compressed) {
+        if (rdata->compressed) {
             const char* accept_encoding = apr_table_get(r->headers_in,"Accept-Encoding");
             if (accept_encoding && strstr(accept_encoding,"gzip")) {
                 r->content_encoding = "gzip";
@@ -1228,36 +1752,35 @@ static int tile_handler_serve(request_rec *r)
             }
         }
         
-#if 0
-        // Set default Last-Modified and Etag headers
-        ap_update_mtime(r, r->finfo.mtime);
-        ap_set_last_modified(r);
-        ap_set_etag(r);
-#else
-        // Use MD5 hash as only cache attribute.
-        // If a tile is re-rendered and produces the same output
-        // then we can continue to use the previous cached copy
-        md5 = ap_md5_binary(r->pool, (unsigned char *)buf, len);
         apr_table_setn(r->headers_out, "ETag",
-                        apr_psprintf(r->pool, "\"%s\"", md5));
-#endif
-        ap_set_content_type(r, tile_configs[rdata->layerNumber].mimeType);
+                        apr_psprintf(r->pool, "\"%s\"", etag));
+        // Metatiles record the format renderd encoded their tiles in, older ones fall back to the configured type
+        mimetype = tile_format_mimetype(rdata->format);
+        ap_set_content_type(r, mimetype ? mimetype : tile_configs[rdata->layerNumber].mimeType);
         ap_set_content_length(r, len);
         add_expiry(r, cmd);
 
-        gettimeofday(&end,NULL);
-        incTimingCounter((end.tv_sec*1000000 + end.tv_usec) - (start.tv_sec*1000000 + start.tv_usec) , cmd->z, r);
+        incTimingCounter(rdata->fetch_time, cmd->z, r);
         
         if ((errstatus = ap_meets_conditions(r)) != OK) {
-            free(buf);
             if (!incRespCounter(errstatus, r, cmd, rdata->layerNumber)) {
                 ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
                         "Failed to increase response stats counter");
             }
             return errstatus;
         } else {
-            ap_rwrite(buf, len, r);
-            free(buf);
+            if (r->header_only) {
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_handler_serve: HEAD request, not sending tile data");
+            } else if (rdata->slice_fd >= 0) {
+                apr_status_t rv = tile_send_slice(r, rdata->slice_fd, rdata->slice_offset, len);
+                // The request pool owns the metatile fd now
+                rdata->slice_fd = -1;
+                if (rv != APR_SUCCESS) {
+                    ap_log_rerror(APLOG_MARK, APLOG_INFO, rv, r, "Failed to send tile to client");
+                }
+            } else {
+                ap_rwrite(rdata->tile, len, r);
+            }
             if (!incRespCounter(errstatus, r, cmd, rdata->layerNumber)) {
                 ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
                         "Failed to increase response stats counter");
@@ -1265,8 +1788,7 @@ static int tile_handler_serve(request_rec *r)
             return OK;
         }
     }
-    free(buf);
-    ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "Failed to read tile from disk: %s", err_msg);
+    ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "Failed to read tile from disk: %s", rdata->fetch_err);
     if (!incRespCounter(HTTP_NOT_FOUND, r, cmd, rdata->layerNumber)) {
         ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
                 "Failed to increase response stats counter");
@@ -1274,11 +1796,151 @@ static int tile_handler_serve(request_rec *r)
     return DECLINED;
 }
 
+/*
+ * Compile the baseuris of all tile layers of a server into a hash, so that
+ * tile_translate can find the layer of a request with a handful of lookups
+ * instead of comparing it against every layer. As baseuris always end in a
+ * '/', only the prefixes of the uri up to a '/' need to be looked up.
+ */
+static void tile_router_build(apr_pool_t *p, tile_server_conf *scfg)
+{
+    tile_config_rec *tile_configs = (tile_config_rec *) scfg->configs->elts;
+    int i;
+
+    scfg->router = apr_hash_make(p);
+    scfg->router_maxlen = 0;
+    for (i = 0; i < scfg->configs->nelts; ++i) {
+        tile_config_rec *tile_config = &tile_configs[i];
+        int *layer;
+        int len = strlen(tile_config->baseuri);
+
+        /* Earlier layers take precedence, as they did with the linear search */
+        if (apr_hash_get(scfg->router, tile_config->baseuri, len) != NULL)
+            continue;
+        layer = apr_palloc(p, sizeof(int));
+        *layer = i;
+        apr_hash_set(scfg->router, tile_config->baseuri, len, layer);
+        if (len > scfg->router_maxlen)
+            scfg->router_maxlen = len;
+    }
+}
+
+/*
+ * Find the tile layer whose baseuri is a prefix of uri. If several are, the
+ * one configured first wins. Returns -1 if there is none.
+ */
+static int tile_router_lookup(tile_server_conf *scfg, const char *uri)
+{
+    tile_config_rec *tile_configs = (tile_config_rec *) scfg->configs->elts;
+    int layer = -1;
+    int i;
+
+    if (scfg->router == NULL) {
+        for (i = 0; i < scfg->configs->nelts; ++i) {
+            if (!strncmp(tile_configs[i].baseuri, uri, strlen(tile_configs[i].baseuri)))
+                return i;
+        }
+        return -1;
+    }
+
+    for (i = 0; uri[i] && i < scfg->router_maxlen; i++) {
+        if (uri[i] == '/') {
+            int *match = apr_hash_get(scfg->router, uri, i + 1);
+            if (match && (layer < 0 || *match < layer))
+                layer = *match;
+        }
+    }
+    return layer;
+}
+
+static const char * tile_parse_int(const char *p, int *value)
+{
+    long v = 0;
+    int neg = 0;
+    int digits = 0;
+
+    if (*p == '-') {
+        neg = 1;
+        p++;
+    } else if (*p == '+') {
+        p++;
+    }
+    while (*p >= '0' && *p <= '9') {
+        v = v * 10 + (*p++ - '0');
+        if (++digits > 10)
+            return NULL;
+    }
+    if (digits == 0 || v > INT_MAX)
+        return NULL;
+    *value = neg ? -v : v;
+    return p;
+}
+
+/*
+ * Parse the part of a tile uri after the baseuri, i.e. "[parameters/]z/x/y.ext[/option]",
+ * without copying anything but the parameters. Returns the number of fields
+ * parsed, counted the same way as the sscanf formats this replaces did.
+ */
+static int tile_parse_uri(const char *p, int withParameters, char *parameters, struct protocol *cmd,
+                          const char **extension, int *extension_len, const char **option)
+{
+    const char *start;
+    int n = 0;
+
+    if (withParameters) {
+        start = p;
+        while (*p && *p != '/' && p - start < XMLCONFIG_MAX - 1)
+            p++;
+        if (p == start)
+            return n;
+        memcpy(parameters, start, p - start);
+        parameters[p - start] = 0;
+        n++;
+        if (*p++ != '/')
+            return n;
+    } else {
+        parameters[0] = 0;
+    }
+
+    if ((p = tile_parse_int(p, &(cmd->z))) == NULL)
+        return n;
+    n++;
+    if (*p++ != '/' || (p = tile_parse_int(p, &(cmd->x))) == NULL)
+        return n;
+    n++;
+    if (*p++ != '/' || (p = tile_parse_int(p, &(cmd->y))) == NULL)
+        return n;
+    n++;
+    if (*p++ != '.')
+        return n;
+
+    start = p;
+    while (*p >= 'a' && *p <= 'z')
+        p++;
+    if (p == start)
+        return n;
+    *extension = start;
+    *extension_len = p - start;
+    n++;
+
+    if (*p++ != '/' || *p == 0)
+        return n;
+    *option = p;
+    n++;
+    return n;
+}
+
 static int tile_translate(request_rec *r)
 {
     int i,n,limit,oob;
-    char option[11];
-    char extension[256];
+    const char *option = NULL;
+    const char *extension = NULL;
+    int extension_len = 0;
+    const char *path;
+    char parameters[XMLCONFIG_MAX];
+    tile_config_rec *tile_config;
+    struct tile_request_data * rdata;
+    struct protocol * cmd;
 
     ap_conf_vector_t *sconf = r->server->module_config;
     tile_server_conf *scfg = ap_get_module_config(sconf, &tile_module);
@@ -1299,102 +1961,99 @@ static int tile_translate(request_rec *r)
         return OK;
     }
 
-    for (i = 0; i < scfg->configs->nelts; ++i) {
-        tile_config_rec *tile_config = &tile_configs[i];
-
-        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_translate: testing baseuri(%s) name(%s) extension(%s)",
-                tile_config->baseuri, tile_config->xmlname, tile_config->fileExtension );
+    i = tile_router_lookup(scfg, r->uri);
+    if (i < 0) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_translate: No suitable tile layer found");
+        return DECLINED;
+    }
+    tile_config = &tile_configs[i];
+    path = r->uri + strlen(tile_config->baseuri);
 
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_translate: matched baseuri(%s) name(%s) extension(%s)",
+            tile_config->baseuri, tile_config->xmlname, tile_config->fileExtension );
 
-        if (!strncmp(tile_config->baseuri, r->uri, strlen(tile_config->baseuri))) {
+    rdata = (struct tile_request_data *) apr_pcalloc(r->pool, sizeof(struct tile_request_data));
+    cmd = (struct protocol *) apr_pcalloc(r->pool, sizeof(struct protocol));
+    if (!strncmp(path,"tile-layer.json", strlen("tile-layer.json"))) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_translate: Requesting tileJSON for tilelayer %s", tile_config->xmlname);
+        r->handler = "tile_json";
+        rdata->layerNumber = i;
+        ap_set_module_config(r->request_config, &tile_module, rdata);
+        return OK;
+    }
 
-            struct tile_request_data * rdata = (struct tile_request_data *) apr_pcalloc(r->pool, sizeof(struct tile_request_data));
-            struct protocol * cmd = (struct protocol *) apr_pcalloc(r->pool, sizeof(struct protocol));
-            bzero(cmd, sizeof(struct protocol));
-            bzero(rdata, sizeof(struct tile_request_data));
-            if (!strncmp(r->uri + strlen(tile_config->baseuri),"tile-layer.json", strlen("tile-layer.json"))) {
-                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_translate: Requesting tileJSON for tilelayer %s", tile_config->xmlname);
-                r->handler = "tile_json";
-                rdata->layerNumber = i;
-                ap_set_module_config(r->request_config, &tile_module, rdata);
-                return OK;
-            }
+    if (tile_config->enableOptions) {
+        cmd->ver = PROTO_VER;
+        n = tile_parse_uri(path, 1, parameters, cmd, &extension, &extension_len, &option);
+        if (n < 5) { 
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_translate: Invalid URL for tilelayer %s with options", tile_config->xmlname); 
+            return DECLINED; 
+        } 
+    } else { 
+        cmd->ver = 2;
+        n = tile_parse_uri(path, 0, parameters, cmd, &extension, &extension_len, &option);
+        if (n < 4) { 
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_translate: Invalid URL for tilelayer %s without options", tile_config->xmlname); 
+            return DECLINED; 
+        }
+    }
+    if (extension_len != (int)strlen(tile_config->fileExtension) || strncmp(extension, tile_config->fileExtension, extension_len) != 0) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_translate: Invalid file extension (%.*s) for tilelayer %s, required %s",
+                extension_len, extension, tile_config->xmlname, tile_config->fileExtension);
+        return DECLINED;
+    }
 
-            char parameters[XMLCONFIG_MAX];
-            if (tile_config->enableOptions) {
-                cmd->ver = PROTO_VER;
-                n = sscanf(r->uri+strlen(tile_config->baseuri),"%40[^/]/%d/%d/%d.%255[a-z]/%10s", parameters,&(cmd->z), &(cmd->x), &(cmd->y), extension, option); 
-                if (n < 5) { 
-                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_translate: Invalid URL for tilelayer %s with options", tile_config->xmlname); 
-                    return DECLINED; 
-                } 
-            } else { 
-                cmd->ver = 2;
-                n = sscanf(r->uri+strlen(tile_config->baseuri),"%d/%d/%d.%255[a-z]/%10s", &(cmd->z), &(cmd->x), &(cmd->y), extension, option); 
-                if (n < 4) { 
-                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_translate: Invalid URL for tilelayer %s without options", tile_config->xmlname); 
-                    return DECLINED; 
-                }
-                parameters[0] = 0;
-            }
-            if (strcmp(extension, tile_config->fileExtension) != 0) {
-                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_translate: Invalid file extension (%s) for tilelayer %s, required %s",
-                        extension, tile_config->xmlname, tile_config->fileExtension);
-                return DECLINED;
-            }
+    oob = (cmd->z < tile_config->minzoom || cmd->z > tile_config->maxzoom);
+    if (!oob) {
+         // valid x/y for tiles are 0 ... 2^zoom-1
+         limit = (1 << cmd->z);
+         oob =  (cmd->x < 0 || cmd->x > (limit*tile_config->aspect_x - 1) || cmd->y < 0 || cmd->y > (limit * tile_config->aspect_y - 1));
+         ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_translate: request for %s was %i %i %i", tile_config->xmlname, cmd->x, cmd->y, limit);
+    }
 
-            oob = (cmd->z < tile_config->minzoom || cmd->z > tile_config->maxzoom);
-            if (!oob) {
-                 // valid x/y for tiles are 0 ... 2^zoom-1
-                 limit = (1 << cmd->z);
-                 oob =  (cmd->x < 0 || cmd->x > (limit*tile_config->aspect_x - 1) || cmd->y < 0 || cmd->y > (limit * tile_config->aspect_y - 1));
-                 ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_translate: request for %s was %i %i %i", tile_config->xmlname, cmd->x, cmd->y, limit);
-            }
+    if (oob) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_translate: request for %s was outside of allowed bounds", tile_config->xmlname);
+        delay_penalize(r);
+        //Don't increase stats counter here,
+        //As we are interested in valid tiles only
+        return HTTP_NOT_FOUND;
+    }
 
-            if (oob) {
-                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_translate: request for %s was outside of allowed bounds", tile_config->xmlname);
-                sleep(CLIENT_PENALTY);
-                //Don't increase stats counter here,
-                //As we are interested in valid tiles only
-                return HTTP_NOT_FOUND;
-            }
+    strcpy(cmd->xmlname, tile_config->xmlname);
+    strcpy(cmd->mimetype, tile_config->mimeType); 
+    strcpy(cmd->options,parameters);
 
-            strcpy(cmd->xmlname, tile_config->xmlname);
-            strcpy(cmd->mimetype, tile_config->mimeType); 
-            strcpy(cmd->options,parameters);
-
-            // Store a copy for later
-            rdata->cmd = cmd;
-            rdata->layerNumber = i;
-            rdata->store = get_storage_backend(r, i);
-            if (rdata->store == NULL) {
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "tile_translate: failed to get valid storage backend");
-                if (!incRespCounter(HTTP_INTERNAL_SERVER_ERROR, r, cmd, rdata->layerNumber)) {
-                    ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
-                            "Failed to increase response stats counter");
-                }
-                return HTTP_INTERNAL_SERVER_ERROR;
-            }
-            ap_set_module_config(r->request_config, &tile_module, rdata);
+    // Store a copy for later
+    rdata->cmd = cmd;
+    rdata->layerNumber = i;
+    rdata->store = get_storage_backend(r, i);
+    if (rdata->store == NULL) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "tile_translate: failed to get valid storage backend");
+        if (!incRespCounter(HTTP_INTERNAL_SERVER_ERROR, r, cmd, rdata->layerNumber)) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                    "Failed to increase response stats counter");
+        }
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    rdata->slice_fd = -1;
+    rdata->latency_kind = LATENCY_NONE;
+    apr_pool_cleanup_register(r->pool, rdata, tile_fetch_release, apr_pool_cleanup_null);
+    ap_set_module_config(r->request_config, &tile_module, rdata);
 
-            r->filename = NULL; 
+    r->filename = NULL; 
 
-            if ((tile_config->enableOptions && (n == 6)) || ( !tile_config->enableOptions && (n == 5))) { 
-                if (!strcmp(option, "status")) r->handler = "tile_status";
-                else if (!strcmp(option, "dirty")) r->handler = "tile_dirty";
-                else return DECLINED;
-            } else {
-                r->handler = "tile_serve";
-            }
+    if ((tile_config->enableOptions && (n == 6)) || ( !tile_config->enableOptions && (n == 5))) { 
+        if (!strcmp(option, "status")) r->handler = "tile_status";
+        else if (!strcmp(option, "dirty")) r->handler = "tile_dirty";
+        else return DECLINED;
+    } else {
+        r->handler = "tile_serve";
+    }
 
-            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_translate: op(%s) xml(%s) mime(%s) z(%d) x(%d) y(%d)",
-                    r->handler , cmd->xmlname, tile_config->mimeType, cmd->z, cmd->x, cmd->y);
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_translate: op(%s) xml(%s) mime(%s) z(%d) x(%d) y(%d)",
+            r->handler , cmd->xmlname, tile_config->mimeType, cmd->z, cmd->x, cmd->y);
 
-            return OK;
-        }
-    }
-    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "tile_translate: No suitable tile layer found");
-    return DECLINED;
+    return OK;
 }
 
 /*
@@ -1410,6 +2069,7 @@ static int mod_tile_post_config(apr_pool_t *pconf, apr_pool_t *plog,
     apr_status_t rs;
     stats_data *stats;
     delaypool *delayp;
+    server_rec *sv;
     int i;
 
     /*
@@ -1426,6 +2086,11 @@ static int mod_tile_post_config(apr_pool_t *pconf, apr_pool_t *plog,
         return OK;
     } /* Kilroy was here */
 
+    /* Compile the tile layers of every virtual host into a router */
+    for (sv = s; sv; sv = sv->next) {
+        tile_router_build(pconf, ap_get_module_config(sv->module_config, &tile_module));
+    }
+
     /* Create the shared memory segment */
 
     /*
@@ -1440,7 +2105,12 @@ static int mod_tile_post_config(apr_pool_t *pconf, apr_pool_t *plog,
      * would prefer to use scfg->configs->nelts here but that does
      * not seem to be set at this stage, so rely on previously set layerCount */
 
-    rs = apr_shm_create(&stats_shm, sizeof(stats_data) + layerCount * 2 * sizeof(apr_uint64_t),
+    /* Each shard is padded to a full cache line, so that workers updating
+     * different shards never write to the same line */
+    stats_shard_size = sizeof(stats_data) + layerCount * (2 + LATENCY_KINDS * LATENCY_BUCKETS) * sizeof(apr_uint64_t);
+    stats_shard_size = (stats_shard_size + STATS_CACHE_LINE - 1) & ~((apr_size_t)STATS_CACHE_LINE - 1);
+
+    rs = apr_shm_create(&stats_shm, stats_shard_size * STATS_SHARDS,
                         (const char *) shmfilename, pconf);
     if (rs != APR_SUCCESS) {
         ap_log_error(APLOG_MARK, APLOG_ERR, rs, s,
@@ -1459,49 +2129,24 @@ static int mod_tile_post_config(apr_pool_t *pconf, apr_pool_t *plog,
     }
 
     /* Created it, now let's zero it out */
-    stats = (stats_data *)apr_shm_baseaddr_get(stats_shm);
-    stats->noResp200 = 0;
-    stats->noResp304 = 0;
-    stats->noResp404 = 0;
-    stats->noResp503 = 0;
-    stats->noResp5XX = 0;
-    for (i = 0; i <= global_max_zoom; i++) {
-        stats->noRespZoom[i] = 0;
-    }
-    stats->totalBufferRetrievalTime = 0;
-    stats->noTotalBufferRetrieval = 0;
-    for (i = 0; i <= global_max_zoom; i++) {
-        stats->zoomBufferRetrievalTime[i] = 0;
-        stats->noZoomBufferRetrieval[i] = 0;
-    }
-    stats->noRespOther = 0;
-    stats->noFreshCache = 0;
-    stats->noFreshRender = 0;
-    stats->noOldCache = 0;
-    stats->noOldRender = 0;
-
-    /* the "stats" block does not have a fixed size; it is a fixed-size struct
-     * followed by two arrays with one element each per layer. All of this sits
-     * in one shared memory block, and for ease of use, pointers from inside the
-     * struct point to the arrays. */
-    stats->noResp404Layer = (apr_uint64_t *) ((char *) stats + sizeof(stats_data));
-    stats->noResp200Layer = (apr_uint64_t *) ((char *) stats + sizeof(stats_data) + sizeof(apr_uint64_t) * layerCount);
+    memset(apr_shm_baseaddr_get(stats_shm), 0, stats_shard_size * STATS_SHARDS);
 
-    /* zero out all the non-fixed-length stuff */
-    for (i=0; i<layerCount; i++) {
-        stats->noResp404Layer[i] = 0;
-        stats->noResp200Layer[i] = 0;
+    /* Each shard does not have a fixed size; it is a fixed-size struct
+     * followed by arrays with one element (or histogram) each per layer. For
+     * ease of use, pointers from inside the struct point to the arrays. */
+    for (i = 0; i < STATS_SHARDS; i++) {
+        stats = (stats_data *)((char *)apr_shm_baseaddr_get(stats_shm) + stats_shard_size * i);
+        stats->noResp404Layer = (apr_uint64_t *) ((char *) stats + sizeof(stats_data));
+        stats->noResp200Layer = (apr_uint64_t *) ((char *) stats + sizeof(stats_data) + sizeof(apr_uint64_t) * layerCount);
+        stats->latencyLayer = (apr_uint64_t *) ((char *) stats + sizeof(stats_data) + sizeof(apr_uint64_t) * layerCount * 2);
     }
 
     delayp = (delaypool *)apr_shm_baseaddr_get(delaypool_shm);
-    
-    delayp->last_tile_fillup = apr_time_now();
-    delayp->last_render_fillup = apr_time_now();
 
     for (i = 0; i < DELAY_HASHTABLE_SIZE; i++) {
-        memset(&(delayp->users[i].ip_addr),0, sizeof(struct in6_addr));
-        delayp->users[i].available_tiles = 0;
-        delayp->users[i].available_render_req = 0;
+        delayp->users[i].ip_tag = 0;
+        delayp->users[i].tiles_full_at = 0;
+        delayp->users[i].render_full_at = 0;
     }
     for (i = 0; i < DELAY_HASHTABLE_WHITELIST_SIZE; i++) {
         delayp->whitelist[i] = (in_addr_t)0;
@@ -1516,69 +2161,6 @@ static int mod_tile_post_config(apr_pool_t *pconf, apr_pool_t *plog,
      * depending on OS and locking mechanism of choice, the file
      * may or may not be actually created.
      */
-    mutexfilename = apr_psprintf(pconf, "/tmp/httpd_mutex.%ld",
-                                 (long int) getpid());
-
-    rs = apr_global_mutex_create(&stats_mutex, (const char *) mutexfilename,
-                                 APR_LOCK_DEFAULT, pconf);
-    if (rs != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rs, s,
-                     "Failed to create mutex on file %s",
-                     mutexfilename);
-        return HTTP_INTERNAL_SERVER_ERROR;
-    }
-
-#ifdef MOD_TILE_SET_MUTEX_PERMS
-#ifdef APACHE24
-    rs = ap_unixd_set_global_mutex_perms(stats_mutex);
-#else
-    rs = unixd_set_global_mutex_perms(stats_mutex);
-#endif
-
-    if (rs != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_CRIT, rs, s,
-                     "Parent could not set permissions on mod_tile "
-                     "mutex: check User and Group directives");
-        return HTTP_INTERNAL_SERVER_ERROR;
-    }
-#endif /* MOD_TILE_SET_MUTEX_PERMS */
-
-    /*
-     * Create another unique filename to lock upon. Note that
-     * depending on OS and locking mechanism of choice, the file
-     * may or may not be actually created.
-     */
-    mutexfilename = apr_psprintf(pconf, "/tmp/httpd_mutex_delay.%ld",
-                                 (long int) getpid());
-
-    rs = apr_global_mutex_create(&delay_mutex, (const char *) mutexfilename,
-                                 APR_LOCK_DEFAULT, pconf);
-    if (rs != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rs, s,
-                     "Failed to create mutex on file %s",
-                     mutexfilename);
-        return HTTP_INTERNAL_SERVER_ERROR;
-    }
-
-#ifdef MOD_TILE_SET_MUTEX_PERMS
-#ifdef APACHE24
-    rs = ap_unixd_set_global_mutex_perms(delay_mutex);
-#else
-    rs = unixd_set_global_mutex_perms(delay_mutex);
-#endif
-    if (rs != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_CRIT, rs, s,
-                     "Parent could not set permissions on mod_tile "
-                     "mutex: check User and Group directives");
-        return HTTP_INTERNAL_SERVER_ERROR;
-    }
-#endif /* MOD_TILE_SET_MUTEX_PERMS */
-
-    /*
-         * Create another unique filename to lock upon. Note that
-         * depending on OS and locking mechanism of choice, the file
-         * may or may not be actually created.
-         */
         mutexfilename = apr_psprintf(pconf, "/tmp/httpd_mutex_storage.%ld",
                                      (long int) getpid());
 
@@ -1624,21 +2206,41 @@ static void mod_tile_child_init(apr_pool_t *p, server_rec *s)
 
      /*
       * Re-open the mutex for the child. Note we're reusing
-      * the mutex pointer global here.
+      * the mutex pointer global here, which the parent last set to the
+      * storage mutex. The stats counters don't need a mutex.
       */
-     rs = apr_global_mutex_child_init(&stats_mutex,
+     rs = apr_global_mutex_child_init(&storage_mutex,
                                       (const char *) mutexfilename,
                                       p);
      if (rs != APR_SUCCESS) {
          ap_log_error(APLOG_MARK, APLOG_CRIT, rs, s,
                      "Failed to reopen mutex on file %s",
-                     shmfilename);
+                     mutexfilename);
          /* There's really nothing else we can do here, since
           * This routine doesn't return a status. */
          exit(1); /* Ugly, but what else? */
      }
 }
 
+/*
+ * Record the latency of tile requests once they have been answered, so that
+ * it includes the time spent sending the tile.
+ */
+static int tile_log_latency(request_rec *r)
+{
+    struct tile_request_data * rdata;
+
+    if (!r->handler || strcmp(r->handler, "tile_serve"))
+        return DECLINED;
+
+    rdata = (struct tile_request_data *)ap_get_module_config(r->request_config, &tile_module);
+    if (rdata == NULL || rdata->cmd == NULL || rdata->latency_kind == LATENCY_NONE)
+        return DECLINED;
+
+    incLatencyCounter(apr_time_now() - r->request_time, rdata->latency_kind, rdata->cmd->z, rdata->layerNumber, r);
+    return DECLINED;
+}
+
 static void register_hooks(__attribute__((unused)) apr_pool_t *p)
 {
     ap_hook_post_config(mod_tile_post_config, NULL, NULL, APR_HOOK_MIDDLE);
@@ -1650,6 +2252,7 @@ static void register_hooks(__attribute__((unused)) apr_pool_t *p)
     ap_hook_handler(tile_handler_mod_stats, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_translate_name(tile_translate, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_map_to_storage(tile_storage_hook, NULL, NULL, APR_HOOK_FIRST);
+    ap_hook_log_transaction(tile_log_latency, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 static const char *_add_tile_config(cmd_parms *cmd, void *mconfig,
@@ -1775,6 +2378,8 @@ static const char *load_tile_config(cmd_parms *cmd, void *mconfig, const char *c
     int aspect_x = 1;
     int aspect_y = 1;
     int parameterize = 0;
+    int have_type = 0;
+    int format;
 
     if (strlen(conffile) == 0) {
         strcpy(filename, RENDERD_CONFIG);
@@ -1823,6 +2428,7 @@ static const char *load_tile_config(cmd_parms *cmd, void *mconfig, const char *c
             strcpy(url,"");
             strcpy(fileExtension,"png");
             strcpy(mimeType,"image/png");
+            have_type = 0;
             description = NULL;
             cors = NULL;
             attribution = NULL;
@@ -1862,6 +2468,15 @@ static const char *load_tile_config(cmd_parms *cmd, void *mconfig, const char *c
                     fclose(hini);
                     return "TYPE is not correctly parsable";
                 }
+                have_type = 1;
+            }
+            if (!strcmp(key, "FORMAT")){
+                /* Without an explicit TYPE, serve the tiles with the extension and type of renderd's output format */
+                format = tile_format(value);
+                if ((format != formatUnknown) && !have_type) {
+                    strcpy(fileExtension, tile_format_extension(format));
+                    strcpy(mimeType, tile_format_mimetype(format));
+                }
             }
             if (!strcmp(key, "DESCRIPTION")){
                 if (description) free(description);
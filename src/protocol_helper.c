@@ -4,6 +4,7 @@
 #include <syslog.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
 
 int send_cmd(struct protocol * cmd, int fd) {
     int ret;
@@ -34,6 +35,10 @@ int recv_cmd(struct protocol * cmd, int fd,  int block) {
     int ret, ret2;
     memset(cmd,0,sizeof(*cmd));
     ret = recv(fd, cmd, sizeof(struct protocol_v1), block?MSG_WAITALL:MSG_DONTWAIT);
+    if ((ret < 0) && !block && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+        // Nothing to read right now, leave errno for the caller to check
+        return -1;
+    }
     if (ret < 1) {
         syslog(LOG_INFO, "DEBUG: Failed to read cmd on fd %i", fd);
         return -1;
@@ -69,3 +74,90 @@ int recv_cmd(struct protocol * cmd, int fd,  int block) {
     syslog(LOG_WARNING, "WARNING: Socket read wrong number of bytes: %i -> %li, %li\n", ret, sizeof(struct protocol_v2), sizeof(struct protocol)); 
     return 0;
 }
+
+/*
+ * Decode the first command frame out of a buffer of received bytes. The size
+ * of a frame depends on the protocol version in its first field.
+ * Returns the number of bytes used by the frame, 0 if the buffer does not
+ * hold a complete frame yet, or -1 if the protocol version is unknown.
+ */
+int parse_cmd(struct protocol * cmd, const char * buf, size_t len) {
+    int ver;
+    size_t size;
+
+    if (len < sizeof(int)) {
+        return 0;
+    }
+    memcpy(&ver, buf, sizeof(int));
+    switch (ver) {
+    case 1:
+        size = sizeof(struct protocol_v1);
+        break;
+    case 2:
+        size = sizeof(struct protocol_v2);
+        break;
+    case 3:
+        size = sizeof(struct protocol);
+        break;
+    default:
+        syslog(LOG_WARNING, "WARNING: Failed to recieve render cmd with unknown protocol version %i\n", ver);
+        return -1;
+    }
+    if (len < size) {
+        return 0;
+    }
+    memset(cmd, 0, sizeof(*cmd));
+    memcpy(cmd, buf, size);
+    return size;
+}
+
+/*
+ * Send count tiles as one version 4 frame.
+ * Returns the number of bytes sent, or -1 on failure.
+ */
+int send_frame(struct protocol_v4_tile * tiles, int count, int fd) {
+    char buf[PROTO_FRAME_MAX];
+    struct protocol_v4_header hdr;
+    int ret;
+
+    if ((count < 1) || (count > PROTO_FRAME_MAX_TILES)) {
+        syslog(LOG_WARNING, "WARNING: Failed to send frame with %i tiles on fd %d\n", count, fd);
+        return -1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.ver = PROTO_VER_FRAMED;
+    hdr.count = count;
+    hdr.len = sizeof(hdr) + count * sizeof(struct protocol_v4_tile);
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), tiles, count * sizeof(struct protocol_v4_tile));
+
+    syslog(LOG_DEBUG, "DEBUG: Sending frame of %i tiles, first cmd(%i %s %i/%i/%i) id %llu to fd %i\n", count, tiles[0].cmd, tiles[0].xmlname, tiles[0].z, tiles[0].x, tiles[0].y, (unsigned long long)tiles[0].id, fd);
+    ret = send(fd, buf, hdr.len, 0);
+    if (ret != hdr.len) {
+        syslog(LOG_WARNING, "WARNING: Failed to send frame on fd %i\n", fd);
+        return -1;
+    }
+    return ret;
+}
+
+/*
+ * Decode the header of a version 4 frame out of a buffer of received bytes.
+ * The tiles follow the header in the buffer.
+ * Returns the length of the frame, 0 if the buffer does not hold the complete
+ * frame yet, or -1 if the frame is malformed.
+ */
+int parse_frame(struct protocol_v4_header * hdr, const char * buf, size_t len) {
+    if (len < sizeof(*hdr)) {
+        return 0;
+    }
+    memcpy(hdr, buf, sizeof(*hdr));
+    if ((hdr->ver != PROTO_VER_FRAMED) || (hdr->count < 1) || (hdr->count > PROTO_FRAME_MAX_TILES) ||
+        (hdr->len < sizeof(*hdr) + hdr->count * sizeof(struct protocol_v4_tile)) || (hdr->len > PROTO_FRAME_MAX)) {
+        syslog(LOG_WARNING, "WARNING: Failed to recieve malformed frame of version %i with %u tiles and length %u\n", hdr->ver, hdr->count, hdr->len);
+        return -1;
+    }
+    if (len < hdr->len) {
+        return 0;
+    }
+    return hdr->len;
+}
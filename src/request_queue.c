@@ -26,124 +26,234 @@
 #include <string.h>
 #include <pthread.h>
 #include <syslog.h>
+#include <sys/time.h>
 #include "render_config.h"
 #include "request_queue.h"
+#include "dirty_log.h"
 
-static int calcHashKey(struct request_queue *queue, struct item *item) {
-    uint64_t xmlnameHash = 0;
-    uint64_t key;
-    for (int i = 0; (item->req.xmlname[i] != 0) && (i < sizeof(item->req.xmlname)); i++) {
-        xmlnameHash += item->req.xmlname[i];
+// Items preallocated for the queues. Duplicates and items being rendered
+// beyond that come from malloc.
+#define ITEM_SLAB_SIZE (4 * REQ_LIMIT + DIRTY_LIMIT + 256)
+
+/*
+ * The queue has no global lock. Each priority list has its own lock, and the
+ * index of pending requests is split into shards by hash, each with its own
+ * lock. A shard lock may be held while taking a list lock, never the other
+ * way round. Promotion holds the dirty or bulk list lock while taking the lock
+ * of one of the request lists, which are never locked first. The scheduler
+ * lock is taken before any other. Counters are updated atomically so they
+ * can be read at any time.
+ */
+#define QUEUE_STAT_ADD(field, n) __atomic_fetch_add(&(queue->stats.field), (n), __ATOMIC_RELAXED)
+
+// Order in which the lists are served when they are due at the same time
+static const enum queueEnum fetchOrder[] = {queueRequestPrio, queueRequest, queueRequestLow, queueDirty, queueRequestBulk};
+
+// Virtual time a list is charged for an item is QUEUE_STRIDE divided by its weight
+#define QUEUE_STRIDE (1ULL << 32)
+
+/*
+ * 64 bit FNV-1a hash over everything that makes two requests render the same
+ * metatile, finished off with a mixer so the low bits used to pick a slot are
+ * well distributed.
+ */
+static uint64_t calcHashKey(const struct item *item) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const unsigned char *c;
+    int i;
+
+    for (c = (const unsigned char *)item->req.xmlname; (c < (const unsigned char *)item->req.xmlname + XMLCONFIG_MAX) && (*c != 0); c++) {
+        h = (h ^ *c) * 0x100000001b3ULL;
+    }
+    h = (h ^ 0xff) * 0x100000001b3ULL;
+    for (c = (const unsigned char *)item->req.options; (c < (const unsigned char *)item->req.options + XMLCONFIG_MAX) && (*c != 0); c++) {
+        h = (h ^ *c) * 0x100000001b3ULL;
     }
-    key = ((uint64_t)(xmlnameHash & 0x1FF) << 52) + ((uint64_t)(item->req.z) << 48) + ((uint64_t)(item->mx & 0xFFFFFF) << 24) + (item->my & 0xFFFFFF);
-    return key % queue->hashidxSize;
+    for (i = 0; i < 4; i++) {
+        h = (h ^ ((item->req.z >> (8 * i)) & 0xff)) * 0x100000001b3ULL;
+        h = (h ^ ((item->mx >> (8 * i)) & 0xff)) * 0x100000001b3ULL;
+        h = (h ^ ((item->my >> (8 * i)) & 0xff)) * 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
 }
 
-static struct item * lookup_item_idx(struct request_queue * queue, struct item * item) {
-    struct item_idx * nextItem;
-    struct item * test;
+static int same_metatile(const struct item *a, const struct item *b) {
+    return (a->mx == b->mx) && (a->my == b->my) && (a->req.z == b->req.z) &&
+           !strcmp(a->req.xmlname, b->req.xmlname) && !strcmp(a->req.options, b->req.options);
+}
 
-    int key = calcHashKey(queue, item);
+/*
+ * Each shard of the index of pending requests is an open addressing table
+ * with linear probing. Its size is a power of two and it is kept at most half
+ * full. All of these are called with the shard lock held.
+ */
+static struct request_shard * item_shard(struct request_queue * queue, uint64_t hash) {
+    return &(queue->shards[(hash >> 48) % QUEUE_SHARDS]);
+}
 
-    if (queue->item_hashidx[key].item == NULL) {
-        return NULL;
-    } else {
-        nextItem = &(queue->item_hashidx[key]);
-        while (nextItem != NULL) {
-            test = nextItem->item;
-            if ((item->mx == test->mx) && (item->my == test->my)
-                    && (item->req.z == test->req.z) && (!strcmp(
-                            item->req.xmlname, test->req.xmlname))) {
-                return test;
-            } else {
-                nextItem = nextItem->next;
-            }
+static struct item * lookup_item_idx(struct request_shard * shard, struct item * item, uint64_t hash) {
+    unsigned int mask = shard->hashidxSize - 1;
+    unsigned int i;
+
+    for (i = hash & mask; shard->item_hashidx[i].item != NULL; i = (i + 1) & mask) {
+        if ((shard->item_hashidx[i].hash == hash) && same_metatile(item, shard->item_hashidx[i].item)) {
+            return shard->item_hashidx[i].item;
         }
     }
     return NULL;
 }
 
-static void insert_item_idx(struct request_queue * queue, struct item *item) {
-    struct item_idx * nextItem;
-    struct item_idx * prevItem;
+static void place_item_idx(struct item_idx * table, unsigned int mask, uint64_t hash, struct item * item) {
+    unsigned int i;
+
+    for (i = hash & mask; table[i].item != NULL; i = (i + 1) & mask);
+    table[i].hash = hash;
+    table[i].item = item;
+}
 
-    int key = calcHashKey(queue, item);
+static void insert_item_idx(struct request_shard * shard, struct item *item, uint64_t hash) {
+    if (2 * (shard->hashidxUsed + 1) > shard->hashidxSize) {
+        // Only happens if far more items are being rendered than expected
+        struct item_idx * table = (struct item_idx *)calloc(2 * shard->hashidxSize, sizeof(struct item_idx));
+        int i;
 
-    if (queue->item_hashidx[key].item == NULL) {
-        queue->item_hashidx[key].item = item;
-    } else {
-        prevItem = &(queue->item_hashidx[key]);
-        nextItem = queue->item_hashidx[key].next;
-        while(nextItem) {
-            prevItem = nextItem;
-            nextItem = nextItem->next;
-        }
-        nextItem = (struct item_idx *)malloc(sizeof(struct item_idx));
-        nextItem->item = item;
-        nextItem->next = NULL;
-        prevItem->next = nextItem;
-    }
-}
-
-static void remove_item_idx(struct request_queue * queue, struct item * item) {
-    int key = calcHashKey(queue, item);
-    struct item_idx * nextItem;
-    struct item_idx * prevItem;
-    struct item * test;
-    if (queue->item_hashidx[key].item == NULL) {
-        //item not in index;
-        return;
-    }
-    prevItem = &(queue->item_hashidx[key]);
-    nextItem = &(queue->item_hashidx[key]);
-
-    while (nextItem != NULL) {
-        test = nextItem->item;
-        if ((item->mx == test->mx) && (item->my == test->my) && (item->req.z
-                == test->req.z) && (!strcmp(item->req.xmlname,
-                        test->req.xmlname))) {
-            /*
-             * Found item, removing it from list
-             */
-            nextItem->item = NULL;
-            if (nextItem->next != NULL) {
-                if (nextItem == &(queue->item_hashidx[key])) {
-                    prevItem = nextItem->next;
-                    memcpy(&(queue->item_hashidx[key]), nextItem->next,
-                            sizeof(struct item_idx));
-                    free(prevItem);
-                } else {
-                    prevItem->next = nextItem->next;
+        if (table == NULL) {
+            syslog(LOG_ERR, "Failed to grow the request queue index");
+        } else {
+            for (i = 0; i < shard->hashidxSize; i++) {
+                if (shard->item_hashidx[i].item != NULL) {
+                    place_item_idx(table, 2 * shard->hashidxSize - 1, shard->item_hashidx[i].hash, shard->item_hashidx[i].item);
                 }
-            } else {
-                prevItem->next = NULL;
             }
+            free(shard->item_hashidx);
+            shard->item_hashidx = table;
+            shard->hashidxSize *= 2;
+        }
+    }
+    place_item_idx(shard->item_hashidx, shard->hashidxSize - 1, hash, item);
+    shard->hashidxUsed++;
+}
 
-            if (nextItem != &(queue->item_hashidx[key])) {
-                free(nextItem);
-            }
+static void remove_item_idx(struct request_shard * shard, struct item * item, uint64_t hash) {
+    struct item_idx * table = shard->item_hashidx;
+    unsigned int mask = shard->hashidxSize - 1;
+    unsigned int i, j, home;
+
+    for (i = hash & mask; table[i].item != item; i = (i + 1) & mask) {
+        if (table[i].item == NULL) {
+            //item not in index;
             return;
+        }
+    }
+    shard->hashidxUsed--;
+
+    /*
+     * Close the gap by moving back later entries of the probe sequence that
+     * could not be placed at or before the free slot.
+     */
+    for (j = (i + 1) & mask; table[j].item != NULL; j = (j + 1) & mask) {
+        home = table[j].hash & mask;
+        if (((j > i) && ((home <= i) || (home > j))) || ((j < i) && (home <= i) && (home > j))) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i].item = NULL;
+}
+
+static void attach_duplicate(struct item * item, struct item * test) {
+    test->duplicates = item->duplicates;
+    item->duplicates = test;
+    test->inQueue = queueDuplicate;
+}
+
+// Number of items of the styles in the mask in a list
+static int list_num(struct request_queue * queue, enum queueEnum list, unsigned int styles) {
+    int style, num = 0;
+
+    if (styles == QUEUE_ALL_STYLES) {
+        return __atomic_load_n(&(queue->lists[list].num), __ATOMIC_SEQ_CST);
+    }
+    for (style = 0; style < QUEUE_STYLES; style++) {
+        if (styles & (1u << style)) {
+            num += __atomic_load_n(&(queue->lists[list].styleNum[style]), __ATOMIC_SEQ_CST);
+        }
+    }
+    return num;
+}
+
+/*
+ * Whether a list has room for another item of a style. The request lists are
+ * limited for each pool on its own, so a backlog of one pool does not push the
+ * requests of another to the dirty list. Called with the list lock held.
+ */
+static int list_room(struct request_queue * queue, enum queueEnum list, int limit, int style) {
+    if ((queue->numPools == 1) || (list == queueDirty)) {
+        return queue->lists[list].num < limit;
+    }
+    return list_num(queue, list, queue->pools[queue->stylePool[style]].styles) < limit;
+}
+
+/*
+ * Move an item waiting in the dirty or bulk list to a list that is served
+ * earlier. Returns 0 if the target list is full. An item a render thread has
+ * already taken off its list is about to be rendered anyway, so that counts as
+ * done. Called with the shard lock of the item held.
+ */
+static int promote(struct request_queue * queue, struct item * item, enum queueEnum list) {
+    struct request_list * from = &(queue->lists[item->inQueue]);
+    struct request_list * to = &(queue->lists[list]);
+    int done = 1;
+
+    pthread_mutex_lock(&(from->lock));
+    if (item->next != NULL) {
+        pthread_mutex_lock(&(to->lock));
+        if (list_room(queue, list, REQ_LIMIT, item->style)) {
+            item->next->prev = item->prev;
+            item->prev->next = item->next;
+            __atomic_sub_fetch(&(from->styleNum[item->style]), 1, __ATOMIC_SEQ_CST);
+            __atomic_sub_fetch(&(from->num), 1, __ATOMIC_SEQ_CST);
+
+            item->inQueue = list;
+            item->originatedQueue = list;
+            item->next = &(to->heads[item->style]);
+            item->prev = to->heads[item->style].prev;
+            item->prev->next = item;
+            to->heads[item->style].prev = item;
+            __atomic_add_fetch(&(to->styleNum[item->style]), 1, __ATOMIC_SEQ_CST);
+            __atomic_add_fetch(&(to->num), 1, __ATOMIC_SEQ_CST);
+            QUEUE_STAT_ADD(noReqPromoted, 1);
         } else {
-            prevItem = nextItem;
-            nextItem = nextItem->next;
+            done = 0;
         }
+        pthread_mutex_unlock(&(to->lock));
     }
+    pthread_mutex_unlock(&(from->lock));
+    return done;
 }
 
-static enum protoCmd pending(struct request_queue * queue, struct item *test) {
+static enum protoCmd pending(struct request_queue * queue, struct request_shard * shard, struct item *test, uint64_t hash) {
     // check all queues and render list to see if this request already queued
     // If so, add this new request as a duplicate
-    // call with qLock held
+    // call with the shard lock held
     struct item *item;
 
-    item = lookup_item_idx(queue, test);
+    item = lookup_item_idx(shard, test, hash);
     if (item != NULL) {
         if ((item->inQueue == queueRender) || (item->inQueue == queueRequest) || (item->inQueue == queueRequestPrio) || (item->inQueue == queueRequestLow)) {
-            test->duplicates = item->duplicates;
-            item->duplicates = test;
-            test->inQueue = queueDuplicate;
+            attach_duplicate(item, test);
             return cmdIgnore;
         } else if ((item->inQueue == queueDirty) || (item->inQueue == queueRequestBulk)){
+            // Someone is waiting for this tile now, so it can not stay in a background queue
+            if (((test->req.cmd == cmdRenderPrio) && promote(queue, item, queueRequestPrio)) ||
+                ((test->req.cmd == cmdRender) && promote(queue, item, queueRequest)) ||
+                ((test->req.cmd == cmdRenderLow) && promote(queue, item, queueRequestLow))) {
+                attach_duplicate(item, test);
+                return cmdIgnore;
+            }
             return cmdNotDone;
         }
     }
@@ -151,48 +261,409 @@ static enum protoCmd pending(struct request_queue * queue, struct item *test) {
     return cmdRender;
 }
 
-struct item *request_queue_fetch_request(struct request_queue * queue) {
-    struct item *item = NULL;
-
-    pthread_mutex_lock(&(queue->qLock));
-
-    while ((queue->reqNum == 0) && (queue->dirtyNum == 0) && (queue->reqLowNum == 0) && (queue->reqPrioNum == 0) && (queue->reqBulkNum == 0)) {
-        pthread_cond_wait(&(queue->qCond), &(queue->qLock));
-    }
-    if (queue->reqPrioNum) {
-        item = queue->reqPrioHead.next;
-        queue->reqPrioNum--;
-        queue->stats.noReqPrioRender++;
-    } else if (queue->reqNum) {
-        item = queue->reqHead.next;
-        queue->reqNum--;
-        queue->stats.noReqRender++;
-    } else if (queue->reqLowNum) {
-        item = queue->reqLowHead.next;
-        queue->reqLowNum--;
-        queue->stats.noReqLowRender++;
-    } else if (queue->dirtyNum) {
-        item = queue->dirtyHead.next;
-        queue->dirtyNum--;
-        queue->stats.noDirtyRender++;
-    } else if (queue->reqBulkNum) {
-        item = queue->reqBulkHead.next;
-        queue->reqBulkNum--;
-        queue->stats.noReqBulkRender++;
+/*
+ * Append an item to a list unless the list is full. Called with the shard
+ * lock of the item held.
+ */
+static int list_append(struct request_queue * queue, enum queueEnum list, int limit, struct item * item) {
+    struct request_list * l = &(queue->lists[list]);
+
+    pthread_mutex_lock(&(l->lock));
+    if (!list_room(queue, list, limit, item->style)) {
+        pthread_mutex_unlock(&(l->lock));
+        return 0;
+    }
+    item->inQueue = list;
+    item->originatedQueue = list;
+    item->next = &(l->heads[item->style]);
+    item->prev = l->heads[item->style].prev;
+    item->prev->next = item;
+    l->heads[item->style].prev = item;
+    __atomic_add_fetch(&(l->styleNum[item->style]), 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&(l->num), 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&(l->lock));
+    return 1;
+}
+
+/*
+ * Take the next item of one of the styles in the mask off a list, going round
+ * the styles in turn. With a cutoff only the longest waiting item is taken, if
+ * it was queued before the cutoff. An item taken off its list has next set to
+ * NULL.
+ */
+static struct item * list_pop(struct request_queue * queue, enum queueEnum list, long long cutoff, unsigned int styles) {
+    struct request_list * l = &(queue->lists[list]);
+    struct item * item = NULL;
+    int i, style;
+
+    if (__atomic_load_n(&(l->num), __ATOMIC_SEQ_CST) == 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&(l->lock));
+    for (i = 0; i < QUEUE_STYLES; i++) {
+        style = (l->nextStyle + i) % QUEUE_STYLES;
+        if ((l->styleNum[style] == 0) || !(styles & (1u << style))) {
+            continue;
+        }
+        if (cutoff == 0) {
+            item = l->heads[style].next;
+            l->nextStyle = (style + 1) % QUEUE_STYLES;
+            break;
+        }
+        if ((l->heads[style].next->queued <= cutoff) && ((item == NULL) || (l->heads[style].next->queued < item->queued))) {
+            item = l->heads[style].next;
+        }
     }
     if (item) {
         item->next->prev = item->prev;
         item->prev->next = item->next;
+        item->next = item->prev = NULL;
+        __atomic_sub_fetch(&(l->styleNum[item->style]), 1, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&(l->num), 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&(l->lock));
+    return item;
+}
+
+static int queued_requests(struct request_queue * queue) {
+    int i, num = 0;
+    for (i = 0; i < sizeof(fetchOrder) / sizeof(fetchOrder[0]); i++) {
+        num += __atomic_load_n(&(queue->lists[fetchOrder[i]].num), __ATOMIC_SEQ_CST);
+    }
+    return num;
+}
+
+/*
+ * Styles are registered before the queue is used, so the table is read
+ * without a lock.
+ */
+static int style_index(struct request_queue * queue, const char * xmlname) {
+    int i;
+
+    for (i = 0; i < queue->numStyles; i++) {
+        if (!strcmp(queue->styles[i], xmlname)) {
+            return i;
+        }
+    }
+    return QUEUE_STYLES - 1;
+}
+
+void request_queue_add_style(struct request_queue * queue, const char * xmlname) {
+    if ((queue->numStyles < QUEUE_STYLES - 1) && (style_index(queue, xmlname) == QUEUE_STYLES - 1)) {
+        strncpy(queue->styles[queue->numStyles], xmlname, XMLCONFIG_MAX - 1);
+        queue->numStyles++;
+    }
+}
+
+/*
+ * Give a style a pool of render threads of its own, which fetch with the
+ * returned pool id. The shared pool 0 no longer serves it. Call before any
+ * render thread starts.
+ */
+int request_queue_add_pool(struct request_queue * queue, const char * xmlname) {
+    int style, pool;
+
+    request_queue_add_style(queue, xmlname);
+    style = style_index(queue, xmlname);
+    if ((style == QUEUE_STYLES - 1) || (queue->numPools >= QUEUE_STYLES)) {
+        syslog(LOG_WARNING, "Too many styles, %s is served by the shared render threads", xmlname);
+        return 0;
+    }
+    for (pool = 1; pool < queue->numPools; pool++) {
+        if (queue->pools[pool].styles == (1u << style)) {
+            return pool;
+        }
+    }
+    pool = queue->numPools++;
+    queue->pools[pool].styles = 1u << style;
+    queue->pools[0].styles &= ~(1u << style);
+    queue->stylePool[style] = pool;
+    return pool;
+}
+
+void request_queue_set_weight(struct request_queue * queue, enum protoCmd priority, int weight) {
+    int list;
+
+    switch(priority) {
+    case cmdRenderPrio: list = queueRequestPrio; break;
+    case cmdRender: list = queueRequest; break;
+    case cmdRenderLow: list = queueRequestLow; break;
+    case cmdDirty: list = queueDirty; break;
+    case cmdRenderBulk: list = queueRequestBulk; break;
+    default: return;
+    }
+    pthread_mutex_lock(&(queue->schedLock));
+    queue->weight[list] = MAX(weight, 1);
+    pthread_mutex_unlock(&(queue->schedLock));
+}
+
+// Maximum time in seconds a request waits before it is served regardless of its priority, 0 for none
+void request_queue_set_max_age(struct request_queue * queue, int max_age) {
+    pthread_mutex_lock(&(queue->schedLock));
+    queue->maxAge = max_age * 1000LL;
+    pthread_mutex_unlock(&(queue->schedLock));
+}
+
+/*
+ * Keep dirty requests in a log on disk rather than dropping them once the
+ * dirty list is full. Requests left in the log by a previous run are queued
+ * again.
+ */
+int request_queue_open_dirty_log(struct request_queue * queue, const char * path, long capacity) {
+    queue->dirtyLog = dirty_log_open(path, capacity);
+    return (queue->dirtyLog == NULL) ? -1 : 0;
+}
+
+/*
+ * Items are handed out from a slab allocated with the queue, so queueing a
+ * request does not need malloc. If the slab runs out, malloc takes over.
+ */
+struct item *request_queue_alloc_item(struct request_queue * queue) {
+    struct item *item;
+
+    pthread_mutex_lock(&(queue->slabLock));
+    item = queue->itemFree;
+    if (item) {
+        queue->itemFree = item->next;
+    }
+    pthread_mutex_unlock(&(queue->slabLock));
+
+    if (item == NULL) {
+        item = (struct item *)malloc(sizeof(struct item));
+        if (item == NULL) {
+            return NULL;
+        }
+    }
+    memset(item, 0, sizeof(struct item));
+    return item;
+}
+
+void request_queue_free_item(struct request_queue * queue, struct item * item) {
+    if ((item >= queue->itemSlab) && (item < queue->itemSlab + queue->itemSlabSize)) {
+        pthread_mutex_lock(&(queue->slabLock));
+        item->next = queue->itemFree;
+        queue->itemFree = item;
+        pthread_mutex_unlock(&(queue->slabLock));
+    } else {
+        free(item);
+    }
+}
+
+static long long now_ms(void) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return now.tv_sec * 1000LL + now.tv_usec / 1000;
+}
+
+/*
+ * Whether everyone waiting for a request has given up: the item or its
+ * duplicates carry a deadline, and none of those with a client connection has
+ * one that is still ahead. Requests without any deadline never expire. Called
+ * with the shard lock of the item held.
+ */
+static int expired(struct item * item, long long now) {
+    int deadlines = 0;
 
-        //Add item to render queue
-        item->prev = &(queue->renderHead);
-        item->next = queue->renderHead.next;
-        queue->renderHead.next->prev = item;
-        queue->renderHead.next = item;
-        item->inQueue = queueRender;
+    for (; item != NULL; item = item->duplicates) {
+        if ((item->fd != FD_INVALID) && ((item->deadline == 0) || (item->deadline > now))) {
+            return 0;
+        }
+        if (item->deadline != 0) {
+            deadlines = 1;
+        }
+    }
+    return deadlines;
+}
+
+/*
+ * Nobody waits for a request any more. The tile is still missing or out of
+ * date, so it goes to the back of the dirty queue if there is room, without
+ * its expired duplicates. Called with the shard lock of the item held.
+ */
+static void expire_item(struct request_queue * queue, struct request_shard * shard, struct item * item, uint64_t hash) {
+    struct item * dupes = item->duplicates;
+    struct item * prev;
+    long expired = 1;
+
+    while (dupes) {
+        prev = dupes;
+        dupes = dupes->duplicates;
+        request_queue_free_item(queue, prev);
+        expired++;
+    }
+    item->duplicates = NULL;
+    item->fd = FD_INVALID;
+    item->deadline = 0;
+    QUEUE_STAT_ADD(noReqExpired, expired);
+
+    if (!list_append(queue, queueDirty, DIRTY_LIMIT, item)) {
+        remove_item_idx(shard, item, hash);
+        if (item->logpos) {
+            dirty_log_done(queue->dirtyLog, item->logpos);
+        }
+        request_queue_free_item(queue, item);
+    }
+}
+
+/*
+ * Whether there is anything for a pool to do. Requests still in the dirty
+ * log count as long as there is room to move them to the dirty list.
+ */
+static int work_queued(struct request_queue * queue, struct request_pool * pool) {
+    int i;
+
+    for (i = 0; i < sizeof(fetchOrder) / sizeof(fetchOrder[0]); i++) {
+        if (list_num(queue, fetchOrder[i], pool->styles) > 0) {
+            return 1;
+        }
+    }
+    return (queue->dirtyLog != NULL) && (__atomic_load_n(&(queue->lists[queueDirty].num), __ATOMIC_SEQ_CST) < DIRTY_LIMIT) &&
+           (dirty_log_pending(queue->dirtyLog) > 0);
+}
+
+// Wake up the render threads waiting for work, of every pool if there are several
+static void wake_fetchers(struct request_queue * queue) {
+    if (__atomic_load_n(&(queue->waiting), __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&(queue->qLock));
+        if (queue->numPools > 1) {
+            pthread_cond_broadcast(&queue->qCond);
+        } else {
+            pthread_cond_signal(&queue->qCond);
+        }
+        pthread_mutex_unlock(&(queue->qLock));
+    }
+}
+
+/*
+ * Move dirty requests from the log to the dirty list while it has room.
+ * Called with the scheduler lock held, which makes the room check safe as
+ * with a log nothing else adds to the dirty list without that lock.
+ */
+static void refill_dirty(struct request_queue * queue) {
+    struct item * item;
+
+    while (__atomic_load_n(&(queue->lists[queueDirty].num), __ATOMIC_SEQ_CST) < DIRTY_LIMIT) {
+        item = request_queue_alloc_item(queue);
+        if (item == NULL) {
+            return;
+        }
+        if (!dirty_log_next(queue->dirtyLog, item)) {
+            request_queue_free_item(queue, item);
+            return;
+        }
+        request_queue_add_request(queue, item);
+    }
+}
+
+/*
+ * Pick the list a pool serves next. For each pool, each list has a virtual
+ * time that advances by QUEUE_STRIDE / weight for every item taken from it,
+ * and the non-empty list furthest behind is served. A list that has been empty
+ * is brought up to the current virtual time, so it can not save up a share it
+ * did not use. Called with the scheduler lock held.
+ */
+static int pick_list(struct request_queue * queue, struct request_pool * pool) {
+    unsigned long long pass, best_pass = 0;
+    int i, list, best = -1;
+
+    for (i = 0; i < sizeof(fetchOrder) / sizeof(fetchOrder[0]); i++) {
+        list = fetchOrder[i];
+        if (list_num(queue, list, pool->styles) == 0) {
+            continue;
+        }
+        pass = MAX(pool->pass[list], pool->vtime);
+        if ((best < 0) || (pass < best_pass)) {
+            best = list;
+            best_pass = pass;
+        }
     }
+    return best;
+}
+
+static void charge_list(struct request_queue * queue, struct request_pool * pool, enum queueEnum list) {
+    pool->vtime = MAX(pool->pass[list], pool->vtime);
+    pool->pass[list] = pool->vtime + QUEUE_STRIDE / queue->weight[list];
+}
 
-    pthread_mutex_unlock(&queue->qLock);
+struct item *request_queue_fetch_request(struct request_queue * queue) {
+    return request_queue_fetch_pool_request(queue, 0);
+}
+
+/*
+ * Fetch a request of one of the styles a pool serves. Requests are served by
+ * weighted fair share between the priority lists, and round robin between the
+ * styles within a list. Anything waiting longer than the maximum age goes
+ * first, so even the lowest priority has bounded delay.
+ */
+struct item *request_queue_fetch_pool_request(struct request_queue * queue, int poolId) {
+    struct request_pool * pool = &(queue->pools[poolId]);
+    struct request_shard * shard;
+    struct item *item;
+    uint64_t hash;
+    long long now;
+    int i, list;
+
+    pthread_mutex_lock(&(queue->schedLock));
+    while (1) {
+        item = NULL;
+        now = now_ms();
+        if ((queue->dirtyLog != NULL) && (__atomic_load_n(&(queue->lists[queueDirty].num), __ATOMIC_SEQ_CST) < DIRTY_LIMIT)) {
+            refill_dirty(queue);
+        }
+        for (i = 0; (queue->maxAge > 0) && (item == NULL) && (i < sizeof(fetchOrder) / sizeof(fetchOrder[0])); i++) {
+            item = list_pop(queue, fetchOrder[i], now - queue->maxAge, pool->styles);
+        }
+        if (item == NULL) {
+            list = pick_list(queue, pool);
+            if (list >= 0) {
+                item = list_pop(queue, list, 0, pool->styles);
+            }
+        }
+        if ((item == NULL) && !work_queued(queue, pool)) {
+            /* Nothing queued, sleep until a request gets added. A request added
+             * after the check below sees waiting set and signals. */
+            pthread_mutex_unlock(&(queue->schedLock));
+            pthread_mutex_lock(&(queue->qLock));
+            __atomic_add_fetch(&(queue->waiting), 1, __ATOMIC_SEQ_CST);
+            while (!work_queued(queue, pool)) {
+                pthread_cond_wait(&(queue->qCond), &(queue->qLock));
+            }
+            __atomic_sub_fetch(&(queue->waiting), 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&(queue->qLock));
+            pthread_mutex_lock(&(queue->schedLock));
+            continue;
+        }
+        if (item == NULL) {
+            // A promotion emptied the list in the meantime
+            continue;
+        }
+
+        hash = calcHashKey(item);
+        shard = item_shard(queue, hash);
+        pthread_mutex_lock(&(shard->lock));
+        if (((item->inQueue == queueRequestPrio) || (item->inQueue == queueRequest) || (item->inQueue == queueRequestLow)) &&
+            expired(item, now)) {
+            // Rendering it now would answer nobody, don't let it hold up the others
+            expire_item(queue, shard, item, hash);
+            pthread_mutex_unlock(&(shard->lock));
+            continue;
+        }
+        charge_list(queue, pool, item->inQueue);
+        break;
+    }
+    pthread_mutex_unlock(&(queue->schedLock));
+
+    switch (item->inQueue) {
+    case queueRequestPrio: { QUEUE_STAT_ADD(noReqPrioRender, 1); break;}
+    case queueRequest: { QUEUE_STAT_ADD(noReqRender, 1); break;}
+    case queueRequestLow: { QUEUE_STAT_ADD(noReqLowRender, 1); break;}
+    case queueDirty: { QUEUE_STAT_ADD(noDirtyRender, 1); break;}
+    case queueRequestBulk: { QUEUE_STAT_ADD(noReqBulkRender, 1); break;}
+    default: break;
+    }
+    item->inQueue = queueRender;
+    pthread_mutex_unlock(&(shard->lock));
 
     return item;
 }
@@ -201,23 +672,20 @@ struct item *request_queue_fetch_request(struct request_queue * queue) {
  * requests to not send feedback to invalid FDs
  */
 void request_queue_clear_requests_by_fd(struct request_queue * queue, int fd) {
-    struct item *item, *dupes, *queueHead;
-
-    /**Only need to look up on the shorter request and render queue,
-     * as the all requests on the dirty queue already have a FD_INVALID
-     * as a file descriptor, so using the linear list shouldn't be a problem
-     */
-    pthread_mutex_lock(&(queue->qLock));
-    for (int i = 0; i < 4; i++) {
-        switch (i) {
-        case 0: { queueHead = &(queue->reqHead); break;}
-        case 1: { queueHead = &(queue->renderHead); break;}
-        case 2: { queueHead = &(queue->reqPrioHead); break;}
-        case 3: { queueHead = &(queue->reqBulkHead); break;}
-        }
+    struct item *item, *dupes;
+    struct request_shard * shard;
+    int i, j;
+
+    /* Every queued request and every request being rendered is in the index,
+     * so walking the index shards finds all of them */
+    for (i = 0; i < QUEUE_SHARDS; i++) {
+        shard = &(queue->shards[i]);
+        pthread_mutex_lock(&(shard->lock));
+        for (j = 0; j < shard->hashidxSize; j++) {
+            item = shard->item_hashidx[j].item;
+            if (item == NULL)
+                continue;
 
-        item = queueHead->next;
-        while (item != queueHead) {
             if (item->fd == fd)
                 item->fd = FD_INVALID;
 
@@ -227,189 +695,295 @@ void request_queue_clear_requests_by_fd(struct request_queue * queue, int fd) {
                     dupes->fd = FD_INVALID;
                 dupes = dupes->duplicates;
             }
-            item = item->next;
         }
+        pthread_mutex_unlock(&(shard->lock));
     }
-
-    pthread_mutex_unlock(&(queue->qLock));
 }
 
 enum protoCmd request_queue_add_request(struct request_queue * queue, struct item *item) {
     enum protoCmd status;
     const struct protocol *req;
-    struct item *list = NULL;
+    struct request_shard * shard;
+    uint64_t hash;
+    int queued;
     req = &(item->req);
     if (queue == NULL) {
         printf("queue os NULL");
         exit(3);
     }
 
-    pthread_mutex_lock(&(queue->qLock));
+    item->style = style_index(queue, req->xmlname);
+    item->queued = now_ms();
+    hash = calcHashKey(item);
+    shard = item_shard(queue, hash);
+    pthread_mutex_lock(&(shard->lock));
 
     // Check for a matching request in the current rendering or dirty queues
-    status = pending(queue, item);
+    status = pending(queue, shard, item, hash);
+    if ((status != cmdRender) && item->logpos) {
+        // A request from the dirty log is taken care of by the matching one
+        dirty_log_done(queue->dirtyLog, item->logpos);
+        item->logpos = 0;
+    }
     if (status == cmdNotDone) {
-        // We found a match in the dirty queue, can not wait for it
-        pthread_mutex_unlock(&(queue->qLock));
-        free(item);
+        // We found a match in the dirty or bulk queue that could not be
+        // moved up, can not wait for it
+        pthread_mutex_unlock(&(shard->lock));
+        request_queue_free_item(queue, item);
         return cmdNotDone;
     }
     if (status == cmdIgnore) {
-        // Found a match in render queue, item added as duplicate
-        pthread_mutex_unlock(&(queue->qLock));
+        // Found a match in a render queue, or moved one up from the dirty or
+        // bulk queue, item added as duplicate
+        pthread_mutex_unlock(&(shard->lock));
         return cmdIgnore;
     }
 
     // New request, add it to render or dirty queue
-    if ((req->cmd == cmdRender) && (queue->reqNum < REQ_LIMIT)) {
-        list = &(queue->reqHead);
-        item->inQueue = queueRequest;
-        item->originatedQueue = queueRequest;
-        queue->reqNum++;
-    } else if ((req->cmd == cmdRenderPrio) && (queue->reqPrioNum < REQ_LIMIT)) {
-        list = &(queue->reqPrioHead);
-        item->inQueue = queueRequestPrio;
-        item->originatedQueue = queueRequestPrio;
-        queue->reqPrioNum++;
-    } else if ((req->cmd == cmdRenderLow) && (queue->reqLowNum < REQ_LIMIT)) {
-        list = &(queue->reqLowHead);
-        item->inQueue = queueRequestLow;
-        item->originatedQueue = queueRequestLow;
-        queue->reqLowNum++;
-    } else if ((req->cmd == cmdRenderBulk) && (queue->reqBulkNum < REQ_LIMIT)) {
-        list = &(queue->reqBulkHead);
-        item->inQueue = queueRequestBulk;
-        item->originatedQueue = queueRequestBulk;
-        queue->reqBulkNum++;
-    } else if (queue->dirtyNum < DIRTY_LIMIT) {
-        list = &(queue->dirtyHead);
-        item->inQueue = queueDirty;
-        item->originatedQueue = queueDirty;
-        queue->dirtyNum++;
+    if (((req->cmd == cmdRender) && list_append(queue, queueRequest, REQ_LIMIT, item)) ||
+        ((req->cmd == cmdRenderPrio) && list_append(queue, queueRequestPrio, REQ_LIMIT, item)) ||
+        ((req->cmd == cmdRenderLow) && list_append(queue, queueRequestLow, REQ_LIMIT, item)) ||
+        ((req->cmd == cmdRenderBulk) && list_append(queue, queueRequestBulk, REQ_LIMIT, item))) {
+        queued = 1;
+    } else if ((queue->dirtyLog != NULL) && (item->logpos == 0)) {
+        // Dirty requests go through the log, which feeds the dirty list
+        queued = dirty_log_append(queue->dirtyLog, item);
+        if (queued) {
+            pthread_mutex_unlock(&(shard->lock));
+            request_queue_free_item(queue, item);
+            wake_fetchers(queue);
+            return cmdNotDone;
+        }
+    } else if (list_append(queue, queueDirty, DIRTY_LIMIT, item)) {
         item->fd = FD_INVALID; // No response after render
+        queued = 1;
     } else {
+        queued = 0;
+    }
+
+    if (!queued) {
         // The queue is severely backlogged. Drop request
-        queue->stats.noReqDroped++;
-        pthread_mutex_unlock(&(queue->qLock));
-        free(item);
+        QUEUE_STAT_ADD(noReqDroped, 1);
+        pthread_mutex_unlock(&(shard->lock));
+        if (item->logpos) {
+            dirty_log_done(queue->dirtyLog, item->logpos);
+        }
+        request_queue_free_item(queue, item);
         return cmdNotDone;
     }
 
-    if (list) {
-        item->next = list;
-        item->prev = list->prev;
-        item->prev->next = item;
-        list->prev = item;
-        /* In addition to the linked list, add item to a hash table index
-         * for faster lookup of pending requests.
-         */
-        insert_item_idx(queue, item);
-
-        pthread_cond_signal(&queue->qCond);
-    } else
-        free(item);
+    /* In addition to the linked list, add item to a hash table index
+     * for faster lookup of pending requests.
+     */
+    insert_item_idx(shard, item, hash);
+    status = (item->inQueue == queueDirty) ? cmdNotDone : cmdIgnore;
+    pthread_mutex_unlock(&(shard->lock));
 
-    pthread_mutex_unlock(&queue->qLock);
+    wake_fetchers(queue);
 
-    return (list == &(queue->dirtyHead))?cmdNotDone:cmdIgnore;
+    return status;
 }
 
 void request_queue_remove_request(struct request_queue * queue, struct item * request, int render_time) {
-    pthread_mutex_lock(&(queue->qLock));
+    uint64_t hash = calcHashKey(request);
+    struct request_shard * shard = item_shard(queue, hash);
+    int wasted;
+
+    pthread_mutex_lock(&(shard->lock));
     if (request->inQueue != queueRender) {
         syslog(LOG_WARNING, "Removing request from queue, even though not on rendering queue");
     }
+    remove_item_idx(shard, request, hash);
+    // Requests whose clients all gave up while the tile was being rendered
+    wasted = ((request->originatedQueue == queueRequestPrio) || (request->originatedQueue == queueRequest) ||
+              (request->originatedQueue == queueRequestLow)) && expired(request, now_ms());
+    pthread_mutex_unlock(&(shard->lock));
+
+    if (request->logpos) {
+        dirty_log_done(queue->dirtyLog, request->logpos);
+    }
+
+    if (wasted) {
+        QUEUE_STAT_ADD(noReqWasted, 1);
+        if (render_time > 0) {
+            QUEUE_STAT_ADD(timeReqWasted, render_time);
+        }
+    }
+
     if (render_time > 0) {
         switch (request->originatedQueue) {
-        case queueRequestPrio: { queue->stats.timeReqPrioRender += render_time; break;}
-        case queueRequest: { queue->stats.timeReqRender += render_time; break;}
-        case queueRequestLow: { queue->stats.timeReqLowRender += render_time; break;}
-        case queueDirty: { queue->stats.timeReqDirty += render_time; break;}
-        case queueRequestBulk: { queue->stats.timeReqBulkRender += render_time; break;}
+        case queueRequestPrio: { QUEUE_STAT_ADD(timeReqPrioRender, render_time); break;}
+        case queueRequest: { QUEUE_STAT_ADD(timeReqRender, render_time); break;}
+        case queueRequestLow: { QUEUE_STAT_ADD(timeReqLowRender, render_time); break;}
+        case queueDirty: { QUEUE_STAT_ADD(timeReqDirty, render_time); break;}
+        case queueRequestBulk: { QUEUE_STAT_ADD(timeReqBulkRender, render_time); break;}
+        default: break;
         }
-        queue->stats.noZoomRender[request->req.z]++;
-        queue->stats.timeZoomRender[request->req.z] += render_time;
+        QUEUE_STAT_ADD(noZoomRender[request->req.z], 1);
+        QUEUE_STAT_ADD(timeZoomRender[request->req.z], render_time);
     }
-    request->next->prev = request->prev;
-    request->prev->next = request->next;
-    remove_item_idx(queue, request);
-    pthread_mutex_unlock(&(queue->qLock));
 }
 
 int request_queue_no_requests_queued(struct request_queue * queue, enum protoCmd priority) {
-    int noReq = -1;
-    pthread_mutex_lock(&(queue->qLock));
     switch(priority) {
     case cmdRenderPrio:
-        noReq = queue->reqPrioNum;
-        break;
+        return __atomic_load_n(&(queue->lists[queueRequestPrio].num), __ATOMIC_RELAXED);
     case cmdRender:
-        noReq = queue->reqNum;
-        break;
+        return __atomic_load_n(&(queue->lists[queueRequest].num), __ATOMIC_RELAXED);
     case cmdRenderLow:
-        noReq = queue->reqLowNum;
-        break;
+        return __atomic_load_n(&(queue->lists[queueRequestLow].num), __ATOMIC_RELAXED);
     case cmdDirty:
-        noReq = queue->dirtyNum;
-        break;
+        // Includes the backlog in the dirty log
+        return __atomic_load_n(&(queue->lists[queueDirty].num), __ATOMIC_RELAXED) +
+               ((queue->dirtyLog != NULL) ? dirty_log_pending(queue->dirtyLog) : 0);
     case cmdRenderBulk:
-        noReq = queue->reqBulkNum;
-        break;
+        return __atomic_load_n(&(queue->lists[queueRequestBulk].num), __ATOMIC_RELAXED);
+    default:
+        return -1;
     }
-    pthread_mutex_unlock(&queue->qLock);
-    return noReq;
 }
 
+/*
+ * Take a snapshot of the stats without stopping the queue. Every counter is
+ * read atomically, but counters may be updated while the copy is made.
+ */
 void request_queue_copy_stats(struct request_queue * queue, stats_struct * stats) {
-    pthread_mutex_lock(&(queue->qLock));
-    memcpy(stats, &(queue->stats), sizeof(stats_struct));
-    pthread_mutex_unlock(&queue->qLock);
+    long *src = (long *)&(queue->stats);
+    long *dst = (long *)stats;
+    int i;
+
+    for (i = 0; i < sizeof(stats_struct) / sizeof(long); i++) {
+        dst[i] = __atomic_load_n(&(src[i]), __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Create the locks of a new queue. If one can't be created, the ones created
+ * before it are destroyed again.
+ */
+static int request_queue_init_locks(struct request_queue * queue) {
+    int i = 0, j = 0;
+
+    if (pthread_mutex_init(&(queue->qLock), NULL) != 0) {
+        return -1;
+    }
+    if (pthread_cond_init(&(queue->qCond), NULL) != 0) {
+        goto fail_cond;
+    }
+    if (pthread_mutex_init(&(queue->slabLock), NULL) != 0) {
+        goto fail_slab;
+    }
+    if (pthread_mutex_init(&(queue->schedLock), NULL) != 0) {
+        goto fail_sched;
+    }
+    for (i = 0; i <= queueRequestLow; i++) {
+        if (pthread_mutex_init(&(queue->lists[i].lock), NULL) != 0) {
+            goto fail_lists;
+        }
+    }
+    for (j = 0; j < QUEUE_SHARDS; j++) {
+        if (pthread_mutex_init(&(queue->shards[j].lock), NULL) != 0) {
+            goto fail_shards;
+        }
+    }
+    return 0;
+
+fail_shards:
+    while (j-- > 0) {
+        pthread_mutex_destroy(&(queue->shards[j].lock));
+    }
+fail_lists:
+    while (i-- > 0) {
+        pthread_mutex_destroy(&(queue->lists[i].lock));
+    }
+    pthread_mutex_destroy(&(queue->schedLock));
+fail_sched:
+    pthread_mutex_destroy(&(queue->slabLock));
+fail_slab:
+    pthread_cond_destroy(&(queue->qCond));
+fail_cond:
+    pthread_mutex_destroy(&(queue->qLock));
+    return -1;
 }
 
 struct request_queue * request_queue_init() {
-    int res;
     struct request_queue * queue = calloc(1,sizeof (struct request_queue));
+    int shardSize = 1;
+    int i, j;
+
     if (queue == NULL) {
         return NULL;
     }
 
-    res = pthread_mutex_init(&(queue->qLock), NULL);
-    if (res != 0) {
-        syslog(LOG_ERR, "Failed to create mutex for request_queue");
+    if (request_queue_init_locks(queue) < 0) {
+        syslog(LOG_ERR, "Failed to create locks for request_queue");
         free(queue);
         return NULL;
     }
-    res = pthread_cond_init(&(queue->qCond), NULL);
-    if (res != 0) {
-        syslog(LOG_ERR, "Failed to create condition variable for request_queue");
-        pthread_mutex_destroy(&(queue->qLock));
-        free(queue);
+
+    // Everything below is allocated with the queue, so a single
+    // request_queue_close cleans up after a failure
+    for (i = 0; i <= queueRequestLow; i++) {
+        for (j = 0; j < QUEUE_STYLES; j++) {
+            queue->lists[i].heads[j].next = queue->lists[i].heads[j].prev = &(queue->lists[i].heads[j]);
+        }
+        queue->weight[i] = 1;
+    }
+    queue->weight[queueRequestPrio] = QUEUE_WEIGHT_PRIO;
+    queue->weight[queueRequest] = QUEUE_WEIGHT_REQUEST;
+    queue->weight[queueRequestLow] = QUEUE_WEIGHT_LOW;
+    queue->weight[queueDirty] = QUEUE_WEIGHT_DIRTY;
+    queue->weight[queueRequestBulk] = QUEUE_WEIGHT_BULK;
+    queue->numPools = 1;
+    queue->pools[0].styles = QUEUE_ALL_STYLES;
+
+    queue->itemSlabSize = ITEM_SLAB_SIZE;
+    queue->itemSlab = (struct item *) malloc(sizeof(struct item) * queue->itemSlabSize);
+    if (queue->itemSlab == NULL) {
+        syslog(LOG_ERR, "Failed to allocate memory for request_queue");
+        request_queue_close(queue);
         return NULL;
     }
+    for (i = queue->itemSlabSize - 1; i >= 0; i--) {
+        queue->itemSlab[i].next = queue->itemFree;
+        queue->itemFree = &(queue->itemSlab[i]);
+    }
 
-    queue->stats.noDirtyRender = 0;
-    queue->stats.noReqDroped = 0;
-    queue->stats.noReqRender = 0;
-    queue->stats.noReqPrioRender = 0;
-    queue->stats.noReqLowRender = 0;
-    queue->stats.noReqBulkRender = 0;
-
-    queue->reqHead.next = queue->reqHead.prev = &(queue->reqHead);
-    queue->reqPrioHead.next = queue->reqPrioHead.prev = &(queue->reqPrioHead);
-    queue->reqLowHead.next = queue->reqLowHead.prev = &(queue->reqLowHead);
-    queue->reqBulkHead.next = queue->reqBulkHead.prev = &(queue->reqBulkHead);
-    queue->dirtyHead.next = queue->dirtyHead.prev = &(queue->dirtyHead);
-    queue->renderHead.next = queue->renderHead.prev = &(queue->renderHead);
-    queue->hashidxSize = HASHIDX_SIZE;
-    queue->item_hashidx = (struct item_idx *) malloc(sizeof(struct item_idx) * queue->hashidxSize);
-    bzero(queue->item_hashidx, sizeof(struct item_idx) * queue->hashidxSize);
+    // Leave room for an uneven spread of the items over the shards
+    while (shardSize < 4 * queue->itemSlabSize / QUEUE_SHARDS) {
+        shardSize <<= 1;
+    }
+    for (i = 0; i < QUEUE_SHARDS; i++) {
+        queue->shards[i].hashidxSize = shardSize;
+        queue->shards[i].item_hashidx = (struct item_idx *) calloc(shardSize, sizeof(struct item_idx));
+        if (queue->shards[i].item_hashidx == NULL) {
+            syslog(LOG_ERR, "Failed to allocate memory for request_queue");
+            request_queue_close(queue);
+            return NULL;
+        }
+    }
 
     return queue;
 }
 
 void request_queue_close(struct request_queue * queue) {
+    int i;
+
     //TODO: Free items if the queues are not empty at closing time
+    if (queue->dirtyLog != NULL) {
+        dirty_log_close(queue->dirtyLog);
+    }
+    for (i = 0; i < QUEUE_SHARDS; i++) {
+        pthread_mutex_destroy(&(queue->shards[i].lock));
+        free(queue->shards[i].item_hashidx);
+    }
+    for (i = 0; i <= queueRequestLow; i++) {
+        pthread_mutex_destroy(&(queue->lists[i].lock));
+    }
+    pthread_mutex_destroy(&(queue->schedLock));
     pthread_mutex_destroy(&(queue->qLock));
-    free(queue->item_hashidx);
+    pthread_cond_destroy(&(queue->qCond));
+    pthread_mutex_destroy(&(queue->slabLock));
+    free(queue->itemSlab);
     free(queue);
 }
@@ -10,18 +10,21 @@
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <inttypes.h>
 #ifdef HAVE_PTHREAD
 #include <pthread.h>
 #endif
 
 
 #include "store.h"
+#include "metatile.h"
 #include "store_file.h"
 #include "store_memcached.h"
 #include "store_rados.h"
 #include "store_ro_http_proxy.h"
 #include "store_ro_composite.h"
 #include "store_null.h"
+#include "store_dedup.h"
 
 //TODO: Make this function handle different logging backends, depending on if on compiles it from apache or something else
 void log_message(int log_lvl, const char *format, ...) {
@@ -54,6 +57,106 @@ void log_message(int log_lvl, const char *format, ...) {
     va_end(ap);
 }
 
+/*
+ * Extract the ETag of the tile at meta_offset from the first len bytes of a
+ * metatile, if it was written with per tile hashes. Returns 1 and fills in etag
+ * (TILE_ETAG_MAX long) if it was, otherwise returns 0 and sets etag to "".
+ */
+int metatile_etag(const char * meta, size_t len, int meta_offset, char * etag) {
+    const struct meta_layout * m = (const struct meta_layout *)meta;
+    const struct meta_etags * e;
+    size_t header_len = sizeof(struct meta_layout) + METATILE*METATILE*sizeof(struct entry);
+    uint64_t hash;
+    int i;
+
+    etag[0] = 0;
+    if (len < header_len + META_ETAGS_SIZE) {
+        return 0;
+    }
+    e = (const struct meta_etags *)(meta + header_len);
+    if (memcmp(e->magic, META_ETAG_MAGIC, strlen(META_ETAG_MAGIC)) || (e->count != METATILE*METATILE) || (m->count != METATILE*METATILE)) {
+        return 0;
+    }
+    // Make sure this really is a hash table and not the start of the tile data
+    for (i = 0; i < m->count; i++) {
+        if ((m->index[i].offset < 0) || ((size_t)m->index[i].offset < header_len + META_ETAGS_SIZE)) {
+            return 0;
+        }
+    }
+
+    memcpy(&hash, meta + header_len + sizeof(struct meta_etags) + meta_offset * sizeof(uint64_t), sizeof(hash));
+    snprintf(etag, TILE_ETAG_MAX, "%016" PRIx64, hash);
+    return 1;
+}
+
+/*
+ * The tileFormat recorded in the first len bytes of a metatile, or
+ * formatUnknown for metatiles written without it.
+ */
+int metatile_format(const char * meta, size_t len) {
+    const struct meta_layout * m = (const struct meta_layout *)meta;
+    const struct meta_etags * e;
+    const struct meta_format * f;
+    size_t header_len = sizeof(struct meta_layout) + METATILE*METATILE*sizeof(struct entry);
+    int i;
+
+    if (len < header_len + META_ETAGS_SIZE + META_FORMAT_SIZE) {
+        return formatUnknown;
+    }
+    e = (const struct meta_etags *)(meta + header_len);
+    f = (const struct meta_format *)(meta + header_len + META_ETAGS_SIZE);
+    if (memcmp(e->magic, META_ETAG_MAGIC, strlen(META_ETAG_MAGIC)) || memcmp(f->magic, META_FORMAT_MAGIC, strlen(META_FORMAT_MAGIC)) || (m->count != METATILE*METATILE)) {
+        return formatUnknown;
+    }
+    // As with the hashes, make sure this isn't the start of the tile data
+    for (i = 0; i < m->count; i++) {
+        if ((m->index[i].offset < 0) || ((size_t)m->index[i].offset < header_len + META_ETAGS_SIZE + META_FORMAT_SIZE)) {
+            return formatUnknown;
+        }
+    }
+    if ((f->format < formatUnknown) || (f->format > formatWebp)) {
+        return formatUnknown;
+    }
+    return f->format;
+}
+
+static const struct {
+    const char * name;      // prefix of the mapnik output format, e.g. png256:z=9 or jpeg85
+    const char * extension;
+    const char * mimetype;
+} tile_formats[] = {
+    [formatUnknown] = { NULL, NULL, NULL },
+    [formatPng] = { "png", "png", "image/png" },
+    [formatJpeg] = { "jpeg", "jpg", "image/jpeg" },
+    [formatWebp] = { "webp", "webp", "image/webp" },
+};
+
+// The tileFormat of a mapnik output format string
+enum tileFormat tile_format(const char * output_format) {
+    int i;
+
+    for (i = formatPng; i <= formatWebp; i++) {
+        if (strncmp(output_format, tile_formats[i].name, strlen(tile_formats[i].name)) == 0) {
+            return (enum tileFormat)i;
+        }
+    }
+    return formatUnknown;
+}
+
+const char * tile_format_mimetype(int format) {
+    if ((format <= formatUnknown) || (format > formatWebp)) {
+        return NULL;
+    }
+    return tile_formats[format].mimetype;
+}
+
+const char * tile_format_extension(int format) {
+    if ((format <= formatUnknown) || (format > formatWebp)) {
+        return NULL;
+    }
+    return tile_formats[format].extension;
+}
+
 /**
  * In Apache 2.2, we call the init_storage_backend once per process. For mpm_worker and mpm_event multiple threads therefore use the same
  * storage context, and all storage backends need to be thread-safe in order not to cause issues with these mpm's
@@ -103,6 +206,11 @@ struct storage_backend * init_storage_backend(const char * options) {
         store = init_storage_ro_composite(options);
         return store;
     }
+    if (strstr(options,"dedup://") == options) {
+        log_message(STORE_LOGLVL_DEBUG, "init_storage_backend: initialising dedup storage backend at: %s", options);
+        store = init_storage_dedup(options);
+        return store;
+    }
     if (strstr(options,"null://") == options) {
         log_message(STORE_LOGLVL_DEBUG, "init_storage_backend: initialising null storage backend at: %s", options);
         store = init_storage_null();
@@ -0,0 +1,608 @@
+/* Content addressed tile storage
+ *
+ * Tiles are kept in a single pack file per tile directory and every
+ * distinct tile is written to it only once. The metatiles themselves are
+ * small records at the usual metatile paths that point into the pack.
+ * Blank sea, empty land and other repeated tiles so take their space once
+ * across all metatiles and zooms, and a re-render only appends the tiles
+ * that changed.
+ *
+ * An index of the tiles in the pack is kept in a memory mapped hash table
+ * next to it. It is only opened by writers, once per process and tile
+ * directory, readers just follow the offsets of the metatile records. The
+ * index has a fixed size and a tile that can not be placed in it is
+ * appended to the pack again, so a full index only costs disk space.
+ *
+ * This backend is experimental: tiles that are no longer referenced are
+ * not removed from the pack, which therefore grows with every re-render
+ * of changed tiles. There is no compaction yet.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include "store.h"
+#include "metatile.h"
+#include "render_config.h"
+#include "store_dedup.h"
+#include "store_file.h"
+
+#define DEDUP_PACK "dedup.pack"
+#define DEDUP_INDEX "dedup.idx"
+#define DEDUP_INDEX_MAGIC "renderd dedup index 1"
+// The header takes the first page of the index, the slots follow
+#define DEDUP_INDEX_HEADER (4096)
+// Slots looked at for a tile before it is appended without an index entry
+#define DEDUP_PROBE_MAX (64)
+
+struct dedup_index_header {
+    char magic[24];
+    uint64_t capacity;
+};
+
+struct dedup_blob {
+    uint64_t hash[2];
+    uint64_t offset;
+    uint32_t size;     // 0 for a free slot
+    uint32_t reserved;
+};
+
+/*
+ * The pack and index of a tile directory. They are shared by all backends of
+ * the process that write to the directory, so the index is only mapped once.
+ */
+struct dedup_writer {
+    char tile_dir[PATH_MAX];
+    int refs;
+    // Serialises the writers of this process, the index is flocked against other processes
+    pthread_mutex_t lock;
+    int pack_fd;
+    int index_fd;
+    void * index;
+    size_t index_len;
+    uint64_t capacity;
+    struct dedup_writer * next;
+};
+
+static pthread_mutex_t dedup_writers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dedup_writer * dedup_writers = NULL;
+
+struct dedup_ctx {
+    char * tile_dir;
+    char pack_path[PATH_MAX];
+    char index_path[PATH_MAX];
+    // Writes the metatile records, and does stat, expiry and deletion of them
+    struct storage_backend * records;
+    // Taken on the first write
+    struct dedup_writer * writer;
+};
+
+// A tile appended to the pack whose index slot is filled in once the pack is synced
+struct dedup_pending {
+    struct dedup_blob * slot;
+    struct dedup_blob blob;
+};
+
+#define DEDUP_RECORD_SIZE (sizeof(struct dedup_layout) + (sizeof(struct dedup_entry) * (METATILE * METATILE)))
+
+/*
+ * 128bit hash of a tile, so that different tiles practically never collide.
+ * Made of two 64bit FNV-1a lanes with different offset bases, the second
+ * one going over the data backwards.
+ */
+static void dedup_hash(const char * data, size_t len, uint64_t hash[2]) {
+    uint64_t h0 = 14695981039346656037ULL;
+    uint64_t h1 = 0x6c62272e07bb0142ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h0 ^= (unsigned char)data[i];
+        h0 *= 1099511628211ULL;
+        h1 ^= (unsigned char)data[len - 1 - i];
+        h1 *= 1099511628211ULL;
+    }
+    hash[0] = h0;
+    hash[1] = h1;
+}
+
+/*
+ * Open the pack and map the index of a tile directory, creating them if
+ * needed.
+ */
+static int dedup_writer_open(struct dedup_writer * w, const char * pack_path, const char * index_path) {
+    struct dedup_index_header h;
+    struct stat st;
+
+    w->pack_fd = open(pack_path, O_RDWR | O_CREAT, 0666);
+    if (w->pack_fd < 0) {
+        log_message(STORE_LOGLVL_ERR, "dedup: Could not open pack %s: %s", pack_path, strerror(errno));
+        return -1;
+    }
+    w->index_fd = open(index_path, O_RDWR | O_CREAT, 0666);
+    if (w->index_fd < 0) {
+        log_message(STORE_LOGLVL_ERR, "dedup: Could not open index %s: %s", index_path, strerror(errno));
+        goto fail;
+    }
+
+    // Whoever gets here first sets up the index
+    flock(w->index_fd, LOCK_EX);
+    if (fstat(w->index_fd, &st) < 0) {
+        flock(w->index_fd, LOCK_UN);
+        goto fail;
+    }
+    if (st.st_size < DEDUP_INDEX_HEADER) {
+        memset(&h, 0, sizeof(h));
+        strncpy(h.magic, DEDUP_INDEX_MAGIC, sizeof(h.magic));
+        h.capacity = DEDUP_INDEX_SIZE;
+        if ((ftruncate(w->index_fd, DEDUP_INDEX_HEADER + h.capacity * sizeof(struct dedup_blob)) < 0) ||
+            (pwrite(w->index_fd, &h, sizeof(h), 0) != sizeof(h))) {
+            log_message(STORE_LOGLVL_ERR, "dedup: Could not create index %s: %s", index_path, strerror(errno));
+            flock(w->index_fd, LOCK_UN);
+            goto fail;
+        }
+    } else if (pread(w->index_fd, &h, sizeof(h), 0) != sizeof(h)) {
+        flock(w->index_fd, LOCK_UN);
+        goto fail;
+    }
+    flock(w->index_fd, LOCK_UN);
+
+    if (strncmp(h.magic, DEDUP_INDEX_MAGIC, sizeof(h.magic)) || (h.capacity == 0)) {
+        log_message(STORE_LOGLVL_ERR, "dedup: %s is not a dedup index", index_path);
+        goto fail;
+    }
+    w->capacity = h.capacity;
+    w->index_len = DEDUP_INDEX_HEADER + h.capacity * sizeof(struct dedup_blob);
+    w->index = mmap(NULL, w->index_len, PROT_READ | PROT_WRITE, MAP_SHARED, w->index_fd, 0);
+    if (w->index == MAP_FAILED) {
+        log_message(STORE_LOGLVL_ERR, "dedup: Could not map index %s: %s", index_path, strerror(errno));
+        w->index = NULL;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if (w->index_fd >= 0) {
+        close(w->index_fd);
+        w->index_fd = -1;
+    }
+    close(w->pack_fd);
+    w->pack_fd = -1;
+    return -1;
+}
+
+// Take a reference to the writer of the tile directory of ctx, opening it if needed
+static struct dedup_writer * dedup_writer_get(struct dedup_ctx * ctx) {
+    struct dedup_writer * w;
+
+    pthread_mutex_lock(&dedup_writers_lock);
+    for (w = dedup_writers; w; w = w->next) {
+        if (strcmp(w->tile_dir, ctx->tile_dir) == 0) {
+            w->refs++;
+            pthread_mutex_unlock(&dedup_writers_lock);
+            return w;
+        }
+    }
+
+    w = (struct dedup_writer *)calloc(1, sizeof(struct dedup_writer));
+    if (w == NULL) {
+        pthread_mutex_unlock(&dedup_writers_lock);
+        return NULL;
+    }
+    if (dedup_writer_open(w, ctx->pack_path, ctx->index_path) < 0) {
+        pthread_mutex_unlock(&dedup_writers_lock);
+        free(w);
+        return NULL;
+    }
+    strncpy(w->tile_dir, ctx->tile_dir, sizeof(w->tile_dir) - 1);
+    w->refs = 1;
+    pthread_mutex_init(&(w->lock), NULL);
+    w->next = dedup_writers;
+    dedup_writers = w;
+    pthread_mutex_unlock(&dedup_writers_lock);
+    return w;
+}
+
+static void dedup_writer_put(struct dedup_writer * w) {
+    struct dedup_writer ** prev;
+
+    pthread_mutex_lock(&dedup_writers_lock);
+    if (--w->refs > 0) {
+        pthread_mutex_unlock(&dedup_writers_lock);
+        return;
+    }
+    for (prev = &dedup_writers; *prev != w; prev = &((*prev)->next));
+    *prev = w->next;
+    pthread_mutex_unlock(&dedup_writers_lock);
+
+    munmap(w->index, w->index_len);
+    close(w->index_fd);
+    close(w->pack_fd);
+    pthread_mutex_destroy(&(w->lock));
+    free(w);
+}
+
+/*
+ * Find a tile in the pack, or append it. The index slot of an appended tile
+ * is only reserved in pending, it is filled in once the pack is synced.
+ * Called with the writer lock and the index file lock held.
+ */
+static int dedup_store_blob(struct dedup_writer * w, const char * data, uint32_t size, uint64_t * offset, struct dedup_pending * pending, int * npending) {
+    struct dedup_blob * blobs = (struct dedup_blob *)((char *)w->index + DEDUP_INDEX_HEADER);
+    struct dedup_blob * blob, * free_slot = NULL;
+    uint64_t hash[2];
+    off_t end;
+    size_t pos;
+    ssize_t res;
+    int i, j;
+
+    dedup_hash(data, size, hash);
+    for (i = 0; (i < DEDUP_PROBE_MAX) && (free_slot == NULL); i++) {
+        blob = &(blobs[(hash[1] + i) % w->capacity]);
+        if (blob->size == 0) {
+            for (j = 0; (j < *npending) && (pending[j].slot != blob); j++);
+            if (j == *npending) {
+                free_slot = blob;
+            } else if ((pending[j].blob.hash[0] == hash[0]) && (pending[j].blob.hash[1] == hash[1]) && (pending[j].blob.size == size)) {
+                *offset = pending[j].blob.offset;
+                return 0;
+            }
+            continue;
+        }
+        if ((blob->hash[0] == hash[0]) && (blob->hash[1] == hash[1]) && (blob->size == size)) {
+            *offset = blob->offset;
+            return 0;
+        }
+    }
+
+    end = lseek(w->pack_fd, 0, SEEK_END);
+    if (end < 0) {
+        return -1;
+    }
+    for (pos = 0; pos < size; pos += res) {
+        res = pwrite(w->pack_fd, data + pos, size - pos, end + pos);
+        if (res <= 0) {
+            log_message(STORE_LOGLVL_WARNING, "dedup: Error writing to pack of %s: %s", w->tile_dir, strerror(errno));
+            return -1;
+        }
+    }
+
+    // Without a free slot the tile is in the pack, but can't be found for reuse
+    if (free_slot) {
+        pending[*npending].slot = free_slot;
+        pending[*npending].blob.hash[0] = hash[0];
+        pending[*npending].blob.hash[1] = hash[1];
+        pending[*npending].blob.offset = end;
+        pending[*npending].blob.size = size;
+        (*npending)++;
+    }
+    *offset = end;
+    return 1;
+}
+
+/*
+ * Takes a metatile as written by metaTile::save, appends the tiles that are
+ * not in the pack yet and writes the record pointing at them. The pack is
+ * synced before the index or the record refer to the appended tiles, so
+ * neither can point at data lost in a crash.
+ */
+static int dedup_metatile_write(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, const char *buf, int sz) {
+    struct dedup_ctx * ctx = (struct dedup_ctx *)(store->storage_ctx);
+    const struct meta_layout * m = (const struct meta_layout *)buf;
+    size_t header_len = sizeof(struct meta_layout) + (sizeof(struct entry) * (METATILE * METATILE));
+    struct dedup_pending pending[METATILE * METATILE];
+    struct dedup_writer * w;
+    struct dedup_layout * record;
+    int i, j, res = 0, appended = 0, npending = 0;
+
+    if ((sz < (int)header_len) || (m->count != (METATILE * METATILE))) {
+        log_message(STORE_LOGLVL_WARNING, "dedup: Refusing to write malformed metatile");
+        return -1;
+    }
+
+    if (ctx->writer == NULL) {
+        ctx->writer = dedup_writer_get(ctx);
+        if (ctx->writer == NULL) {
+            return -1;
+        }
+    }
+    w = ctx->writer;
+
+    record = (struct dedup_layout *)calloc(1, DEDUP_RECORD_SIZE);
+    if (record == NULL) {
+        return -1;
+    }
+    memcpy(record->magic, DEDUP_META_MAGIC, strlen(DEDUP_META_MAGIC));
+    record->count = m->count;
+    record->x = m->x;
+    record->y = m->y;
+    record->z = m->z;
+    record->compressed = (memcmp(m->magic, META_MAGIC_COMPRESSED, strlen(META_MAGIC_COMPRESSED)) == 0);
+    record->format = metatile_format(buf, sz);
+
+    pthread_mutex_lock(&(w->lock));
+    flock(w->index_fd, LOCK_EX);
+    for (i = 0; (i < m->count) && (res >= 0); i++) {
+        if ((m->index[i].offset < 0) || (m->index[i].size < 0) || (m->index[i].offset + m->index[i].size > sz)) {
+            log_message(STORE_LOGLVL_WARNING, "dedup: Tile %i lies outside of the metatile", i);
+            res = -1;
+            break;
+        }
+        record->index[i].size = m->index[i].size;
+        record->index[i].etag = meta_tile_hash(buf + m->index[i].offset, m->index[i].size);
+        if (m->index[i].size == 0) {
+            continue;
+        }
+        // Tiles the metatile already shares are in the pack by now
+        for (j = 0; j < i; j++) {
+            if ((m->index[j].offset == m->index[i].offset) && (m->index[j].size == m->index[i].size)) {
+                break;
+            }
+        }
+        if (j < i) {
+            record->index[i].offset = record->index[j].offset;
+        } else {
+            res = dedup_store_blob(w, buf + m->index[i].offset, m->index[i].size, &(record->index[i].offset), pending, &npending);
+            appended |= (res > 0);
+        }
+    }
+    if ((res >= 0) && appended && (fdatasync(w->pack_fd) < 0)) {
+        log_message(STORE_LOGLVL_WARNING, "dedup: Could not sync pack of %s: %s", w->tile_dir, strerror(errno));
+        res = -1;
+    }
+    if (res >= 0) {
+        for (i = 0; i < npending; i++) {
+            pending[i].slot->hash[0] = pending[i].blob.hash[0];
+            pending[i].slot->hash[1] = pending[i].blob.hash[1];
+            pending[i].slot->offset = pending[i].blob.offset;
+            // The size marks the slot as used, so it goes last
+            pending[i].slot->size = pending[i].blob.size;
+        }
+    }
+    flock(w->index_fd, LOCK_UN);
+    pthread_mutex_unlock(&(w->lock));
+
+    if (res >= 0) {
+        res = ctx->records->metatile_write(ctx->records, xmlconfig, options, x, y, z, (const char *)record, DEDUP_RECORD_SIZE);
+        res = (res == (int)DEDUP_RECORD_SIZE) ? sz : -1;
+    }
+    free(record);
+    return res;
+}
+
+/*
+ * Look up the entry of a tile in its metatile record. On success the open
+ * record is returned in fd, which the caller closes.
+ */
+static int dedup_tile_locate(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, int * fd, struct dedup_entry * entry, int * compressed, int * format, char * log_msg) {
+    struct dedup_ctx * ctx = (struct dedup_ctx *)(store->storage_ctx);
+    char path[PATH_MAX];
+    struct dedup_layout * record;
+    int meta_offset;
+
+    meta_offset = xyzo_to_meta(path, sizeof(path), ctx->tile_dir, xmlconfig, options, x, y, z);
+
+    *fd = open(path, O_RDONLY);
+    if (*fd < 0) {
+        snprintf(log_msg, PATH_MAX - 1, "Could not open metatile %s. Reason: %s\n", path, strerror(errno));
+        return -1;
+    }
+    record = (struct dedup_layout *)malloc(DEDUP_RECORD_SIZE);
+    if (record == NULL) {
+        snprintf(log_msg, PATH_MAX - 1, "Failed to allocate memory for metatile %s\n", path);
+        close(*fd);
+        return -1;
+    }
+    if (pread(*fd, record, DEDUP_RECORD_SIZE, 0) != DEDUP_RECORD_SIZE) {
+        snprintf(log_msg, PATH_MAX - 1, "Meta file %s too small to contain header\n", path);
+        close(*fd);
+        free(record);
+        return -3;
+    }
+    if (memcmp(record->magic, DEDUP_META_MAGIC, strlen(DEDUP_META_MAGIC)) || (record->count != (METATILE * METATILE))) {
+        snprintf(log_msg, PATH_MAX - 1, "Meta file %s is not a dedup metatile\n", path);
+        close(*fd);
+        free(record);
+        return -4;
+    }
+    *entry = record->index[meta_offset];
+    *compressed = record->compressed;
+    if (format) *format = record->format;
+    free(record);
+    return 0;
+}
+
+static int dedup_tile_fetch(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz, int * compressed, struct stat_info * sinfo, char * etag, int * format, char * log_msg) {
+    struct dedup_ctx * ctx = (struct dedup_ctx *)(store->storage_ctx);
+    struct dedup_entry entry;
+    int fd, res;
+    size_t pos;
+    ssize_t got;
+
+    if (etag) etag[0] = 0;
+    if (format) *format = formatUnknown;
+    if (sinfo) *sinfo = ctx->records->tile_stat(ctx->records, xmlconfig, options, x, y, z);
+
+    res = dedup_tile_locate(store, xmlconfig, options, x, y, z, &fd, &entry, compressed, format, log_msg);
+    if (res < 0) {
+        return res;
+    }
+    close(fd);
+
+    if (entry.size > sz) {
+        snprintf(log_msg, PATH_MAX - 1, "Truncating tile %u to fit buffer of %zu\n", entry.size, sz);
+        return -6;
+    }
+    if (entry.size == 0) {
+        return 0;
+    }
+
+    fd = open(ctx->pack_path, O_RDONLY);
+    if (fd < 0) {
+        snprintf(log_msg, PATH_MAX - 1, "Could not open pack %s. Reason: %s\n", ctx->pack_path, strerror(errno));
+        return -1;
+    }
+    for (pos = 0; pos < entry.size; pos += got) {
+        got = pread(fd, buf + pos, entry.size - pos, entry.offset + pos);
+        if (got < 0) {
+            snprintf(log_msg, PATH_MAX - 1, "Failed to read data from pack %s. Reason: %s\n", ctx->pack_path, strerror(errno));
+            close(fd);
+            return -8;
+        } else if (got == 0) {
+            snprintf(log_msg, PATH_MAX - 1, "Tile slice %" PRIu64 "+%u lies outside of pack %s\n", entry.offset, entry.size, ctx->pack_path);
+            close(fd);
+            return -7;
+        }
+    }
+    close(fd);
+
+    if (etag) snprintf(etag, TILE_ETAG_MAX, "%016" PRIx64, entry.etag);
+    return pos;
+}
+
+static int dedup_tile_read(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz, int * compressed, char * log_msg) {
+    return dedup_tile_fetch(store, xmlconfig, options, x, y, z, buf, sz, compressed, NULL, NULL, NULL, log_msg);
+}
+
+// The slice of a tile is its range of the pack
+static int dedup_tile_read_slice(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, int * fd, off_t * offset, size_t * len, int * compressed, struct stat_info * sinfo, char * etag, int * format, char * log_msg) {
+    struct dedup_ctx * ctx = (struct dedup_ctx *)(store->storage_ctx);
+    struct dedup_entry entry;
+    struct stat st;
+    int res;
+
+    if (etag) etag[0] = 0;
+    if (format) *format = formatUnknown;
+    if (sinfo) *sinfo = ctx->records->tile_stat(ctx->records, xmlconfig, options, x, y, z);
+
+    res = dedup_tile_locate(store, xmlconfig, options, x, y, z, fd, &entry, compressed, format, log_msg);
+    if (res < 0) {
+        *fd = -1;
+        return res;
+    }
+    *offset = 0;
+    *len = 0;
+    if (entry.size == 0) {
+        // Nothing to send, the open record will do
+        return 0;
+    }
+    close(*fd);
+
+    *fd = open(ctx->pack_path, O_RDONLY);
+    if (*fd < 0) {
+        snprintf(log_msg, PATH_MAX - 1, "Could not open pack %s. Reason: %s\n", ctx->pack_path, strerror(errno));
+        return -1;
+    }
+    // Make sure a truncated pack can't make us send less than we announced
+    if ((fstat(*fd, &st) < 0) || (entry.offset + entry.size > (uint64_t)st.st_size)) {
+        snprintf(log_msg, PATH_MAX - 1, "Tile slice %" PRIu64 "+%u lies outside of pack %s\n", entry.offset, entry.size, ctx->pack_path);
+        close(*fd);
+        *fd = -1;
+        return -7;
+    }
+    *offset = entry.offset;
+    *len = entry.size;
+
+    if (etag) snprintf(etag, TILE_ETAG_MAX, "%016" PRIx64, entry.etag);
+    return 0;
+}
+
+static struct stat_info dedup_tile_stat(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z) {
+    struct dedup_ctx * ctx = (struct dedup_ctx *)(store->storage_ctx);
+    return ctx->records->tile_stat(ctx->records, xmlconfig, options, x, y, z);
+}
+
+static char * dedup_tile_storage_id(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, char * string) {
+    struct dedup_ctx * ctx = (struct dedup_ctx *)(store->storage_ctx);
+    char meta_path[PATH_MAX];
+
+    xyzo_to_meta(meta_path, sizeof(meta_path), ctx->tile_dir, xmlconfig, options, x, y, z);
+    snprintf(string, PATH_MAX - 1, "dedup://%s", meta_path);
+    return string;
+}
+
+static int dedup_metatile_delete(struct storage_backend * store, const char *xmlconfig, int x, int y, int z) {
+    struct dedup_ctx * ctx = (struct dedup_ctx *)(store->storage_ctx);
+    return ctx->records->metatile_delete(ctx->records, xmlconfig, x, y, z);
+}
+
+static int dedup_metatile_expire(struct storage_backend * store, const char *xmlconfig, int x, int y, int z) {
+    struct dedup_ctx * ctx = (struct dedup_ctx *)(store->storage_ctx);
+    return ctx->records->metatile_expire(ctx->records, xmlconfig, x, y, z);
+}
+
+static int dedup_close_storage(struct storage_backend * store) {
+    struct dedup_ctx * ctx = (struct dedup_ctx *)(store->storage_ctx);
+
+    if (ctx->writer) {
+        dedup_writer_put(ctx->writer);
+    }
+    ctx->records->close_storage(ctx->records);
+    free(ctx->records);
+    free(ctx->tile_dir);
+    free(ctx);
+    free(store);
+    return 0;
+}
+
+struct storage_backend * init_storage_dedup(const char * connection_string) {
+    struct storage_backend * store;
+    struct dedup_ctx * ctx;
+    const char * tile_dir = connection_string + strlen("dedup://");
+    struct stat st;
+
+    if ((stat(tile_dir, &st) != 0) || !S_ISDIR(st.st_mode)) {
+        log_message(STORE_LOGLVL_ERR, "init_storage_dedup: %s is not a directory", tile_dir);
+        return NULL;
+    }
+
+    store = malloc(sizeof(struct storage_backend));
+    ctx = calloc(1, sizeof(struct dedup_ctx));
+    if ((store == NULL) || (ctx == NULL)) {
+        log_message(STORE_LOGLVL_ERR, "init_storage_dedup: Failed to allocate memory for storage backend");
+        free(store);
+        free(ctx);
+        return NULL;
+    }
+    ctx->tile_dir = strdup(tile_dir);
+    if (ctx->tile_dir == NULL) {
+        log_message(STORE_LOGLVL_ERR, "init_storage_dedup: Failed to allocate memory for storage backend");
+        free(store);
+        free(ctx);
+        return NULL;
+    }
+    ctx->records = init_storage_file(tile_dir);
+    if (ctx->records == NULL) {
+        free(ctx->tile_dir);
+        free(store);
+        free(ctx);
+        return NULL;
+    }
+    snprintf(ctx->pack_path, sizeof(ctx->pack_path), "%s/%s", tile_dir, DEDUP_PACK);
+    snprintf(ctx->index_path, sizeof(ctx->index_path), "%s/%s", tile_dir, DEDUP_INDEX);
+
+    store->storage_ctx = ctx;
+
+    store->tile_read = &dedup_tile_read;
+    store->tile_read_slice = &dedup_tile_read_slice;
+    store->tile_fetch = &dedup_tile_fetch;
+    store->tile_stat = &dedup_tile_stat;
+    store->metatile_write = &dedup_metatile_write;
+    store->metatile_delete = &dedup_metatile_delete;
+    store->metatile_expire = &dedup_metatile_expire;
+    store->tile_storage_id = &dedup_tile_storage_id;
+    store->close_storage = &dedup_close_storage;
+
+    return store;
+}
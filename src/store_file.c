@@ -27,7 +27,19 @@
 #include "protocol.h"
 
 
-static time_t getPlanetTime(const char * tile_dir, const char * xmlname)
+struct planet_time_entry {
+    char * tile_dir;
+    char xmlname[XMLCONFIG_MAX];
+    time_t planet_time;
+    time_t checked;
+};
+
+/* Shared by all storage backends (and therefore threads) of the process */
+static struct planet_time_entry planet_time_cache[PLANET_TIMESTAMP_CACHE_SIZE];
+static int planet_time_cache_next = 0;
+static pthread_mutex_t planet_time_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t statPlanetTime(const char * tile_dir, const char * xmlname)
 {
     struct stat st_stat;
     char filename[PATH_MAX];
@@ -44,31 +56,136 @@ static time_t getPlanetTime(const char * tile_dir, const char * xmlname)
     return st_stat.st_mtime;
 }
 
-static int file_tile_read(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz, int * compressed, char * log_msg) {
+static struct planet_time_entry * lookupPlanetTime(const char * tile_dir, const char * xmlname)
+{
+    int i;
 
-    char path[PATH_MAX];
-    int meta_offset, fd;
+    for (i = 0; i < PLANET_TIMESTAMP_CACHE_SIZE; i++) {
+        if (planet_time_cache[i].tile_dir && !strcmp(planet_time_cache[i].xmlname, xmlname) && !strcmp(planet_time_cache[i].tile_dir, tile_dir)) {
+            return &(planet_time_cache[i]);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The planet import timestamp only changes once per import, so rather than
+ * stat()ing it for every tile, remember it for PLANET_TIMESTAMP_TTL seconds.
+ * While one thread refreshes an entry, the others keep using the old value.
+ */
+static time_t getPlanetTime(const char * tile_dir, const char * xmlname)
+{
+    struct planet_time_entry * entry;
+    time_t now = time(NULL);
+    time_t planet_time;
+
+    pthread_mutex_lock(&planet_time_lock);
+    entry = lookupPlanetTime(tile_dir, xmlname);
+    if (entry) {
+        planet_time = entry->planet_time;
+        if ((now - entry->checked) < PLANET_TIMESTAMP_TTL) {
+            pthread_mutex_unlock(&planet_time_lock);
+            return planet_time;
+        }
+        entry->checked = now;
+    }
+    pthread_mutex_unlock(&planet_time_lock);
+
+    planet_time = statPlanetTime(tile_dir, xmlname);
+
+    pthread_mutex_lock(&planet_time_lock);
+    // The cache may have changed while we didn't hold the lock, so look up the entry again
+    entry = lookupPlanetTime(tile_dir, xmlname);
+    if (!entry) {
+        entry = &(planet_time_cache[planet_time_cache_next]);
+        planet_time_cache_next = (planet_time_cache_next + 1) % PLANET_TIMESTAMP_CACHE_SIZE;
+        free(entry->tile_dir);
+        entry->tile_dir = strdup(tile_dir);
+        strncpy(entry->xmlname, xmlname, XMLCONFIG_MAX - 1);
+        entry->xmlname[XMLCONFIG_MAX - 1] = 0;
+    }
+    entry->planet_time = planet_time;
+    entry->checked = now;
+    pthread_mutex_unlock(&planet_time_lock);
+
+    return planet_time;
+}
+
+/*
+ * Fill in a stat_info from the result of stat()ing a metatile. st_stat
+ * may be NULL if the metatile does not exist.
+ */
+static void file_stat_info(struct storage_backend * store, const char *xmlconfig, const struct stat * st_stat, struct stat_info * tile_stat) {
+    if (st_stat == NULL) {
+        tile_stat->size = -1;
+        tile_stat->mtime = 0;
+        tile_stat->atime = 0;
+        tile_stat->ctime = 0;
+    } else {
+        tile_stat->size = st_stat->st_size;
+        tile_stat->mtime = st_stat->st_mtime;
+        tile_stat->atime = st_stat->st_atime;
+        tile_stat->ctime = st_stat->st_ctime;
+    }
+
+    if (tile_stat->mtime < getPlanetTime(store->storage_ctx, xmlconfig)) {
+        tile_stat->expired = 1;
+    } else {
+        tile_stat->expired = 0;
+    }
+}
+
+/*
+ * Open the metatile containing x,y,z and locate the tile within it.
+ * On success the open file descriptor is returned in fd and the
+ * position of the tile data within the file in file_offset and
+ * tile_size. The caller is responsible for closing fd.
+ * path needs to be at least PATH_MAX long and receives the metatile path.
+ * If sinfo is not NULL, it is filled in from an fstat of the open metatile
+ * (or marked as missing if the metatile can't be opened).
+ * If etag is not NULL, it receives the ETag stored in the metatile header, if any,
+ * and if format is not NULL the format of the tiles.
+ */
+static int file_tile_locate(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, char * path, int * fd, off_t * file_offset, size_t * tile_size, int * compressed, struct stat_info * sinfo, char * etag, int * format, char * log_msg) {
+
+    int meta_offset;
     unsigned int pos;
     unsigned int header_len = sizeof(struct meta_layout) + METATILE*METATILE*sizeof(struct entry);
-    struct meta_layout *m = (struct meta_layout *)malloc(header_len);
-    size_t file_offset, tile_size;
+    // Read the optional per tile hashes and format along with the header
+    unsigned int read_len = header_len + META_ETAGS_SIZE + META_FORMAT_SIZE;
+    struct meta_layout *m;
+    struct stat st_stat;
 
-    meta_offset = xyzo_to_meta(path, sizeof(path), store->storage_ctx, xmlconfig, options, x, y, z);
+    if (etag) etag[0] = 0;
+    if (format) *format = formatUnknown;
 
-    fd = open(path, O_RDONLY);
-    if (fd < 0) {
+    meta_offset = xyzo_to_meta(path, PATH_MAX, store->storage_ctx, xmlconfig, options, x, y, z);
+
+    *fd = open(path, O_RDONLY);
+    if (*fd < 0) {
         snprintf(log_msg,PATH_MAX - 1, "Could not open metatile %s. Reason: %s\n", path, strerror(errno));
-        free(m);
+        if (sinfo) file_stat_info(store, xmlconfig, NULL, sinfo);
         return -1;
     }
 
+    if (sinfo) {
+        if (fstat(*fd, &st_stat) < 0) {
+            snprintf(log_msg,PATH_MAX - 1, "Could not stat metatile %s. Reason: %s\n", path, strerror(errno));
+            file_stat_info(store, xmlconfig, NULL, sinfo);
+            close(*fd);
+            return -1;
+        }
+        file_stat_info(store, xmlconfig, &st_stat, sinfo);
+    }
+
+    m = (struct meta_layout *)malloc(read_len);
     pos = 0;
-    while (pos < header_len) {
-        size_t len = header_len - pos;
-        int got = read(fd, ((unsigned char *) m) + pos, len);
+    while (pos < read_len) {
+        size_t len = read_len - pos;
+        int got = pread(*fd, ((unsigned char *) m) + pos, len, pos);
         if (got < 0) {
             snprintf(log_msg,PATH_MAX - 1, "Failed to read complete header for metatile %s Reason: %s\n", path, strerror(errno));
-            close(fd);
+            close(*fd);
             free(m);
             return -2;
         } else if (got > 0) {
@@ -79,14 +196,14 @@ static int file_tile_read(struct storage_backend * store, const char *xmlconfig,
     }
     if (pos < header_len) {
         snprintf(log_msg,PATH_MAX - 1, "Meta file %s too small to contain header\n", path);
-        close(fd);
+        close(*fd);
         free(m);
         return -3;
     }
     if (memcmp(m->magic, META_MAGIC, strlen(META_MAGIC))) {
         if (memcmp(m->magic, META_MAGIC_COMPRESSED, strlen(META_MAGIC_COMPRESSED))) {
             snprintf(log_msg,PATH_MAX - 1, "Meta file %s header magic mismatch\n", path);
-            close(fd);
+            close(*fd);
             free(m);
             return -4;
         } else {
@@ -98,32 +215,37 @@ static int file_tile_read(struct storage_backend * store, const char *xmlconfig,
     if (m->count != (METATILE * METATILE)) {
         snprintf(log_msg, PATH_MAX - 1, "Meta file %s header bad count %d != %d\n", path, m->count, METATILE * METATILE);
         free(m);
-        close(fd);
+        close(*fd);
         return -5;
     }
 
-    file_offset = m->index[meta_offset].offset;
-    tile_size   = m->index[meta_offset].size;
+    *file_offset = m->index[meta_offset].offset;
+    *tile_size   = m->index[meta_offset].size;
+
+    if (etag) metatile_etag((char *)m, pos, meta_offset, etag);
+    if (format) *format = metatile_format((char *)m, pos);
 
     free(m);
+    return 0;
+}
+
+/*
+ * Copy tile_size bytes at file_offset of the open metatile into buf
+ * and close the metatile.
+ */
+static int file_tile_copy(int fd, const char * path, off_t file_offset, size_t tile_size, char *buf, size_t sz, char * log_msg) {
+    unsigned int pos;
 
     if (tile_size > sz) {
         snprintf(log_msg, PATH_MAX - 1, "Truncating tile %zd to fit buffer of %zd\n", tile_size, sz);
-        tile_size = sz;
         close(fd);
         return -6;
     }
 
-    if (lseek(fd, file_offset, SEEK_SET) < 0) {
-        snprintf(log_msg, PATH_MAX - 1, "Meta file %s seek error: %s\n", path, strerror(errno));
-        close(fd);
-        return -7;
-    }
-    
     pos = 0;
     while (pos < tile_size) {
         size_t len = tile_size - pos;
-        int got = read(fd, buf + pos, len);
+        int got = pread(fd, buf + pos, len, file_offset + pos);
         if (got < 0) {
             snprintf(log_msg, PATH_MAX - 1, "Failed to read data from file %s. Reason: %s\n", path, strerror(errno));
             close(fd);
@@ -138,6 +260,58 @@ static int file_tile_read(struct storage_backend * store, const char *xmlconfig,
     return pos;
 }
 
+/*
+ * Stat and read the tile in one pass over the open metatile, rather than
+ * a separate stat() followed by open() and read() of the same file.
+ * sinfo, etag and format may be NULL if the caller is only interested in the tile data.
+ */
+static int file_tile_fetch(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz, int * compressed, struct stat_info * sinfo, char * etag, int * format, char * log_msg) {
+
+    char path[PATH_MAX];
+    int fd, res;
+    off_t file_offset;
+    size_t tile_size;
+
+    res = file_tile_locate(store, xmlconfig, options, x, y, z, path, &fd, &file_offset, &tile_size, compressed, sinfo, etag, format, log_msg);
+    if (res < 0) {
+        return res;
+    }
+
+    return file_tile_copy(fd, path, file_offset, tile_size, buf, sz, log_msg);
+}
+
+static int file_tile_read(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz, int * compressed, char * log_msg) {
+    return file_tile_fetch(store, xmlconfig, options, x, y, z, buf, sz, compressed, NULL, NULL, NULL, log_msg);
+}
+
+/*
+ * Rather than copying the tile out of the metatile, hand back the open
+ * metatile together with the byte range of the tile, so that the caller
+ * can send it straight from the page cache (e.g. via sendfile).
+ */
+static int file_tile_read_slice(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, int * fd, off_t * offset, size_t * len, int * compressed, struct stat_info * sinfo, char * etag, int * format, char * log_msg) {
+    char path[PATH_MAX];
+    int res;
+    struct stat_info tile_stat;
+
+    res = file_tile_locate(store, xmlconfig, options, x, y, z, path, fd, offset, len, compressed, &tile_stat, etag, format, log_msg);
+    if (sinfo) *sinfo = tile_stat;
+    if (res < 0) {
+        *fd = -1;
+        return res;
+    }
+
+    // Make sure a truncated metatile can't make us send less than we announced
+    if (*offset < 0 || *offset + (off_t)*len > tile_stat.size) {
+        snprintf(log_msg, PATH_MAX - 1, "Tile slice %li+%zd lies outside of metatile %s\n", (long)*offset, *len, path);
+        close(*fd);
+        *fd = -1;
+        return -7;
+    }
+
+    return 0;
+}
+
 static struct stat_info file_tile_stat(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z) {
     struct stat_info tile_stat;
     struct stat st_stat;
@@ -146,21 +320,9 @@ static struct stat_info file_tile_stat(struct storage_backend * store, const cha
     xyzo_to_meta(meta_path, sizeof(meta_path), (char *)(store->storage_ctx), xmlconfig, options, x, y, z);
     
     if (stat(meta_path, &st_stat)) {
-        tile_stat.size = -1;
-        tile_stat.mtime = 0;
-        tile_stat.atime = 0;
-        tile_stat.ctime = 0;
-    } else {
-        tile_stat.size = st_stat.st_size;
-        tile_stat.mtime = st_stat.st_mtime;
-        tile_stat.atime = st_stat.st_atime;
-        tile_stat.ctime = st_stat.st_ctime;
-    }
-
-    if (tile_stat.mtime < getPlanetTime(store->storage_ctx, xmlconfig)) {
-        tile_stat.expired = 1;
+        file_stat_info(store, xmlconfig, NULL, &tile_stat);
     } else {
-        tile_stat.expired = 0;
+        file_stat_info(store, xmlconfig, &st_stat, &tile_stat);
     }
 
     return tile_stat;
@@ -273,6 +435,8 @@ struct storage_backend * init_storage_file(const char * tile_dir) {
     store->storage_ctx = strdup(tile_dir);
 
     store->tile_read = &file_tile_read;
+    store->tile_read_slice = &file_tile_read_slice;
+    store->tile_fetch = &file_tile_fetch;
     store->tile_stat = &file_tile_stat;
     store->metatile_write = &file_metatile_write;
     store->metatile_delete = &file_metatile_delete;
@@ -46,12 +46,17 @@ static char * memcached_xyz_to_storagekey(const char *xmlconfig, int x, int y, i
     return memcached_xyzo_to_storagekey(xmlconfig, "", x, y, z, key);
 }
 
-static int memcached_tile_read(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz, int * compressed, char * log_msg) {
+/*
+ * The stat_info is stored in front of the metatile, so a single get
+ * returns everything needed to answer both tile_stat and tile_read.
+ * sinfo, etag and format may be NULL if the caller is only interested in the tile data.
+ */
+static int memcached_tile_fetch(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz, int * compressed, struct stat_info * sinfo, char * etag, int * format, char * log_msg) {
 
     char meta_path[PATH_MAX];
     int meta_offset;
     unsigned int header_len = sizeof(struct meta_layout) + METATILE*METATILE*sizeof(struct entry);
-    struct meta_layout *m = (struct meta_layout *)malloc(header_len);
+    struct meta_layout *m;
     size_t file_offset, tile_size;
     int mask;
     uint32_t flags;
@@ -62,20 +67,35 @@ static int memcached_tile_read(struct storage_backend * store, const char *xmlco
     mask = METATILE - 1;
     meta_offset = (x & mask) * METATILE + (y & mask);
 
+    if (etag) etag[0] = 0;
+    if (format) *format = formatUnknown;
+
     memcached_xyzo_to_storagekey(xmlconfig, options, x, y, z, meta_path);
     buf_raw = memcached_get(store->storage_ctx, meta_path, strlen(meta_path), &len, &flags, &rc);
 
-    if (rc != MEMCACHED_SUCCESS) {
-        free(m);
+    if ((rc != MEMCACHED_SUCCESS) || (len < sizeof(struct stat_info) + header_len)) {
+        if (sinfo) {
+            sinfo->size = -1;
+            sinfo->expired = 0;
+            sinfo->mtime = 0;
+            sinfo->atime = 0;
+            sinfo->ctime = 0;
+        }
+        free(buf_raw);
         return -1;
     }
 
-    memcpy(m, buf_raw + sizeof(struct stat_info), header_len);
+    m = (struct meta_layout *)(buf_raw + sizeof(struct stat_info));
+
+    if (sinfo) {
+        memcpy(sinfo, buf_raw, sizeof(struct stat_info));
+        sinfo->size = m->index[meta_offset].size;
+    }
 
     if (memcmp(m->magic, META_MAGIC, strlen(META_MAGIC))) {
         if (memcmp(m->magic, META_MAGIC_COMPRESSED, strlen(META_MAGIC_COMPRESSED))) {
             snprintf(log_msg,1024, "Meta file header magic mismatch\n");
-            free(m);
+            free(buf_raw);
             return -4;
         } else {
             *compressed = 1;
@@ -85,26 +105,37 @@ static int memcached_tile_read(struct storage_backend * store, const char *xmlco
     // Currently this code only works with fixed metatile sizes (due to xyz_to_meta above)
     if (m->count != (METATILE * METATILE)) {
         snprintf(log_msg, 1024, "Meta file header bad count %d != %d\n", m->count, METATILE * METATILE);
-        free(m);
+        free(buf_raw);
         return -5;
     }
 
     file_offset = m->index[meta_offset].offset + sizeof(struct stat_info);
     tile_size   = m->index[meta_offset].size;
 
-    free(m);
+    if (etag) metatile_etag((char *)m, len - sizeof(struct stat_info), meta_offset, etag);
+    if (format) *format = metatile_format((char *)m, len - sizeof(struct stat_info));
 
     if (tile_size > sz) {
         snprintf(log_msg, 1024, "Truncating tile %zd to fit buffer of %zd\n", tile_size, sz);
-        tile_size = sz;
+        free(buf_raw);
         return -6;
     }
 
+    if (file_offset + tile_size > len) {
+        snprintf(log_msg, 1024, "Tile data lies outside of metatile %s\n", meta_path);
+        free(buf_raw);
+        return -7;
+    }
+
     memcpy(buf, buf_raw + file_offset, tile_size);
     free(buf_raw);
     return tile_size;
 }
 
+static int memcached_tile_read(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz, int * compressed, char * log_msg) {
+    return memcached_tile_fetch(store, xmlconfig, options, x, y, z, buf, sz, compressed, NULL, NULL, NULL, log_msg);
+}
+
 static struct stat_info memcached_tile_stat(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z) {
     struct stat_info tile_stat;
     char meta_path[PATH_MAX];
@@ -260,6 +291,8 @@ struct storage_backend * init_storage_memcached(const char * connection_string)
     store->storage_ctx = ctx;
 
     store->tile_read = &memcached_tile_read;
+    store->tile_read_slice = NULL;
+    store->tile_fetch = &memcached_tile_fetch;
     store->tile_stat = &memcached_tile_stat;
     store->metatile_write = &memcached_metatile_write;
     store->metatile_delete = &memcached_metatile_delete;
@@ -14,6 +14,23 @@ static int tile_read(struct storage_backend * store,
    return -1;
 }
 
+static int tile_fetch(struct storage_backend * store,
+		     const char *xmlconfig,
+             const char *options,
+		     int x, int y, int z,
+		     char *buf, size_t sz,
+		     int * compressed, struct stat_info * sinfo, char * etag, int * format, char * err_msg) {
+   if (etag) etag[0] = 0;
+   if (format) *format = formatUnknown;
+   sinfo->size = -1;
+   sinfo->atime = 0;
+   sinfo->mtime = 0;
+   sinfo->ctime = 0;
+   sinfo->expired = 1;
+   snprintf(err_msg, PATH_MAX - 1, "Cannot read from NULL storage.");
+   return -1;
+}
+
 static struct stat_info tile_stat(struct storage_backend * store, 
 				  const char *xmlconfig, 
                   const char *options,
@@ -70,6 +87,8 @@ struct storage_backend *init_storage_null() {
 
    store->storage_ctx = NULL;
    store->tile_read = &tile_read;
+   store->tile_read_slice = NULL;
+   store->tile_fetch = &tile_fetch;
    store->tile_stat = &tile_stat;
    store->metatile_write = &metatile_write;
    store->metatile_delete = &metatile_delete;
@@ -66,7 +66,8 @@ static char * read_meta_data(struct storage_backend * store, const char *xmlconf
     int err;
     char meta_path[PATH_MAX];
     struct rados_ctx * ctx = (struct rados_ctx *)store->storage_ctx;
-    unsigned int header_len = sizeof(struct stat_info) + sizeof(struct meta_layout) + METATILE*METATILE*sizeof(struct entry);
+    // Include the optional per tile hashes and format following the index
+    unsigned int header_len = sizeof(struct stat_info) + sizeof(struct meta_layout) + METATILE*METATILE*sizeof(struct entry) + META_ETAGS_SIZE + META_FORMAT_SIZE;
 
     mask = METATILE - 1;
     x &= ~mask;
@@ -163,6 +164,125 @@ static int rados_tile_read(struct storage_backend * store, const char *xmlconfig
     return tile_size;
 }
 
+/*
+ * Return stat info and tile data in a single round-trip to the cluster. If the
+ * metadata of the metatile is already cached only the tile data is read, otherwise
+ * the metadata and the beginning of the metatile (up to sz bytes of tile data) are
+ * read in one go and the metadata cache is refreshed from it.
+ */
+static int rados_tile_fetch(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz, int * compressed, struct stat_info * sinfo, char * etag, int * format, char * log_msg) {
+
+    char meta_path[PATH_MAX];
+    struct rados_ctx * ctx = (struct rados_ctx *)store->storage_ctx;
+    unsigned int header_len = sizeof(struct stat_info) + sizeof(struct meta_layout) + METATILE*METATILE*sizeof(struct entry);
+    unsigned int cache_len = header_len + META_ETAGS_SIZE + META_FORMAT_SIZE;
+    struct meta_layout *m;
+    size_t file_offset, tile_size;
+    int meta_offset, mask;
+    int err;
+    int raw_len = 0;
+    unsigned int meta_len = cache_len;
+    char * buf_raw = NULL;
+    char * meta;
+
+    mask = METATILE - 1;
+    meta_offset = (x & mask) * METATILE + (y & mask);
+
+    rados_xyzo_to_storagekey(xmlconfig, options, x, y, z, meta_path);
+
+    if ((ctx->metadata_cache.x == (x & ~mask)) && (ctx->metadata_cache.y == (y & ~mask)) && (ctx->metadata_cache.z == z) && (strcmp(ctx->metadata_cache.xmlname, xmlconfig) == 0)) {
+        meta = ctx->metadata_cache.data;
+    } else {
+        buf_raw = malloc(cache_len + sz);
+        if (buf_raw == NULL) {
+            snprintf(log_msg, 1024, "Failed to allocate memory to read metatile\n");
+            return -2;
+        }
+        raw_len = rados_read(ctx->io, meta_path, buf_raw, cache_len + sz, 0);
+        if (raw_len < (int)header_len) {
+            if (raw_len < 0) {
+                snprintf(log_msg, 1024, "cannot read data from rados pool %s: %s\n", ctx->pool, strerror(-raw_len));
+            } else {
+                snprintf(log_msg, 1024, "Meta file %s too small to contain header\n", meta_path);
+            }
+            if (sinfo) {
+                sinfo->size = -1;
+                sinfo->expired = 0;
+                sinfo->mtime = 0;
+                sinfo->atime = 0;
+                sinfo->ctime = 0;
+            }
+            ctx->metadata_cache.x = -1;
+            ctx->metadata_cache.y = -1;
+            ctx->metadata_cache.z = -1;
+            free(buf_raw);
+            return -3;
+        }
+        memcpy(ctx->metadata_cache.data, buf_raw, cache_len);
+        ctx->metadata_cache.x = x & ~mask;
+        ctx->metadata_cache.y = y & ~mask;
+        ctx->metadata_cache.z = z;
+        strncpy(ctx->metadata_cache.xmlname, xmlconfig, XMLCONFIG_MAX - 1);
+        meta = buf_raw;
+        meta_len = MIN((unsigned int)raw_len, cache_len);
+    }
+
+    m = (struct meta_layout *)(meta + sizeof(struct stat_info));
+
+    if (sinfo) {
+        memcpy(sinfo, meta, sizeof(struct stat_info));
+        sinfo->size = m->index[meta_offset].size;
+    }
+    if (etag) {
+        metatile_etag((char *)m, meta_len - sizeof(struct stat_info), meta_offset, etag);
+    }
+    if (format) {
+        *format = metatile_format((char *)m, meta_len - sizeof(struct stat_info));
+    }
+
+    if (memcmp(m->magic, META_MAGIC, strlen(META_MAGIC))) {
+        if (memcmp(m->magic, META_MAGIC_COMPRESSED, strlen(META_MAGIC_COMPRESSED))) {
+            snprintf(log_msg,1024, "Meta file header magic mismatch\n");
+            free(buf_raw);
+            return -4;
+        } else {
+            *compressed = 1;
+        }
+    } else *compressed = 0;
+
+    // Currently this code only works with fixed metatile sizes (due to xyz_to_meta above)
+    if (m->count != (METATILE * METATILE)) {
+        snprintf(log_msg, 1024, "Meta file header bad count %d != %d\n", m->count, METATILE * METATILE);
+        free(buf_raw);
+        return -5;
+    }
+
+    file_offset = m->index[meta_offset].offset + sizeof(struct stat_info);
+    tile_size   = m->index[meta_offset].size;
+
+    if (tile_size > sz) {
+        snprintf(log_msg, 1024, "Truncating tile %zd to fit buffer of %zd\n", tile_size, sz);
+        free(buf_raw);
+        return -6;
+    }
+
+    if (buf_raw && (file_offset + tile_size <= raw_len)) {
+        memcpy(buf, buf_raw + file_offset, tile_size);
+        free(buf_raw);
+        return tile_size;
+    }
+    free(buf_raw);
+
+    err = rados_read(ctx->io, meta_path, buf, tile_size, file_offset);
+
+    if (err < 0) {
+        snprintf(log_msg, 1024, "Failed to read tile data from rados %s offset: %li length: %li: %s\n", meta_path, file_offset, tile_size, strerror(-err));
+        return -1;
+    }
+
+    return tile_size;
+}
+
 static struct stat_info rados_tile_stat(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z) {
     struct stat_info tile_stat;
     char * buf;
@@ -361,7 +481,7 @@ struct storage_backend * init_storage_rados(const char * connection_string) {
 
     log_message(STORE_LOGLVL_DEBUG,"init_storage_rados: Initialised rados backend for pool %s with config %s", ctx->pool, conf);
 
-    ctx->metadata_cache.data = malloc(sizeof(struct stat_info) + sizeof(struct meta_layout) + METATILE*METATILE*sizeof(struct entry));
+    ctx->metadata_cache.data = malloc(sizeof(struct stat_info) + sizeof(struct meta_layout) + METATILE*METATILE*sizeof(struct entry) + META_ETAGS_SIZE + META_FORMAT_SIZE);
     if (ctx->metadata_cache.data == NULL) {
         rados_ioctx_destroy(ctx->io);
         rados_shutdown(ctx->cluster);
@@ -381,6 +501,8 @@ struct storage_backend * init_storage_rados(const char * connection_string) {
     store->storage_ctx = ctx;
 
     store->tile_read = &rados_tile_read;
+    store->tile_read_slice = NULL;
+    store->tile_fetch = &rados_tile_fetch;
     store->tile_stat = &rados_tile_stat;
     store->metatile_write = &rados_metatile_write;
     store->metatile_delete = &rados_metatile_delete;
@@ -75,15 +75,28 @@ static cairo_status_t read_png_stream_from_byte_array (void *in_closure, unsigne
 }
 
 
-static int ro_composite_tile_read(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz, int * compressed, char * log_msg) {
+/*
+ * The stat info of a composite tile is that of the primary backend, so use
+ * its tile_fetch to get the stat info along with the primary tile data.
+ */
+static int ro_composite_tile_fetch(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz, int * compressed, struct stat_info * sinfo, char * etag, int * format, char * log_msg) {
     struct ro_composite_ctx * ctx = (struct ro_composite_ctx *)(store->storage_ctx);
     cairo_surface_t *imageA;
     cairo_surface_t *imageB;
     cairo_surface_t *imageC;
     cairo_t *cr;
     png_stream_to_byte_array_closure_t closure;
+    struct stat_info tile_stat;
+    int res;
+
+    // The composited tile differs from the stored ones, so none of their ETags apply
+    if (etag) etag[0] = 0;
+    // Whatever the backends hold, the composited tile is written as png
+    if (format) *format = formatPng;
 
-    if(ctx->store_primary->tile_read(ctx->store_primary, ctx->xmlconfig_primary, options, x, y, z, buf, sz, compressed, log_msg) < 0) {
+    res = ctx->store_primary->tile_fetch(ctx->store_primary, ctx->xmlconfig_primary, options, x, y, z, buf, sz, compressed, &tile_stat, NULL, NULL, log_msg);
+    if (sinfo) *sinfo = tile_stat;
+    if (res < 0) {
         snprintf(log_msg,1024, "ro_composite_tile_read: Failed to read tile data of primary backend\n");
         return -1;
     }
@@ -140,6 +153,10 @@ static int ro_composite_tile_read(struct storage_backend * store, const char *xm
     return closure.pos;
 }
 
+static int ro_composite_tile_read(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz, int * compressed, char * log_msg) {
+    return ro_composite_tile_fetch(store, xmlconfig, options, x, y, z, buf, sz, compressed, NULL, NULL, NULL, log_msg);
+}
+
 static struct stat_info ro_composite_tile_stat(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z) {
     struct ro_composite_ctx * ctx = (struct ro_composite_ctx *)(store->storage_ctx);
     return ctx->store_primary->tile_stat(ctx->store_primary,ctx->xmlconfig_primary, options, x, y, z);
@@ -242,6 +259,8 @@ struct storage_backend * init_storage_ro_composite(const char * connection_strin
     store->storage_ctx = ctx;
 
     store->tile_read = &ro_composite_tile_read;
+    store->tile_read_slice = NULL;
+    store->tile_fetch = &ro_composite_tile_fetch;
     store->tile_stat = &ro_composite_tile_stat;
     store->metatile_write = &ro_composite_metatile_write;
     store->metatile_delete = &ro_composite_metatile_delete;
@@ -146,6 +146,31 @@ static int ro_http_proxy_tile_read(struct storage_backend * store, const char *x
     }
 }
 
+static int ro_http_proxy_tile_fetch(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z, char *buf, size_t sz, int * compressed, struct stat_info * sinfo, char * etag, int * format, char * log_msg) {
+    struct ro_http_proxy_ctx * ctx = (struct ro_http_proxy_ctx *)(store->storage_ctx);
+
+    if (etag) etag[0] = 0;
+    if (format) *format = formatUnknown;
+
+    if (ro_http_proxy_tile_retrieve(store, xmlconfig, options, x, y, z) > 0) {
+        *sinfo = ctx->cache.st_stat;
+        if (ctx->cache.st_stat.size > sz) {
+            log_message(STORE_LOGLVL_ERR, "ro_http_proxy_tile_fetch: size was too big, overrun %i %i", sz, ctx->cache.st_stat.size);
+            return -1;
+        }
+        memcpy(buf, ctx->cache.tile, ctx->cache.st_stat.size);
+        return ctx->cache.st_stat.size;
+    } else {
+        log_message(STORE_LOGLVL_ERR, "ro_http_proxy_tile_fetch: Fetching didn't work");
+        sinfo->size = -1;
+        sinfo->expired = 0;
+        sinfo->mtime = 0;
+        sinfo->atime = 0;
+        sinfo->ctime = 0;
+        return -1;
+    }
+}
+
 static struct stat_info ro_http_proxy_tile_stat(struct storage_backend * store, const char *xmlconfig, const char *options, int x, int y, int z) {
     struct stat_info tile_stat;
     struct ro_http_proxy_ctx * ctx = (struct ro_http_proxy_ctx *)(store->storage_ctx);
@@ -259,6 +284,8 @@ struct storage_backend * init_storage_ro_http_proxy(const char * connection_stri
     store->storage_ctx = ctx;
 
     store->tile_read = &ro_http_proxy_tile_read;
+    store->tile_read_slice = NULL;
+    store->tile_fetch = &ro_http_proxy_tile_fetch;
     store->tile_stat = &ro_http_proxy_tile_stat;
     store->metatile_write = &ro_http_proxy_metatile_write;
     store->metatile_delete = &ro_http_proxy_metatile_delete;